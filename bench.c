@@ -0,0 +1,909 @@
+#include <string.h>
+#include <time.h>
+#include <fcntl.h> // For open()
+#include <unistd.h> // For fork(), unlink()
+#include <sys/resource.h> // For getrusage()
+#include <sys/wait.h> // For waitpid()
+#include <malloc.h> // For mallinfo2()
+#include <zlib.h> // For gzdopen()
+#include "markov_chain.h"
+#include "corpus_reader.h"
+#include "tweets_generator.h"
+#include "snakes_and_ladders.h"
+#include "chain_analytics.h"
+#include "walk_simulation.h"
+
+#define BENCH_SEED 1234
+#define VOCABULARY_SIZE 50000
+#define HUB_COUNT 3
+#define BIGRAM_UPDATES 2000000
+#define SAMPLES 2000000
+#define LOOKUPS 2000000
+#define TWEETS 200000
+#define BYTES_IN_KB 1024
+#define GAMES 100000
+#define BOARD_SOLVES 1000
+#define BOARD_STEPS 100000
+#define BOARD_WALKS 1000000
+#define LARGE_BOARD_CELLS 1000000
+#define RNG_DRAWS 20000000
+// drawn at a time by the batch benchmarks, and the bound of every draw
+#define RNG_BATCH_SIZE 1024
+#define RNG_BOUND 6
+#define NS_IN_SEC 1000000000.0
+#define BENCH_CORPUS "justdoit_tweets.txt"
+#define SYNTHETIC_TEMPLATE "/tmp/markov_bench_XXXXXX"
+#define DEFAULT_MAX_SCALE 1000
+#define SCALE_STEP 10
+#define MAX_SCALE_ARG 1
+#define DECIMAL 10
+// runs shorter than this are repeated, so small corpora still give
+// stable numbers
+#define MIN_BENCH_SEC 0.5
+// a prime, so lookups hop around the database instead of walking it
+#define LOOKUP_STRIDE 7919
+#define OUTPUT_FLUSH_SIZE (64 * 1024)
+// copies of the sample corpus with their own renamed words, past this
+// the synthetic corpora grow in counts only, keeping x1000 in memory
+#define SYNTHETIC_VOCABULARY_COPIES 100
+
+/**
+ * Benchmarks for the hot paths of the markov chain, on the sample corpus
+ * and on synthetic corpora scaled up from it. Every result is printed as
+ * one line of "name ns/op ops/sec peak_rss". Every group of benchmarks
+ * runs in its own process, so peak_rss is the peak of that group only.
+ *
+ * Usage: markov_bench [max_scale]
+ */
+
+static const char *hub_words[HUB_COUNT] = {"#justdoit", "the", "nike"};
+
+static char *copy_str (void *data)
+{
+  char *copy = malloc (strlen (data) + 1);
+  if (copy)
+  {
+    strcpy (copy, data);
+  }
+  return copy;
+}
+
+static size_t hash_str (void *data)
+{
+  size_t hash = 2166136261u;
+  for (unsigned char *c = data; *c != '\0'; c++)
+  {
+    hash ^= *c;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static bool never_last (void *data)
+{
+  (void) data;
+  return false;
+}
+
+static double now_sec (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / NS_IN_SEC;
+}
+
+static void report (const char *name, size_t ops, double seconds)
+{
+  struct rusage usage;
+  getrusage (RUSAGE_SELF, &usage);
+  printf ("%-28s %10.1f ns/op %14.0f ops/sec %10ld KB peak_rss\n", name,
+          seconds * NS_IN_SEC / (double) ops, (double) ops / seconds,
+          usage.ru_maxrss);
+  fflush (stdout);
+}
+
+static void report_scaled (const char *name, int scale, size_t ops,
+                           double seconds)
+{
+  char scaled_name[MAX_WORD_LEN];
+  snprintf (scaled_name, sizeof (scaled_name), "%s_x%d", name, scale);
+  report (scaled_name, ops, seconds);
+}
+
+static MarkovChain *create_string_chain (void)
+{
+  MarkovChain *chain = calloc (1, sizeof (MarkovChain));
+  if (!chain)
+  {
+    return NULL;
+  }
+  chain->database = calloc (1, sizeof (LinkedList));
+  if (!chain->database)
+  {
+    free (chain);
+    return NULL;
+  }
+  chain->comp_func = (comp_function) &strcmp;
+  chain->hash_func = (hash_function) &hash_str;
+  chain->copy_func = (copy_function) &copy_str;
+  chain->free_data = (free_function) &free;
+  chain->is_last = (is_last_function) &never_last;
+  return chain;
+}
+
+/**
+ * Hub heavy corpus: every other token is one of a few hub words, the
+ * rest are drawn from a large vocabulary, so every bigram update lands
+ * on a state with tens of thousands of successors.
+ */
+static int bench_hub_bigrams (void)
+{
+  MarkovChain *chain = create_string_chain ();
+  if (!chain)
+  {
+    return EXIT_FAILURE;
+  }
+  MarkovNode **hubs = malloc (HUB_COUNT * sizeof (MarkovNode *));
+  MarkovNode **words = malloc (VOCABULARY_SIZE * sizeof (MarkovNode *));
+  if (!hubs || !words)
+  {
+    free (hubs);
+    free (words);
+    free_database (&chain);
+    return EXIT_FAILURE;
+  }
+  char word[MAX_WORD_LEN];
+  for (int i = 0; i < HUB_COUNT; i++)
+  {
+    hubs[i] = add_to_database (chain, (void *) hub_words[i])->data;
+  }
+  for (int i = 0; i < VOCABULARY_SIZE; i++)
+  {
+    sprintf (word, "word%d", i);
+    words[i] = add_to_database (chain, word)->data;
+  }
+  markov_rng_seed_default (BENCH_SEED);
+  double start = now_sec ();
+  for (int i = 0; i < BIGRAM_UPDATES; i += 2)
+  {
+    MarkovNode *hub = hubs[get_random_number (HUB_COUNT)];
+    MarkovNode *other = words[get_random_number (VOCABULARY_SIZE)];
+    add_node_to_frequencies_list (hub, other, chain);
+    add_node_to_frequencies_list (other, hub, chain);
+  }
+  report ("bigram_update_hub_heavy", BIGRAM_UPDATES, now_sec () - start);
+  build_samplers (chain);
+  start = now_sec ();
+  for (int i = 0; i < SAMPLES; i++)
+  {
+    get_next_random_node (hubs[i % HUB_COUNT]);
+  }
+  report ("next_random_node_hub", SAMPLES, now_sec () - start);
+  free (hubs);
+  free (words);
+  free_database (&chain);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * State of writing one copy of the sample corpus to a synthetic one.
+ */
+typedef struct SyntheticCopy
+{
+    FILE *out;
+    int copy;
+    bool first;
+} SyntheticCopy;
+
+/**
+ * Write the token to the synthetic corpus. In every copy but the first,
+ * #hashtags and @mentions get the copy number appended (up to
+ * SYNTHETIC_VOCABULARY_COPIES), so the vocabulary grows with the corpus
+ * like it does in a real feed.
+ */
+static bool write_synthetic_token (const char *token, size_t len,
+                                   bool line_start, bool ends_sentence,
+                                   void *context)
+{
+  SyntheticCopy *state = context;
+  if (!state->first)
+  {
+    fputc (line_start ? '\n' : ' ', state->out);
+  }
+  state->first = false;
+  fwrite (token, 1, len, state->out);
+  int rename = state->copy % SYNTHETIC_VOCABULARY_COPIES;
+  if (rename > 0 && (token[0] == '#' || token[0] == '@') && !ends_sentence)
+  {
+    fprintf (state->out, "~%d", rename);
+  }
+  return true;
+}
+
+/**
+ * Write scale copies of the sample corpus to a new temporary file.
+ * @param path filled with the file's path, to be unlinked by the caller
+ * @return true on success.
+ */
+static bool write_synthetic_corpus (const Corpus *sample, int scale,
+                                    char *path)
+{
+  strcpy (path, SYNTHETIC_TEMPLATE);
+  int fd = mkstemp (path);
+  FILE *out = fd < 0 ? NULL : fdopen (fd, "w");
+  if (!out)
+  {
+    return false;
+  }
+  for (int copy = 0; copy < scale; copy++)
+  {
+    SyntheticCopy state = {out, copy, true};
+    tokenize_corpus (sample->data, sample->len, &write_synthetic_token,
+                     &state);
+    fputc ('\n', out);
+  }
+  return fclose (out) == 0;
+}
+
+static bool count_token (const char *token, size_t len, bool line_start,
+                         bool ends_sentence, void *context)
+{
+  (void) token;
+  (void) len;
+  (void) line_start;
+  (void) ends_sentence;
+  (*(size_t *) context)++;
+  return true;
+}
+
+/**
+ * Tokenize the corpus with every tokenizer the CPU supports, reporting
+ * the time per byte, then go back to the automatic choice.
+ */
+static void bench_tokenize (const Corpus *corpus, int scale)
+{
+  const char *names[] = {"tokenize_scalar", "tokenize_sse2",
+                         "tokenize_avx2"};
+  const TokenizerKind kinds[] = {TOKENIZER_SCALAR, TOKENIZER_SSE2,
+                                 TOKENIZER_AVX2};
+  for (size_t i = 0; i < sizeof (kinds) / sizeof (kinds[0]); i++)
+  {
+    if (!tokenizer_select (kinds[i]))
+    {
+      continue;
+    }
+    size_t words = 0, ops = 0;
+    double start = now_sec ();
+    while (now_sec () - start < MIN_BENCH_SEC)
+    {
+      tokenize_mapped_corpus (corpus, &count_token, &words);
+      ops += corpus->len;
+    }
+    report_scaled (names[i], scale, ops, now_sec () - start);
+  }
+  tokenizer_select (TOKENIZER_AUTO);
+}
+
+/**
+ * Compress the corpus into a gzip file and tokenize it back through
+ * tokenize_stream, reporting the time per byte of text.
+ * @return false if the gzip file couldn't be written or read.
+ */
+static bool bench_tokenize_stream (const Corpus *corpus, int scale)
+{
+  char path[sizeof (SYNTHETIC_TEMPLATE)];
+  strcpy (path, SYNTHETIC_TEMPLATE);
+  int fd = mkstemp (path);
+  gzFile out = fd < 0 ? NULL : gzdopen (fd, "wb");
+  bool written = out && gzwrite (out, corpus->data, (unsigned) corpus->len)
+                        == (int) corpus->len;
+  written = out && gzclose (out) == Z_OK && written;
+  size_t words = 0, ops = 0;
+  double start = now_sec ();
+  while (written && now_sec () - start < MIN_BENCH_SEC)
+  {
+    CorpusStream stream = {0, 0, false, false};
+    fd = open (path, O_RDONLY);
+    written = fd >= 0 && tokenize_stream (fd, &count_token, &words,
+                                          &stream);
+    ops += stream.bytes;
+    if (fd >= 0)
+    {
+      close (fd);
+    }
+  }
+  unlink (path);
+  if (written)
+  {
+    report_scaled ("tokenize_stream_gzip", scale, ops, now_sec () - start);
+  }
+  return written;
+}
+
+/**
+ * Train chains on the corpus until MIN_BENCH_SEC passed.
+ * @return the last trained chain, NULL on failure.
+ */
+static MarkovChain *bench_fill_database (const Corpus *corpus, int scale)
+{
+  size_t words = 0;
+  tokenize_mapped_corpus (corpus, &count_token, &words);
+  MarkovChain *chain = NULL;
+  size_t ops = 0, frees = 0;
+  double elapsed = 0, free_elapsed = 0;
+  while (elapsed < MIN_BENCH_SEC)
+  {
+    if (chain)
+    {
+      double start = now_sec ();
+      free_database (&chain);
+      free_elapsed += now_sec () - start;
+      frees++;
+    }
+    chain = create_chain (1);
+    if (!chain)
+    {
+      return NULL;
+    }
+    double start = now_sec ();
+    if (fill_database (corpus, -1, chain) == EXIT_FAILURE ||
+        !build_samplers (chain))
+    {
+      free_database (&chain);
+      return NULL;
+    }
+    elapsed += now_sec () - start;
+    ops += words;
+  }
+  report_scaled ("fill_database", scale, ops, elapsed);
+  if (frees > 0)
+  {
+    report_scaled ("free_database", scale, frees, free_elapsed);
+  }
+  return chain;
+}
+
+static bool bench_add_to_database (MarkovChain *chain, int scale)
+{
+  size_t count = (size_t) chain->database->size;
+  void **states = malloc (count * sizeof (void *));
+  if (!states)
+  {
+    return false;
+  }
+  size_t i = 0;
+  for (Node *curr = chain->database->first; curr; curr = curr->next)
+  {
+    states[i++] = curr->data->data;
+  }
+  double start = now_sec ();
+  for (size_t j = 0; j < LOOKUPS; j++)
+  {
+    add_to_database (chain, states[(j * LOOKUP_STRIDE) % count]);
+  }
+  report_scaled ("add_to_database_lookup", scale, LOOKUPS,
+                 now_sec () - start);
+  free (states);
+  return true;
+}
+
+static void bench_next_random_node (MarkovChain *chain, int scale)
+{
+  markov_rng_seed_default (BENCH_SEED);
+  MarkovNode *node = get_first_random_node (chain);
+  double start = now_sec ();
+  for (int i = 0; i < SAMPLES; i++)
+  {
+    node = get_next_random_node (node);
+    if (!node || node->freq_list_act_size == 0)
+    {
+      node = get_first_random_node (chain);
+    }
+  }
+  report_scaled ("next_random_node", scale, SAMPLES, now_sec () - start);
+}
+
+/**
+ * Generate tweets into the chain's output buffer, writing it to
+ * /dev/null in large blocks, like the tweets generator does.
+ */
+static bool bench_generate_tweet (MarkovChain *chain, int scale)
+{
+  int null_fd = open ("/dev/null", O_WRONLY);
+  if (null_fd < 0)
+  {
+    return false;
+  }
+  OutputBuffer out = {0};
+  chain->output = &out;
+  markov_rng_seed_default (BENCH_SEED);
+  double start = now_sec ();
+  for (int i = 0; i < TWEETS; i++)
+  {
+    generate_tweet (chain, get_first_random_node (chain), MAX_TWEET_LEN);
+    if (out.len >= OUTPUT_FLUSH_SIZE)
+    {
+      output_flush_fd (&out, null_fd);
+    }
+  }
+  bool success = output_flush_fd (&out, null_fd);
+  report_scaled ("generate_tweet", scale, TWEETS, now_sec () - start);
+  chain->output = NULL;
+  output_free (&out);
+  close (null_fd);
+  return success;
+}
+
+static size_t heap_in_use (void)
+{
+  struct mallinfo2 info = mallinfo2 ();
+  // large blocks are mapped on their own, outside the arena's count
+  return info.uordblks + info.hblkhd;
+}
+
+/**
+ * Generate tweets from the chain with the batch generator, then freeze
+ * the chain and generate them again from the frozen model, then from
+ * the model compacted to 8 bit counts, reporting the memory each form
+ * takes.
+ * @param ptr_chain the chain, freed here
+ */
+static bool bench_freeze (MarkovChain **ptr_chain, int scale)
+{
+  int null_fd = open ("/dev/null", O_WRONLY);
+  if (null_fd < 0)
+  {
+    free_database (ptr_chain);
+    return false;
+  }
+  double start = now_sec ();
+  bool success = generate_tweets_batch (*ptr_chain, TWEETS, 1, BENCH_SEED,
+                                        null_fd);
+  report_scaled ("batch_tweets", scale, TWEETS, now_sec () - start);
+  size_t chain_heap = heap_in_use ();
+  start = now_sec ();
+  MarkovModel *model = freeze_chain (ptr_chain);
+  if (!model)
+  {
+    free_database (ptr_chain);
+    close (null_fd);
+    return false;
+  }
+  report_scaled ("freeze_chain", scale, 1, now_sec () - start);
+  size_t frozen_heap = heap_in_use ();
+  printf ("%-28s %10zu KB chain %10zu KB frozen\n", "freeze_heap",
+          chain_heap / BYTES_IN_KB, frozen_heap / BYTES_IN_KB);
+  start = now_sec ();
+  success = generate_model_tweets_batch (model, TWEETS, 1, BENCH_SEED,
+                                         null_fd) && success;
+  report_scaled ("batch_tweets_frozen", scale, TWEETS, now_sec () - start);
+  // the same model with its counts in 8 bits, nothing pruned
+  CompactOptions options = {1, false, 8};
+  CompactReport report;
+  start = now_sec ();
+  MarkovModel *compacted = compact_model (model, &options, &report);
+  report_scaled ("compact_model_8bit", scale, 1, now_sec () - start);
+  if (compacted)
+  {
+    printf ("%-28s %10zu KB frozen %10zu KB compacted (divergence %.4f)\n",
+            "compact_size", report.bytes_before / BYTES_IN_KB,
+            report.bytes_after / BYTES_IN_KB, report.mean_divergence);
+    start = now_sec ();
+    success = generate_model_tweets_batch (compacted, TWEETS, 1, BENCH_SEED,
+                                           null_fd) && success;
+    report_scaled ("batch_tweets_compact_8bit", scale, TWEETS,
+                   now_sec () - start);
+  }
+  success = compacted && success;
+  free_model (&compacted);
+  free_model (&model);
+  close (null_fd);
+  return success;
+}
+
+/**
+ * Append the words of a walk to out the way generate_tweet does.
+ */
+static void append_word_walk (const WordChain *chain, const uint32_t *walk,
+                              int len, OutputBuffer *out)
+{
+  for (int i = 0; i < len; i++)
+  {
+    output_append_str (out, chain->states[walk[i]].value);
+    output_append (out, i == len - 1 ? "\n" : " ", 1);
+  }
+}
+
+/**
+ * The fill, lookup, sampling and generation benchmarks again, on the
+ * type specialized WordChain instead of a MarkovChain.
+ */
+static bool bench_word_chain (const Corpus *corpus, int scale)
+{
+  size_t words = 0;
+  tokenize_mapped_corpus (corpus, &count_token, &words);
+  WordChain chain = {0};
+  StringArena *arena = NULL;
+  size_t ops = 0;
+  double elapsed = 0;
+  while (elapsed < MIN_BENCH_SEC)
+  {
+    word_chain_free (&chain);
+    arena_free (&arena);
+    arena = arena_create ();
+    if (!arena)
+    {
+      return false;
+    }
+    double start = now_sec ();
+    if (fill_word_chain (corpus, -1, &chain, arena) == EXIT_FAILURE ||
+        !word_chain_build_samplers (&chain))
+    {
+      word_chain_free (&chain);
+      arena_free (&arena);
+      return false;
+    }
+    elapsed += now_sec () - start;
+    ops += words;
+  }
+  report_scaled ("typed_fill_database", scale, ops, elapsed);
+
+  double start = now_sec ();
+  for (size_t j = 0; j < LOOKUPS; j++)
+  {
+    word_chain_add (&chain, chain.states[(j * LOOKUP_STRIDE) %
+                                         chain.count].value);
+  }
+  report_scaled ("typed_lookup", scale, LOOKUPS, now_sec () - start);
+
+  markov_rng_seed_default (BENCH_SEED);
+  uint32_t state = word_chain_first_random (&chain, NULL);
+  start = now_sec ();
+  for (int i = 0; i < SAMPLES; i++)
+  {
+    state = word_chain_next_random (&chain, state, NULL);
+    if (state == TYPED_NO_STATE || chain.states[state].successor_count == 0)
+    {
+      state = word_chain_first_random (&chain, NULL);
+    }
+  }
+  report_scaled ("typed_next_random_node", scale, SAMPLES,
+                 now_sec () - start);
+
+  int null_fd = open ("/dev/null", O_WRONLY);
+  bool success = null_fd >= 0;
+  OutputBuffer out = {0};
+  uint32_t walk[MAX_TWEET_LEN];
+  markov_rng_seed_default (BENCH_SEED);
+  start = now_sec ();
+  for (int i = 0; success && i < TWEETS; i++)
+  {
+    int len = word_chain_walk (&chain, word_chain_first_random (&chain, NULL),
+                               NULL, walk, MAX_TWEET_LEN);
+    append_word_walk (&chain, walk, len, &out);
+    if (out.len >= OUTPUT_FLUSH_SIZE)
+    {
+      success = output_flush_fd (&out, null_fd);
+    }
+  }
+  success = success && output_flush_fd (&out, null_fd);
+  report_scaled ("typed_generate_tweet", scale, TWEETS, now_sec () - start);
+  output_free (&out);
+  if (null_fd >= 0)
+  {
+    close (null_fd);
+  }
+  word_chain_free (&chain);
+  arena_free (&arena);
+  return success;
+}
+
+/**
+ * Run the tweets benchmarks on the sample corpus scaled by scale.
+ */
+static int bench_corpus (int scale)
+{
+  Corpus sample, corpus;
+  if (!corpus_map (BENCH_CORPUS, &sample))
+  {
+    fprintf (stdout, "Error: can't open %s\n", BENCH_CORPUS);
+    return EXIT_FAILURE;
+  }
+  corpus = sample;
+  char path[sizeof (SYNTHETIC_TEMPLATE)] = "";
+  if (scale > 1)
+  {
+    bool written = write_synthetic_corpus (&sample, scale, path);
+    corpus_unmap (&sample);
+    if (!written || !corpus_map (path, &corpus))
+    {
+      fprintf (stdout, "Error: can't write a synthetic corpus\n");
+      unlink (path);
+      return EXIT_FAILURE;
+    }
+  }
+  bench_tokenize (&corpus, scale);
+  bool stream_success = bench_tokenize_stream (&corpus, scale);
+  MarkovChain *chain = bench_fill_database (&corpus, scale);
+  bool typed_success = bench_word_chain (&corpus, scale);
+  corpus_unmap (&corpus);
+  if (scale > 1)
+  {
+    unlink (path);
+  }
+  if (!chain)
+  {
+    return EXIT_FAILURE;
+  }
+  bool success = bench_add_to_database (chain, scale) && typed_success &&
+                 stream_success;
+  bench_next_random_node (chain, scale);
+  success = bench_generate_tweet (chain, scale) && success;
+  success = bench_freeze (&chain, scale) && success;
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Solve the board's absorbing chain and step its distribution, the exact
+ * counterparts of estimating them from random games.
+ */
+static bool bench_board_analytics (const MarkovModel *board)
+{
+  ChainMatrix *matrix = chain_matrix_create (board);
+  uint32_t size = board->header->num_states;
+  double *expected = malloc (size * sizeof (double));
+  double *variance = malloc (size * sizeof (double));
+  double *current = calloc (size, sizeof (double));
+  double *next = malloc (size * sizeof (double));
+  bool success = matrix && expected && variance && current && next;
+  double start = now_sec ();
+  for (int i = 0; success && i < BOARD_SOLVES; i++)
+  {
+    success = solve_absorption (matrix, expected, variance, NULL) ==
+              ANALYTICS_SOLVED;
+  }
+  report ("board_solve_absorption", BOARD_SOLVES, now_sec () - start);
+  if (success)
+  {
+    current[0] = 1;
+    start = now_sec ();
+    for (int i = 0; i < BOARD_STEPS; i++)
+    {
+      step_distribution (matrix, current, next);
+      double *swap = current;
+      current = next;
+      next = swap;
+    }
+    report ("board_step_distribution", BOARD_STEPS, now_sec () - start);
+  }
+  chain_matrix_free (&matrix);
+  free (expected);
+  free (variance);
+  free (current);
+  free (next);
+  return success;
+}
+
+/**
+ * Simulate games on the board in lockstep, counting moves per second.
+ */
+static bool bench_board_walks (const MarkovModel *board)
+{
+  WalkTable *table = walk_table_create (board);
+  WalkStats stats;
+  double start = now_sec ();
+  if (!table || !simulate_walks (table, 0, BOARD_WALKS, MAX_GENERATION_LENGTH,
+                                 BENCH_SEED, 1, &stats))
+  {
+    walk_table_free (&table);
+    return false;
+  }
+  double elapsed = now_sec () - start;
+  report ("board_simulate_walks", BOARD_WALKS, elapsed);
+  report ("board_simulate_moves", (size_t) stats.moves, elapsed);
+  walk_stats_free (&stats);
+  walk_table_free (&table);
+  return true;
+}
+
+/**
+ * Generate a large board and build its frozen chain, per cell.
+ */
+static bool bench_large_board (void)
+{
+  Board cells;
+  double start = now_sec ();
+  if (board_generate (LARGE_BOARD_CELLS, DICE_MAX, LARGE_BOARD_CELLS / 5,
+                      BENCH_SEED, &cells) == EXIT_FAILURE)
+  {
+    return false;
+  }
+  report ("large_board_generate", LARGE_BOARD_CELLS, now_sec () - start);
+  start = now_sec ();
+  MarkovModel *board = create_snake_board (&cells);
+  report ("large_board_build", LARGE_BOARD_CELLS, now_sec () - start);
+  board_free (&cells);
+  bool success = board != NULL;
+  free_model (&board);
+  return success;
+}
+
+static int bench_generate_game (int unused)
+{
+  (void) unused;
+  Board cells;
+  if (board_classic (&cells) == EXIT_FAILURE)
+  {
+    return EXIT_FAILURE;
+  }
+  MarkovModel *board = create_snake_board (&cells);
+  if (!board)
+  {
+    board_free (&cells);
+    return EXIT_FAILURE;
+  }
+  if (!bench_board_analytics (board) || !bench_board_walks (board))
+  {
+    board_free (&cells);
+    free_model (&board);
+    return EXIT_FAILURE;
+  }
+  markov_rng_seed_default (BENCH_SEED);
+  double start = now_sec ();
+  for (int i = 0; i < GAMES; i++)
+  {
+    size_t track_len = 0;
+    Cell **track = generate_game (board, MAX_GENERATION_LENGTH, &track_len);
+    if (!track)
+    {
+      board_free (&cells);
+      free_model (&board);
+      return EXIT_FAILURE;
+    }
+    free (track);
+  }
+  report ("generate_game", GAMES, now_sec () - start);
+  free_model (&board);
+
+  CellChain cell_chain = {0};
+  bool filled = fill_cell_chain (&cell_chain, &cells) == EXIT_SUCCESS;
+  board_free (&cells);
+  if (!filled)
+  {
+    cell_chain_free (&cell_chain);
+    return EXIT_FAILURE;
+  }
+  uint32_t track[MAX_GENERATION_LENGTH];
+  markov_rng_seed_default (BENCH_SEED);
+  start = now_sec ();
+  for (int i = 0; i < GAMES; i++)
+  {
+    cell_chain_walk (&cell_chain, 0, NULL, track, MAX_GENERATION_LENGTH);
+  }
+  report ("typed_generate_game", GAMES, now_sec () - start);
+  cell_chain_free (&cell_chain);
+  return bench_large_board () ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Draw from the generator one number at a time, from the default stream,
+ * and a batch at a time, with rand () % n as the baseline.
+ */
+static int bench_rng (int unused)
+{
+  (void) unused;
+  MarkovRng rng;
+  markov_rng_seed (&rng, BENCH_SEED, 0);
+  uint64_t sink = 0;
+  double start = now_sec ();
+  for (size_t i = 0; i < RNG_DRAWS; i++)
+  {
+    sink += markov_rng_next (&rng);
+  }
+  report ("rng_next", RNG_DRAWS, now_sec () - start);
+  start = now_sec ();
+  for (size_t i = 0; i < RNG_DRAWS; i++)
+  {
+    sink += markov_rng_bounded (&rng, RNG_BOUND);
+  }
+  report ("rng_bounded", RNG_DRAWS, now_sec () - start);
+  markov_rng_seed_default (BENCH_SEED);
+  start = now_sec ();
+  for (size_t i = 0; i < RNG_DRAWS; i++)
+  {
+    sink += (uint64_t) get_random_number (RNG_BOUND);
+  }
+  report ("get_random_number", RNG_DRAWS, now_sec () - start);
+  srand (BENCH_SEED);
+  start = now_sec ();
+  for (size_t i = 0; i < RNG_DRAWS; i++)
+  {
+    sink += (uint64_t) (rand () % RNG_BOUND);
+  }
+  report ("rand_mod", RNG_DRAWS, now_sec () - start);
+
+  MarkovRngBatch batch;
+  markov_rng_batch_seed (&batch, BENCH_SEED, 0);
+  uint64_t draws[RNG_BATCH_SIZE];
+  uint32_t bounds[RNG_BATCH_SIZE], numbers[RNG_BATCH_SIZE];
+  for (size_t i = 0; i < RNG_BATCH_SIZE; i++)
+  {
+    bounds[i] = RNG_BOUND;
+  }
+  char name[MAX_WORD_LEN];
+  start = now_sec ();
+  for (size_t i = 0; i < RNG_DRAWS; i += RNG_BATCH_SIZE)
+  {
+    markov_rng_batch_fill (&batch, draws, RNG_BATCH_SIZE);
+    sink += draws[0];
+  }
+  snprintf (name, sizeof (name), "rng_batch_fill_%s",
+            markov_rng_kernel_name ());
+  report (name, RNG_DRAWS, now_sec () - start);
+  start = now_sec ();
+  for (size_t i = 0; i < RNG_DRAWS; i += RNG_BATCH_SIZE)
+  {
+    markov_rng_batch_bounded (&batch, bounds, numbers, RNG_BATCH_SIZE);
+    sink += numbers[0];
+  }
+  snprintf (name, sizeof (name), "rng_batch_bounded_%s",
+            markov_rng_kernel_name ());
+  report (name, RNG_DRAWS, now_sec () - start);
+  // keep the draws from being optimized away
+  return sink == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int bench_hub (int unused)
+{
+  (void) unused;
+  return bench_hub_bigrams ();
+}
+
+/**
+ * Run the benchmark in a child process, so it starts from a clean heap
+ * and its peak RSS is its own.
+ * @return the benchmark's result.
+ */
+static int run_isolated (int (*bench) (int), int arg)
+{
+  fflush (stdout);
+  pid_t pid = fork ();
+  if (pid < 0)
+  {
+    return bench (arg);
+  }
+  if (pid == 0)
+  {
+    exit (bench (arg));
+  }
+  int status;
+  if (waitpid (pid, &status, 0) < 0 || !WIFEXITED (status))
+  {
+    return EXIT_FAILURE;
+  }
+  return WEXITSTATUS (status);
+}
+
+int main (int argc, char *argv[])
+{
+  int max_scale = DEFAULT_MAX_SCALE;
+  if (argc > MAX_SCALE_ARG)
+  {
+    max_scale = (int) strtol (argv[MAX_SCALE_ARG], NULL, DECIMAL);
+  }
+  int result = EXIT_SUCCESS;
+  for (int scale = 1; scale <= max_scale; scale *= SCALE_STEP)
+  {
+    if (run_isolated (&bench_corpus, scale) == EXIT_FAILURE)
+    {
+      result = EXIT_FAILURE;
+    }
+  }
+  if (run_isolated (&bench_generate_game, 0) == EXIT_FAILURE ||
+      run_isolated (&bench_hub, 0) == EXIT_FAILURE ||
+      run_isolated (&bench_rng, 0) == EXIT_FAILURE)
+  {
+    result = EXIT_FAILURE;
+  }
+  return result;
+}
@@ -0,0 +1,773 @@
+#include "chain_analytics.h"
+#include <string.h> // For memset()
+#include <stdint.h> // For INT32_MAX
+#if defined(__x86_64__) || defined(__i386__)
+#define ANALYTICS_X86
+#include <immintrin.h> // For the AVX2 intrinsics
+#endif
+
+#define AVX2_DOUBLES 4
+// pivots smaller than this leave the equations without a solution
+#define SINGULAR_PIVOT 1e-12
+
+static double absolute (double x)
+{
+  return x < 0 ? -x : x;
+}
+
+/**
+ * Fill the probability of every edge of the model's rows.
+ */
+static void fill_rows (ChainMatrix *matrix, const MarkovModel *model)
+{
+  for (uint32_t state = 0; state < matrix->size; state++)
+  {
+    uint32_t begin = model->succ_offsets[state];
+    uint32_t end = model->succ_offsets[state + 1];
+    double total = 0;
+    for (uint32_t edge = begin; edge < end; edge++)
+    {
+      total += model_edge_count (model, state, edge);
+    }
+    for (uint32_t edge = begin; edge < end; edge++)
+    {
+      matrix->row_probabilities[edge] =
+          model_edge_count (model, state, edge) / total;
+    }
+    matrix->absorbing[state] = begin == end ||
+        (model->state_flags[state] & MODEL_STATE_LAST);
+  }
+}
+
+/**
+ * Fill the columns from the rows: the edges of the states that aren't
+ * absorbing, and a move to itself for each absorbing state.
+ */
+static void fill_columns (ChainMatrix *matrix)
+{
+  uint32_t size = matrix->size;
+  memset (matrix->column_offsets, 0, (size + 1) * sizeof (uint32_t));
+  for (uint32_t state = 0; state < size; state++)
+  {
+    if (matrix->absorbing[state])
+    {
+      matrix->column_offsets[state + 1]++;
+      continue;
+    }
+    for (uint32_t edge = matrix->row_offsets[state];
+         edge < matrix->row_offsets[state + 1]; edge++)
+    {
+      matrix->column_offsets[matrix->row_targets[edge] + 1]++;
+    }
+  }
+  for (uint32_t state = 0; state < size; state++)
+  {
+    matrix->column_offsets[state + 1] += matrix->column_offsets[state];
+  }
+  // fill each column from its start, sources in increasing order
+  for (uint32_t state = 0; state < size; state++)
+  {
+    if (matrix->absorbing[state])
+    {
+      uint32_t slot = matrix->column_offsets[state]++;
+      matrix->column_sources[slot] = (int32_t) state;
+      matrix->column_probabilities[slot] = 1;
+      continue;
+    }
+    for (uint32_t edge = matrix->row_offsets[state];
+         edge < matrix->row_offsets[state + 1]; edge++)
+    {
+      uint32_t slot = matrix->column_offsets[matrix->row_targets[edge]]++;
+      matrix->column_sources[slot] = (int32_t) state;
+      matrix->column_probabilities[slot] = matrix->row_probabilities[edge];
+    }
+  }
+  // every column start moved to the next one's, shift them back
+  for (uint32_t state = size; state > 0; state--)
+  {
+    matrix->column_offsets[state] = matrix->column_offsets[state - 1];
+  }
+  matrix->column_offsets[0] = 0;
+}
+
+static void fill_dense (ChainMatrix *matrix)
+{
+  size_t size = matrix->size;
+  memset (matrix->dense, 0, size * size * sizeof (double));
+  for (uint32_t target = 0; target < size; target++)
+  {
+    for (uint32_t slot = matrix->column_offsets[target];
+         slot < matrix->column_offsets[target + 1]; slot++)
+    {
+      size_t source = (size_t) matrix->column_sources[slot];
+      matrix->dense[source * size + target] +=
+          matrix->column_probabilities[slot];
+    }
+  }
+}
+
+ChainMatrix *chain_matrix_create (const MarkovModel *model)
+{
+  uint32_t size = model->header->num_states;
+  uint32_t num_edges = model->header->num_edges;
+  if (size > INT32_MAX)
+  {
+    return NULL;
+  }
+  ChainMatrix *matrix = calloc (1, sizeof (ChainMatrix));
+  if (!matrix)
+  {
+    return NULL;
+  }
+  matrix->size = size;
+  matrix->row_offsets = model->succ_offsets;
+  matrix->row_targets = model->succ_targets;
+  // +1 so empty models still get valid allocations
+  matrix->absorbing = malloc (size + 1);
+  matrix->row_probabilities = malloc ((num_edges + 1) * sizeof (double));
+  matrix->column_offsets = malloc ((size + 1) * sizeof (uint32_t));
+  // at most one edge per absorbing state is added
+  matrix->column_sources = malloc (((size_t) num_edges + size + 1) *
+                                   sizeof (int32_t));
+  matrix->column_probabilities = malloc (((size_t) num_edges + size + 1) *
+                                         sizeof (double));
+  if (size <= ANALYTICS_DENSE_MAX_STATES)
+  {
+    matrix->dense = malloc (((size_t) size * size + 1) * sizeof (double));
+  }
+  if (!matrix->absorbing || !matrix->row_probabilities ||
+      !matrix->column_offsets || !matrix->column_sources ||
+      !matrix->column_probabilities ||
+      (size <= ANALYTICS_DENSE_MAX_STATES && !matrix->dense))
+  {
+    chain_matrix_free (&matrix);
+    return NULL;
+  }
+  fill_rows (matrix, model);
+  fill_columns (matrix);
+  if (matrix->dense)
+  {
+    fill_dense (matrix);
+  }
+  return matrix;
+}
+
+void chain_matrix_free (ChainMatrix **ptr_matrix)
+{
+  if (!*ptr_matrix)
+  {
+    return;
+  }
+  ChainMatrix *matrix = *ptr_matrix;
+  free (matrix->absorbing);
+  free (matrix->row_probabilities);
+  free (matrix->column_offsets);
+  free (matrix->column_sources);
+  free (matrix->column_probabilities);
+  free (matrix->dense);
+  free (matrix);
+  *ptr_matrix = NULL;
+}
+
+/**
+ * LU decompose the square matrix of the given size in place, with partial
+ * pivoting.
+ * @param pivots filled with the row swapped into each row
+ * @return false if the matrix is singular.
+ */
+static bool lu_decompose (double *a, uint32_t n, uint32_t *pivots)
+{
+  for (uint32_t k = 0; k < n; k++)
+  {
+    uint32_t pivot = k;
+    for (uint32_t i = k + 1; i < n; i++)
+    {
+      if (absolute (a[(size_t) i * n + k]) >
+          absolute (a[(size_t) pivot * n + k]))
+      {
+        pivot = i;
+      }
+    }
+    if (absolute (a[(size_t) pivot * n + k]) < SINGULAR_PIVOT)
+    {
+      return false;
+    }
+    pivots[k] = pivot;
+    if (pivot != k)
+    {
+      for (uint32_t j = 0; j < n; j++)
+      {
+        double swap = a[(size_t) k * n + j];
+        a[(size_t) k * n + j] = a[(size_t) pivot * n + j];
+        a[(size_t) pivot * n + j] = swap;
+      }
+    }
+    double *row_k = a + (size_t) k * n;
+    for (uint32_t i = k + 1; i < n; i++)
+    {
+      double *row_i = a + (size_t) i * n;
+      double factor = row_i[k] / row_k[k];
+      row_i[k] = factor;
+      if (factor == 0)
+      {
+        continue;
+      }
+      for (uint32_t j = k + 1; j < n; j++)
+      {
+        row_i[j] -= factor * row_k[j];
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * Solve a x = b in place in b, a being LU decomposed.
+ */
+static void lu_solve (const double *a, uint32_t n, const uint32_t *pivots,
+                      double *b)
+{
+  for (uint32_t k = 0; k < n; k++)
+  {
+    double swap = b[k];
+    b[k] = b[pivots[k]];
+    b[pivots[k]] = swap;
+  }
+  for (uint32_t i = 0; i < n; i++)
+  {
+    for (uint32_t j = 0; j < i; j++)
+    {
+      b[i] -= a[(size_t) i * n + j] * b[j];
+    }
+  }
+  for (uint32_t i = n; i-- > 0;)
+  {
+    for (uint32_t j = i + 1; j < n; j++)
+    {
+      b[i] -= a[(size_t) i * n + j] * b[j];
+    }
+    b[i] /= a[(size_t) i * n + i];
+  }
+}
+
+/**
+ * Solve both systems exactly with the dense matrix.
+ * @param transient the index of each state among the transient ones
+ */
+static AnalyticsStatus solve_dense (const ChainMatrix *matrix,
+                                    const uint32_t *transient,
+                                    uint32_t count, double *expected,
+                                    double *second)
+{
+  double *a = calloc ((size_t) count * count + 1, sizeof (double));
+  uint32_t *pivots = malloc ((count + 1) * sizeof (uint32_t));
+  AnalyticsStatus status = a && pivots ? ANALYTICS_SOLVED
+                                       : ANALYTICS_NO_MEMORY;
+  for (uint32_t state = 0; status == ANALYTICS_SOLVED && state < matrix->size;
+       state++)
+  {
+    uint32_t row = transient[state];
+    if (row == MODEL_NO_STATE)
+    {
+      continue;
+    }
+    for (uint32_t target = 0; target < matrix->size; target++)
+    {
+      if (transient[target] != MODEL_NO_STATE)
+      {
+        a[(size_t) row * count + transient[target]] -=
+            matrix->dense[(size_t) state * matrix->size + target];
+      }
+    }
+    a[(size_t) row * count + row] += 1;
+  }
+  if (status == ANALYTICS_SOLVED && !lu_decompose (a, count, pivots))
+  {
+    status = ANALYTICS_UNREACHABLE;
+  }
+  if (status == ANALYTICS_SOLVED)
+  {
+    for (uint32_t i = 0; i < count; i++)
+    {
+      expected[i] = 1;
+    }
+    lu_solve (a, count, pivots, expected);
+    memcpy (second, expected, count * sizeof (double));
+    lu_solve (a, count, pivots, second);
+  }
+  free (a);
+  free (pivots);
+  return status;
+}
+
+/**
+ * Find the profile of the LU factors of I - Q over every state (the rows
+ * of the absorbing states are left as identity rows): each row is kept
+ * from its first to its last column that can be nonzero. Eliminating row
+ * i's columns before the diagonal brings in the U part of each of those
+ * rows, so its last column is the furthest of theirs.
+ * @param first filled with the first column of each row
+ * @param last filled with the last column of each row
+ * @return the number of values in the profile, 0 if it's more than
+ * ANALYTICS_PROFILE_MAX_VALUES.
+ */
+static size_t profile_shape (const ChainMatrix *matrix, uint32_t *first,
+                             uint32_t *last)
+{
+  size_t values = 0;
+  for (uint32_t state = 0; state < matrix->size; state++)
+  {
+    first[state] = last[state] = state;
+    if (matrix->absorbing[state])
+    {
+      values++;
+      continue;
+    }
+    for (uint32_t edge = matrix->row_offsets[state];
+         edge < matrix->row_offsets[state + 1]; edge++)
+    {
+      uint32_t target = matrix->row_targets[edge];
+      if (!matrix->absorbing[target])
+      {
+        first[state] = target < first[state] ? target : first[state];
+        last[state] = target > last[state] ? target : last[state];
+      }
+    }
+    // checked before the loop too, so its work is bounded by the cap
+    values += last[state] - first[state] + 1;
+    if (values > ANALYTICS_PROFILE_MAX_VALUES)
+    {
+      return 0;
+    }
+    uint32_t furthest = last[state];
+    for (uint32_t column = first[state]; column < state; column++)
+    {
+      furthest = last[column] > furthest ? last[column] : furthest;
+    }
+    values += furthest - last[state];
+    last[state] = furthest;
+    if (values > ANALYTICS_PROFILE_MAX_VALUES)
+    {
+      return 0;
+    }
+  }
+  return values;
+}
+
+/**
+ * LU decompose I - Q in place in its profile, without pivoting: I - Q is
+ * diagonally dominant by rows, and stays so while it's eliminated.
+ * @param offsets the index in values of the first column of each row
+ * @return false if a pivot is too small, some state never stops.
+ */
+static bool profile_decompose (const ChainMatrix *matrix,
+                               const uint32_t *first, const uint32_t *last,
+                               const size_t *offsets, double *values)
+{
+  for (uint32_t state = 0; state < matrix->size; state++)
+  {
+    double *row = values + offsets[state];
+    memset (row, 0, (last[state] - first[state] + 1) * sizeof (double));
+    row[state - first[state]] = 1;
+    if (matrix->absorbing[state])
+    {
+      continue;
+    }
+    for (uint32_t edge = matrix->row_offsets[state];
+         edge < matrix->row_offsets[state + 1]; edge++)
+    {
+      uint32_t target = matrix->row_targets[edge];
+      if (!matrix->absorbing[target])
+      {
+        row[target - first[state]] -= matrix->row_probabilities[edge];
+      }
+    }
+    for (uint32_t column = first[state]; column < state; column++)
+    {
+      const double *pivot_row = values + offsets[column] +
+                                (column - first[column]);
+      double factor = row[column - first[state]] / pivot_row[0];
+      row[column - first[state]] = factor;
+      if (factor == 0)
+      {
+        continue;
+      }
+      double *rest = row + (column - first[state]);
+      for (uint32_t j = 1; j <= last[column] - column; j++)
+      {
+        rest[j] -= factor * pivot_row[j];
+      }
+    }
+    if (absolute (row[state - first[state]]) < SINGULAR_PIVOT)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Solve (I - Q) x = b in place in b, I - Q being decomposed in its
+ * profile.
+ */
+static void profile_solve (uint32_t size, const uint32_t *first,
+                           const uint32_t *last, const size_t *offsets,
+                           const double *values, double *b)
+{
+  for (uint32_t state = 0; state < size; state++)
+  {
+    const double *row = values + offsets[state];
+    for (uint32_t column = first[state]; column < state; column++)
+    {
+      b[state] -= row[column - first[state]] * b[column];
+    }
+  }
+  for (uint32_t state = size; state-- > 0;)
+  {
+    const double *row = values + offsets[state] + (state - first[state]);
+    for (uint32_t j = 1; j <= last[state] - state; j++)
+    {
+      b[state] -= row[j] * b[state + j];
+    }
+    b[state] /= row[0];
+  }
+}
+
+/**
+ * Solve both systems exactly by LU decomposing I - Q in its profile,
+ * indexed by state.
+ * @param info filled with the number of values of the profile
+ * @param too_big set if the profile has more than
+ * ANALYTICS_PROFILE_MAX_VALUES values, and nothing was solved
+ * @return ANALYTICS_SOLVED, or why nothing was solved (ANALYTICS_NO_MEMORY
+ * if the profile is too big).
+ */
+static AnalyticsStatus solve_profile (const ChainMatrix *matrix,
+                                      double *expected, double *second,
+                                      AbsorptionInfo *info, bool *too_big)
+{
+  uint32_t size = matrix->size;
+  uint32_t *first = malloc ((size + 1) * sizeof (uint32_t));
+  uint32_t *last = malloc ((size + 1) * sizeof (uint32_t));
+  size_t *offsets = malloc ((size + 1) * sizeof (size_t));
+  size_t values = first && last && offsets ?
+                  profile_shape (matrix, first, last) : 0;
+  *too_big = first && last && offsets && values == 0;
+  double *factors = values ? malloc (values * sizeof (double)) : NULL;
+  AnalyticsStatus status = factors ? ANALYTICS_SOLVED : ANALYTICS_NO_MEMORY;
+  if (status == ANALYTICS_SOLVED)
+  {
+    offsets[0] = 0;
+    for (uint32_t state = 0; state < size; state++)
+    {
+      offsets[state + 1] = offsets[state] + last[state] - first[state] + 1;
+    }
+    if (!profile_decompose (matrix, first, last, offsets, factors))
+    {
+      status = ANALYTICS_UNREACHABLE;
+    }
+  }
+  if (status == ANALYTICS_SOLVED)
+  {
+    for (uint32_t state = 0; state < size; state++)
+    {
+      expected[state] = matrix->absorbing[state] ? 0 : 1;
+    }
+    profile_solve (size, first, last, offsets, factors, expected);
+    memcpy (second, expected, size * sizeof (double));
+    profile_solve (size, first, last, offsets, factors, second);
+    info->profile_values = values;
+  }
+  free (first);
+  free (last);
+  free (offsets);
+  free (factors);
+  return status;
+}
+
+/**
+ * Solve x = rhs + Q x by Gauss-Seidel sweeps over the rows, from the last
+ * state to the first, so walks that mostly move forward converge in few
+ * sweeps.
+ * @param x filled with the solution, 0 for the absorbing states
+ * @return the number of sweeps, -1 if they didn't converge.
+ */
+static int solve_iterative (const ChainMatrix *matrix, const double *rhs,
+                            double *x)
+{
+  memset (x, 0, matrix->size * sizeof (double));
+  for (int sweep = 1; sweep <= ANALYTICS_MAX_SWEEPS; sweep++)
+  {
+    double largest_change = 0;
+    for (uint32_t state = matrix->size; state-- > 0;)
+    {
+      if (matrix->absorbing[state])
+      {
+        continue;
+      }
+      double sum = rhs[state], stay = 0;
+      for (uint32_t edge = matrix->row_offsets[state];
+           edge < matrix->row_offsets[state + 1]; edge++)
+      {
+        uint32_t target = matrix->row_targets[edge];
+        if (target == state)
+        {
+          stay += matrix->row_probabilities[edge];
+        }
+        else
+        {
+          sum += matrix->row_probabilities[edge] * x[target];
+        }
+      }
+      if (stay >= 1)
+      {
+        return -1;
+      }
+      double value = sum / (1 - stay);
+      double change = absolute (value - x[state]) /
+                      (absolute (value) > 1 ? absolute (value) : 1);
+      largest_change = change > largest_change ? change : largest_change;
+      x[state] = value;
+    }
+    if (largest_change <= ANALYTICS_TOLERANCE)
+    {
+      return sweep;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Check that a walk from every state stops, by a search back from the
+ * absorbing states over the columns.
+ * @return ANALYTICS_SOLVED if it does, ANALYTICS_UNREACHABLE if some
+ * state can't reach any absorbing state, ANALYTICS_NO_MEMORY in case of
+ * allocation error.
+ */
+static AnalyticsStatus check_stops (const ChainMatrix *matrix)
+{
+  uint32_t size = matrix->size;
+  uint8_t *reached = calloc (size + 1, 1);
+  uint32_t *queue = malloc ((size + 1) * sizeof (uint32_t));
+  if (!reached || !queue)
+  {
+    free (reached);
+    free (queue);
+    return ANALYTICS_NO_MEMORY;
+  }
+  uint32_t tail = 0;
+  for (uint32_t state = 0; state < size; state++)
+  {
+    if (matrix->absorbing[state])
+    {
+      reached[state] = 1;
+      queue[tail++] = state;
+    }
+  }
+  for (uint32_t head = 0; head < tail; head++)
+  {
+    uint32_t state = queue[head];
+    for (uint32_t slot = matrix->column_offsets[state];
+         slot < matrix->column_offsets[state + 1]; slot++)
+    {
+      uint32_t source = (uint32_t) matrix->column_sources[slot];
+      if (!reached[source])
+      {
+        reached[source] = 1;
+        queue[tail++] = source;
+      }
+    }
+  }
+  free (reached);
+  free (queue);
+  return tail == size ? ANALYTICS_SOLVED : ANALYTICS_UNREACHABLE;
+}
+
+AnalyticsStatus solve_absorption (const ChainMatrix *matrix,
+                                  double *expected, double *variance,
+                                  AbsorptionInfo *info)
+{
+  AnalyticsStatus status = check_stops (matrix);
+  if (status != ANALYTICS_SOLVED)
+  {
+    return status;
+  }
+  uint32_t size = matrix->size;
+  uint32_t *transient = malloc ((size + 1) * sizeof (uint32_t));
+  double *first = malloc ((size + 1) * sizeof (double));
+  double *second = malloc ((size + 1) * sizeof (double));
+  if (!transient || !first || !second)
+  {
+    free (transient);
+    free (first);
+    free (second);
+    return ANALYTICS_NO_MEMORY;
+  }
+  uint32_t count = 0;
+  for (uint32_t state = 0; state < size; state++)
+  {
+    transient[state] = matrix->absorbing[state] ? MODEL_NO_STATE : count++;
+  }
+  AbsorptionInfo solved_by = {.method = ANALYTICS_DENSE_LU,
+                              .transient = count};
+  bool too_big = false;
+  if (matrix->dense)
+  {
+    status = solve_dense (matrix, transient, count, first, second);
+  }
+  else
+  {
+    solved_by.method = ANALYTICS_PROFILE_LU;
+    status = solve_profile (matrix, first, second, &solved_by, &too_big);
+  }
+  if (too_big)
+  {
+    // t = 1 + Q t, then u = t + Q u
+    solved_by.method = ANALYTICS_SPARSE_ITERATIVE;
+    for (uint32_t state = 0; state < size; state++)
+    {
+      second[state] = 1;
+    }
+    int sweeps = solve_iterative (matrix, second, first);
+    int more_sweeps = sweeps < 0 ? -1 : solve_iterative (matrix, first,
+                                                         second);
+    status = more_sweeps >= 0 ? ANALYTICS_SOLVED : ANALYTICS_NOT_CONVERGED;
+    solved_by.sweeps = more_sweeps >= 0 ? sweeps + more_sweeps : 0;
+  }
+  for (uint32_t state = 0; status == ANALYTICS_SOLVED && state < size;
+       state++)
+  {
+    // the dense solutions are indexed by transient state
+    uint32_t i = matrix->dense ? transient[state] : state;
+    bool stops = transient[state] == MODEL_NO_STATE;
+    double t = stops ? 0 : first[i];
+    double u = stops ? 0 : second[i];
+    expected[state] = t;
+    variance[state] = 2 * u - t - t * t;
+    // rounding can leave a tiny negative variance for sure moves
+    variance[state] = variance[state] < 0 ? 0 : variance[state];
+  }
+  if (status == ANALYTICS_SOLVED && info)
+  {
+    *info = solved_by;
+  }
+  free (transient);
+  free (first);
+  free (second);
+  return status;
+}
+
+typedef void (*axpy_function)(double *y, double a, const double *x,
+                              uint32_t n);
+typedef double (*gather_dot_function)(const double *x,
+                                      const int32_t *indices,
+                                      const double *weights, uint32_t n);
+
+/**
+ * y += a x, over n doubles.
+ */
+static void axpy_scalar (double *y, double a, const double *x, uint32_t n)
+{
+  for (uint32_t i = 0; i < n; i++)
+  {
+    y[i] += a * x[i];
+  }
+}
+
+/**
+ * @return the sum of x[indices[i]] * weights[i] over n items.
+ */
+static double gather_dot_scalar (const double *x, const int32_t *indices,
+                                 const double *weights, uint32_t n)
+{
+  double sum = 0;
+  for (uint32_t i = 0; i < n; i++)
+  {
+    sum += x[indices[i]] * weights[i];
+  }
+  return sum;
+}
+
+#ifdef ANALYTICS_X86
+__attribute__ ((target ("avx2,fma")))
+static void axpy_avx2 (double *y, double a, const double *x, uint32_t n)
+{
+  __m256d factor = _mm256_set1_pd (a);
+  uint32_t i = 0;
+  for (; i + AVX2_DOUBLES <= n; i += AVX2_DOUBLES)
+  {
+    __m256d sum = _mm256_fmadd_pd (factor, _mm256_loadu_pd (x + i),
+                                   _mm256_loadu_pd (y + i));
+    _mm256_storeu_pd (y + i, sum);
+  }
+  axpy_scalar (y + i, a, x + i, n - i);
+}
+
+__attribute__ ((target ("avx2,fma")))
+static double gather_dot_avx2 (const double *x, const int32_t *indices,
+                               const double *weights, uint32_t n)
+{
+  __m256d sums = _mm256_setzero_pd ();
+  uint32_t i = 0;
+  for (; i + AVX2_DOUBLES <= n; i += AVX2_DOUBLES)
+  {
+    __m128i index = _mm_loadu_si128 ((const __m128i *) (indices + i));
+    __m256d values = _mm256_i32gather_pd (x, index, sizeof (double));
+    sums = _mm256_fmadd_pd (values, _mm256_loadu_pd (weights + i), sums);
+  }
+  double lanes[AVX2_DOUBLES];
+  _mm256_storeu_pd (lanes, sums);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+         gather_dot_scalar (x, indices + i, weights + i, n - i);
+}
+#endif
+
+static bool use_avx2 (void)
+{
+#ifdef ANALYTICS_X86
+  return __builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma");
+#else
+  return false;
+#endif
+}
+
+const char *analytics_kernel_name (void)
+{
+  return use_avx2 () ? "avx2" : "scalar";
+}
+
+void step_distribution (const ChainMatrix *matrix, const double *current,
+                        double *next)
+{
+  axpy_function axpy = &axpy_scalar;
+  gather_dot_function gather_dot = &gather_dot_scalar;
+#ifdef ANALYTICS_X86
+  if (use_avx2 ())
+  {
+    axpy = &axpy_avx2;
+    gather_dot = &gather_dot_avx2;
+  }
+#endif
+  uint32_t size = matrix->size;
+  if (matrix->dense)
+  {
+    // next is the sum of the rows of P, each weighed by current
+    memset (next, 0, size * sizeof (double));
+    for (uint32_t state = 0; state < size; state++)
+    {
+      if (current[state] != 0)
+      {
+        axpy (next, current[state], matrix->dense + (size_t) state * size,
+              size);
+      }
+    }
+    return;
+  }
+  for (uint32_t state = 0; state < size; state++)
+  {
+    uint32_t begin = matrix->column_offsets[state];
+    next[state] = gather_dot (current, matrix->column_sources + begin,
+                              matrix->column_probabilities + begin,
+                              matrix->column_offsets[state + 1] - begin);
+  }
+}
@@ -0,0 +1,119 @@
+#ifndef _CHAIN_ANALYTICS_H_
+#define _CHAIN_ANALYTICS_H_
+
+#include "markov_chain.h"
+
+// chains with at most this many states also get a dense matrix, and are
+// solved by its LU decomposition
+#define ANALYTICS_DENSE_MAX_STATES 2048
+// larger chains are solved exactly in the profile of their LU factors
+// when it has at most this many values (a board with short ladders and
+// snakes needs a few dozen per cell), by iterating otherwise
+#define ANALYTICS_PROFILE_MAX_VALUES (1u << 26)
+// iterative solving stops once no value moves by more than this share
+#define ANALYTICS_TOLERANCE 1e-12
+#define ANALYTICS_MAX_SWEEPS 100000
+
+/**
+ * The transition matrix of a frozen or loaded model: each state moves to
+ * each of its successors with the share of the state's counts it got. A
+ * walk stops at the states that are last or have no successor; they are
+ * absorbing, so they move to themselves.
+ */
+typedef struct ChainMatrix {
+    uint32_t size;
+    // uint8_t[size]: 1 for the absorbing states
+    uint8_t *absorbing;
+    // the model's rows, and the probability of each of their edges
+    const uint32_t *row_offsets;
+    const uint32_t *row_targets;
+    double *row_probabilities;
+    // the same matrix by column: for each state, the states that move to
+    // it (itself if it's absorbing) and with what probability
+    uint32_t *column_offsets;
+    int32_t *column_sources;
+    double *column_probabilities;
+    // double[size * size], row major, NULL above ANALYTICS_DENSE_MAX_STATES
+    double *dense;
+} ChainMatrix;
+
+typedef enum AnalyticsMethod {
+    // LU decomposition of the dense matrix
+    ANALYTICS_DENSE_LU,
+    // LU decomposition of the sparse matrix, kept from each row's first to
+    // its last column that can be nonzero
+    ANALYTICS_PROFILE_LU,
+    // Gauss-Seidel sweeps over the rows
+    ANALYTICS_SPARSE_ITERATIVE
+} AnalyticsMethod;
+
+typedef enum AnalyticsStatus {
+    ANALYTICS_SOLVED,
+    // allocation error
+    ANALYTICS_NO_MEMORY,
+    // a walk from some state never stops: it can't reach any absorbing
+    // state, so the equations have no solution
+    ANALYTICS_UNREACHABLE,
+    // the iterative method didn't converge in ANALYTICS_MAX_SWEEPS sweeps
+    ANALYTICS_NOT_CONVERGED
+} AnalyticsStatus;
+
+/**
+ * How solve_absorption got its answer.
+ */
+typedef struct AbsorptionInfo {
+    AnalyticsMethod method;
+    // number of states that aren't absorbing
+    uint32_t transient;
+    // sweeps of the iterative method, 0 for LU
+    int sweeps;
+    // values in the profile of the factors, 0 unless ANALYTICS_PROFILE_LU
+    size_t profile_values;
+} AbsorptionInfo;
+
+/**
+ * Build the transition matrix of a model.
+ * @param model
+ * @return the matrix, NULL in case of allocation error or if the model
+ * has more than INT32_MAX states.
+ */
+ChainMatrix *chain_matrix_create (const MarkovModel *model);
+
+/**
+ * Free the matrix and set it to NULL. Does nothing on NULL.
+ */
+void chain_matrix_free (ChainMatrix **ptr_matrix);
+
+/**
+ * Solve the absorbing chain equations (I - Q) t = 1 and (I - Q) u = t,
+ * Q being the moves between states that aren't absorbing, for the
+ * expected number of moves until a walk stops and its variance
+ * 2u - t - t^2, from every state (0 for the absorbing ones).
+ * @param matrix
+ * @param expected filled with the expected number of moves, size doubles
+ * @param variance filled with its variance, size doubles
+ * @param info filled with how it was solved, may be NULL
+ * @return ANALYTICS_SOLVED, or why expected and variance weren't filled.
+ */
+AnalyticsStatus solve_absorption (const ChainMatrix *matrix,
+                                  double *expected, double *variance,
+                                  AbsorptionInfo *info);
+
+/**
+ * Move a distribution over the states one turn forward: next = current P.
+ * Uses the dense matrix when there is one, the columns otherwise, with
+ * AVX2 when the CPU has it.
+ * @param matrix
+ * @param current the probability of being in each state, size doubles
+ * @param next filled with the probabilities a turn later, size doubles
+ */
+void step_distribution (const ChainMatrix *matrix, const double *current,
+                        double *next);
+
+/**
+ * @return "avx2" or "scalar": the products step_distribution uses on this
+ * CPU.
+ */
+const char *analytics_kernel_name (void);
+
+#endif //_CHAIN_ANALYTICS_H_
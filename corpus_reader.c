@@ -0,0 +1,622 @@
+#include "corpus_reader.h"
+#include <fcntl.h> // For open()
+#include <sys/mman.h> // For mmap()
+#include <sys/stat.h> // For fstat()
+#include <unistd.h> // For close(), sysconf()
+#include <stdio.h> // For fprintf()
+#include <string.h> // For memchr(), strerror()
+#include <stdint.h> // For uint64_t, uintptr_t
+#include <errno.h> // For EINTR
+#include <zlib.h> // For inflate()
+#if defined(__x86_64__) || defined(__i386__)
+#define TOKENIZER_X86
+#include <immintrin.h> // For the SSE2 and AVX2 intrinsics
+#endif
+
+#define CORPUS_CHUNK_SIZE (64 * 1024 * 1024)
+// streams are tokenized this many bytes at a time, read this many
+// compressed bytes at a time
+#define STREAM_CHUNK_SIZE (16 * 1024 * 1024)
+#define STREAM_INPUT_SIZE (1024 * 1024)
+// the first two bytes of every gzip member
+#define GZIP_MAGIC_0 0x1f
+#define GZIP_MAGIC_1 0x8b
+#define GZIP_WINDOW_BITS (16 + MAX_WBITS)
+#define STDIN_PATH "-"
+#define TOKENIZER_BLOCK 64
+#define SSE2_WIDTH 16
+#define AVX2_WIDTH 32
+
+/**
+ * Map the regular file open at fd, and close it.
+ */
+static bool map_file (int fd, const struct stat *file_stat, Corpus *corpus)
+{
+  corpus->len = (size_t) file_stat->st_size;
+  if (corpus->len == 0)
+  {
+    // mmap refuses empty mappings, an empty corpus needs none.
+    corpus->data = "";
+    close (fd);
+    return true;
+  }
+  void *data = mmap (NULL, corpus->len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED)
+  {
+    return false;
+  }
+  madvise (data, corpus->len, MADV_SEQUENTIAL);
+  corpus->data = data;
+  return true;
+}
+
+bool corpus_map (const char *path, Corpus *corpus)
+{
+  int fd = open (path, O_RDONLY);
+  if (fd < 0)
+  {
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat (fd, &file_stat) != 0 || !S_ISREG (file_stat.st_mode))
+  {
+    close (fd);
+    return false;
+  }
+  return map_file (fd, &file_stat, corpus);
+}
+
+bool corpus_open (const char *path, Corpus *corpus, int *stream_fd)
+{
+  *corpus = (Corpus) {"", 0};
+  *stream_fd = -1;
+  if (strcmp (path, STDIN_PATH) == 0)
+  {
+    *stream_fd = STDIN_FILENO;
+    return true;
+  }
+  int fd = open (path, O_RDONLY);
+  struct stat file_stat;
+  if (fd < 0 || fstat (fd, &file_stat) != 0)
+  {
+    if (fd >= 0)
+    {
+      close (fd);
+    }
+    return false;
+  }
+  unsigned char magic[2];
+  if (S_ISREG (file_stat.st_mode) &&
+      !(pread (fd, magic, sizeof (magic), 0) == sizeof (magic) &&
+        magic[0] == GZIP_MAGIC_0 && magic[1] == GZIP_MAGIC_1))
+  {
+    return map_file (fd, &file_stat, corpus);
+  }
+  *stream_fd = fd;
+  return true;
+}
+
+void corpus_close (Corpus *corpus, int stream_fd)
+{
+  if (stream_fd > STDIN_FILENO)
+  {
+    close (stream_fd);
+  }
+  corpus_unmap (corpus);
+}
+
+void corpus_unmap (Corpus *corpus)
+{
+  if (corpus->len > 0)
+  {
+    munmap ((void *) corpus->data, corpus->len);
+  }
+  corpus->data = NULL;
+  corpus->len = 0;
+}
+
+static bool is_delimiter (char c)
+{
+  return c == ' ' || c == '\n' || c == '\r';
+}
+
+#ifdef TOKENIZER_X86
+/**
+ * The bytes of one block of TOKENIZER_BLOCK bytes that are delimiters,
+ * newlines and dots, bit i for byte i.
+ */
+typedef struct BlockMasks {
+    uint64_t delimiters;
+    uint64_t newlines;
+    uint64_t dots;
+} BlockMasks;
+
+typedef void (*classify_function)(const char *block, BlockMasks *masks);
+
+__attribute__ ((target ("sse2")))
+static void classify_sse2 (const char *block, BlockMasks *masks)
+{
+  const __m128i spaces = _mm_set1_epi8 (' ');
+  const __m128i newlines = _mm_set1_epi8 ('\n');
+  const __m128i returns = _mm_set1_epi8 ('\r');
+  const __m128i dots = _mm_set1_epi8 ('.');
+  BlockMasks result = {0, 0, 0};
+  for (int i = 0; i < TOKENIZER_BLOCK; i += SSE2_WIDTH)
+  {
+    __m128i bytes = _mm_loadu_si128 ((const __m128i *) (block + i));
+    __m128i is_newline = _mm_cmpeq_epi8 (bytes, newlines);
+    __m128i is_delimiter = _mm_or_si128
+        (_mm_or_si128 (_mm_cmpeq_epi8 (bytes, spaces), is_newline),
+         _mm_cmpeq_epi8 (bytes, returns));
+    result.delimiters |= (uint64_t) (uint32_t) _mm_movemask_epi8
+        (is_delimiter) << i;
+    result.newlines |= (uint64_t) (uint32_t) _mm_movemask_epi8
+        (is_newline) << i;
+    result.dots |= (uint64_t) (uint32_t) _mm_movemask_epi8
+        (_mm_cmpeq_epi8 (bytes, dots)) << i;
+  }
+  *masks = result;
+}
+
+__attribute__ ((target ("avx2")))
+static void classify_avx2 (const char *block, BlockMasks *masks)
+{
+  const __m256i spaces = _mm256_set1_epi8 (' ');
+  const __m256i newlines = _mm256_set1_epi8 ('\n');
+  const __m256i returns = _mm256_set1_epi8 ('\r');
+  const __m256i dots = _mm256_set1_epi8 ('.');
+  BlockMasks result = {0, 0, 0};
+  for (int i = 0; i < TOKENIZER_BLOCK; i += AVX2_WIDTH)
+  {
+    __m256i bytes = _mm256_loadu_si256 ((const __m256i *) (block + i));
+    __m256i is_newline = _mm256_cmpeq_epi8 (bytes, newlines);
+    __m256i is_delimiter = _mm256_or_si256
+        (_mm256_or_si256 (_mm256_cmpeq_epi8 (bytes, spaces), is_newline),
+         _mm256_cmpeq_epi8 (bytes, returns));
+    result.delimiters |= (uint64_t) (uint32_t) _mm256_movemask_epi8
+        (is_delimiter) << i;
+    result.newlines |= (uint64_t) (uint32_t) _mm256_movemask_epi8
+        (is_newline) << i;
+    result.dots |= (uint64_t) (uint32_t) _mm256_movemask_epi8
+        (_mm256_cmpeq_epi8 (bytes, dots)) << i;
+  }
+  *masks = result;
+}
+
+/**
+ * Tokenize a block at a time, with the given way to classify the bytes
+ * of a block.
+ */
+static bool tokenize_blocks (const char *data, size_t len,
+                             classify_function classify,
+                             token_function on_token, void *context)
+{
+  char tail[TOKENIZER_BLOCK];
+  bool line_start = true;
+  size_t token_start = 0;
+  // whether the byte before the block was a delimiter (as is the one
+  // before data) or a dot
+  uint64_t prev_delimiter = 1, prev_dot = 0;
+  // the last block is padded with delimiters, which end its last token,
+  // so it is scanned even when empty
+  for (size_t base = 0; base <= len; base += TOKENIZER_BLOCK)
+  {
+    const char *block = data + base;
+    if (len - base < TOKENIZER_BLOCK)
+    {
+      memset (tail, ' ', TOKENIZER_BLOCK);
+      memcpy (tail, block, len - base);
+      block = tail;
+    }
+    BlockMasks masks;
+    classify (block, &masks);
+    // bit i set if byte i - 1 is a delimiter / a dot
+    uint64_t after_delimiter = masks.delimiters << 1 | prev_delimiter;
+    uint64_t after_dot = masks.dots << 1 | prev_dot;
+    uint64_t starts = ~masks.delimiters & after_delimiter;
+    uint64_t ends = masks.delimiters & ~after_delimiter;
+    prev_delimiter = masks.delimiters >> (TOKENIZER_BLOCK - 1);
+    prev_dot = masks.dots >> (TOKENIZER_BLOCK - 1);
+    // newlines are never inside a token, so each one starts a line for
+    // the next token start after it
+    uint64_t newlines = masks.newlines;
+    for (uint64_t events = starts | ends; events; events &= events - 1)
+    {
+      uint64_t bit = events & -events;
+      size_t pos = base + (size_t) __builtin_ctzll (events);
+      if (ends & bit)
+      {
+        if (!on_token (data + token_start, pos - token_start, line_start,
+                       (after_dot & bit) != 0, context))
+        {
+          return false;
+        }
+        line_start = false;
+        continue;
+      }
+      line_start = line_start || (newlines & (bit - 1)) != 0;
+      newlines &= ~(bit - 1);
+      token_start = pos;
+    }
+    line_start = line_start || newlines != 0;
+  }
+  return true;
+}
+#endif
+
+static TokenizerKind selected_tokenizer = TOKENIZER_AUTO;
+
+bool tokenizer_supported (TokenizerKind kind)
+{
+  switch (kind)
+  {
+    case TOKENIZER_AUTO:
+    case TOKENIZER_SCALAR:
+      return true;
+#ifdef TOKENIZER_X86
+    case TOKENIZER_SSE2:
+      return __builtin_cpu_supports ("sse2");
+    case TOKENIZER_AVX2:
+      return __builtin_cpu_supports ("avx2");
+#endif
+    default:
+      return false;
+  }
+}
+
+bool tokenizer_select (TokenizerKind kind)
+{
+  if (!tokenizer_supported (kind))
+  {
+    return false;
+  }
+  selected_tokenizer = kind;
+  return true;
+}
+
+/**
+ * @return the tokenizer TOKENIZER_AUTO stands for on this CPU, or the
+ * selected one.
+ */
+static TokenizerKind current_tokenizer (void)
+{
+  if (selected_tokenizer != TOKENIZER_AUTO)
+  {
+    return selected_tokenizer;
+  }
+  if (tokenizer_supported (TOKENIZER_AVX2))
+  {
+    return TOKENIZER_AVX2;
+  }
+  return tokenizer_supported (TOKENIZER_SSE2) ? TOKENIZER_SSE2
+                                              : TOKENIZER_SCALAR;
+}
+
+const char *tokenizer_name (void)
+{
+  switch (current_tokenizer ())
+  {
+    case TOKENIZER_AVX2:
+      return "avx2";
+    case TOKENIZER_SSE2:
+      return "sse2";
+    default:
+      return "scalar";
+  }
+}
+
+/**
+ * Tokenize a byte at a time, for CPUs without SSE2.
+ */
+static bool tokenize_scalar (const char *data, size_t len,
+                             token_function on_token, void *context)
+{
+  bool line_start = true;
+  size_t i = 0;
+  while (i < len)
+  {
+    if (is_delimiter (data[i]))
+    {
+      line_start = line_start || data[i] == '\n';
+      i++;
+      continue;
+    }
+    size_t start = i;
+    while (i < len && !is_delimiter (data[i]))
+    {
+      i++;
+    }
+    if (!on_token (data + start, i - start, line_start, data[i - 1] == '.',
+                   context))
+    {
+      return false;
+    }
+    line_start = false;
+  }
+  return true;
+}
+
+bool tokenize_corpus (const char *data, size_t len, token_function on_token,
+                      void *context)
+{
+  switch (current_tokenizer ())
+  {
+#ifdef TOKENIZER_X86
+    case TOKENIZER_AVX2:
+      return tokenize_blocks (data, len, &classify_avx2, on_token, context);
+    case TOKENIZER_SSE2:
+      return tokenize_blocks (data, len, &classify_sse2, on_token, context);
+#endif
+    default:
+      return tokenize_scalar (data, len, on_token, context);
+  }
+}
+
+bool tokenize_mapped_corpus (const Corpus *corpus, token_function on_token,
+                             void *context)
+{
+  uintptr_t page_mask = (uintptr_t) sysconf (_SC_PAGESIZE) - 1;
+  // only whole pages of this corpus are dropped, by their address: a
+  // shard starts and ends anywhere in the mapping, and its first and last
+  // pages may hold another shard's lines
+  uintptr_t released = ((uintptr_t) corpus->data + page_mask) & ~page_mask;
+  bool releasing = true;
+  size_t start = 0;
+  while (start < corpus->len)
+  {
+    // cut chunks right after a newline, so each one starts a line
+    size_t end = corpus->len;
+    size_t cut = start + CORPUS_CHUNK_SIZE;
+    if (cut < corpus->len)
+    {
+      const char *newline = memchr (corpus->data + cut, '\n',
+                                    corpus->len - cut);
+      end = newline ? (size_t) (newline - corpus->data) + 1 : corpus->len;
+    }
+    if (!tokenize_corpus (corpus->data + start, end - start, on_token,
+                          context))
+    {
+      return false;
+    }
+    uintptr_t release_end = (uintptr_t) (corpus->data + end) & ~page_mask;
+    if (releasing && release_end > released)
+    {
+      if (madvise ((void *) released, release_end - released,
+                   MADV_DONTNEED) != 0)
+      {
+        // tokenizing goes on, the pages just stay resident
+        fprintf (stderr, "Warning: can't drop the tokenized pages: %s\n",
+                 strerror (errno));
+        releasing = false;
+      }
+      released = release_end;
+    }
+    start = end;
+  }
+  return true;
+}
+
+/**
+ * Where tokenize_stream gets its text from: the bytes read from fd as
+ * they are, or inflated if they start like gzip.
+ */
+typedef struct StreamSource {
+    int fd;
+    bool gzip;
+    // no more bytes to read from fd
+    bool end_of_input;
+    // the last gzip member inflated ended, and no next one started yet
+    bool member_ended;
+    // bytes read from fd and not used yet, STREAM_INPUT_SIZE of them
+    unsigned char *input;
+    z_stream inflater;
+    CorpusStream *stream;
+} StreamSource;
+
+/**
+ * Read up to len bytes from the source's descriptor into buffer.
+ * @return the number of bytes read, 0 at the end of the input, -1 on
+ * error.
+ */
+static ssize_t read_input (StreamSource *source, void *buffer, size_t len)
+{
+  ssize_t got;
+  do
+  {
+    got = read (source->fd, buffer, len);
+  }
+  while (got < 0 && errno == EINTR);
+  if (got == 0)
+  {
+    source->end_of_input = true;
+  }
+  if (got > 0)
+  {
+    source->stream->bytes_read += (size_t) got;
+  }
+  return got;
+}
+
+/**
+ * Read the first bytes of the descriptor to tell if it's gzip, and set
+ * the inflater up if so.
+ * @return false on read or allocation error.
+ */
+static bool open_source (StreamSource *source, int fd, CorpusStream *stream)
+{
+  memset (source, 0, sizeof (StreamSource));
+  source->fd = fd;
+  source->stream = stream;
+  source->input = malloc (STREAM_INPUT_SIZE);
+  if (!source->input)
+  {
+    return false;
+  }
+  // a pipe may hand over a single byte at first
+  size_t have = 0;
+  while (have < 2 && !source->end_of_input)
+  {
+    ssize_t got = read_input (source, source->input + have,
+                              STREAM_INPUT_SIZE - have);
+    if (got < 0)
+    {
+      return false;
+    }
+    have += (size_t) got;
+  }
+  source->inflater.next_in = source->input;
+  source->inflater.avail_in = (uInt) have;
+  source->gzip = have >= 2 && source->input[0] == GZIP_MAGIC_0 &&
+                 source->input[1] == GZIP_MAGIC_1;
+  stream->gzip = source->gzip;
+  return !source->gzip ||
+         inflateInit2 (&source->inflater, GZIP_WINDOW_BITS) == Z_OK;
+}
+
+static void close_source (StreamSource *source)
+{
+  if (source->gzip)
+  {
+    inflateEnd (&source->inflater);
+  }
+  free (source->input);
+}
+
+/**
+ * Inflate into buffer until it holds some text or the input ends.
+ * Members of a concatenated gzip stream are inflated one after the
+ * other.
+ * @return the number of bytes inflated, 0 at the end of the stream, -1 if
+ * the input isn't valid gzip or ends in the middle of a member.
+ */
+static ssize_t inflate_some (StreamSource *source, char *buffer, size_t len)
+{
+  z_stream *inflater = &source->inflater;
+  inflater->next_out = (Bytef *) buffer;
+  inflater->avail_out = (uInt) len;
+  while (inflater->avail_out == len)
+  {
+    if (inflater->avail_in == 0 && !source->end_of_input)
+    {
+      ssize_t got = read_input (source, source->input, STREAM_INPUT_SIZE);
+      if (got < 0)
+      {
+        return -1;
+      }
+      inflater->next_in = source->input;
+      inflater->avail_in = (uInt) got;
+    }
+    if (inflater->avail_in == 0 && source->end_of_input)
+    {
+      // the input may only end right after a member
+      return source->member_ended ? 0 : -1;
+    }
+    source->member_ended = false;
+    int result = inflate (inflater, Z_NO_FLUSH);
+    if (result == Z_STREAM_END)
+    {
+      source->member_ended = true;
+      inflateReset (inflater);
+    }
+    else if (result != Z_OK)
+    {
+      return -1;
+    }
+  }
+  return (ssize_t) (len - inflater->avail_out);
+}
+
+/**
+ * Put up to len bytes of text from the source into buffer.
+ * @return the number of bytes, 0 at the end of the text, -1 on error.
+ */
+static ssize_t read_text (StreamSource *source, char *buffer, size_t len)
+{
+  if (source->gzip)
+  {
+    return inflate_some (source, buffer, len);
+  }
+  // the bytes read to tell if it's gzip come first
+  z_stream *sniffed = &source->inflater;
+  if (sniffed->avail_in > 0)
+  {
+    size_t count = sniffed->avail_in < len ? sniffed->avail_in : len;
+    memcpy (buffer, sniffed->next_in, count);
+    sniffed->next_in += count;
+    sniffed->avail_in -= (uInt) count;
+    return (ssize_t) count;
+  }
+  return source->end_of_input ? 0 : read_input (source, buffer, len);
+}
+
+/**
+ * @return the length of the buffer up to and including its last newline,
+ * 0 if it has none.
+ */
+static size_t complete_lines (const char *buffer, size_t len)
+{
+  while (len > 0 && buffer[len - 1] != '\n')
+  {
+    len--;
+  }
+  return len;
+}
+
+bool tokenize_stream (int fd, token_function on_token, void *context,
+                      CorpusStream *stream)
+{
+  memset (stream, 0, sizeof (CorpusStream));
+  StreamSource source;
+  size_t capacity = STREAM_CHUNK_SIZE;
+  char *buffer = malloc (capacity);
+  if (!buffer || !open_source (&source, fd, stream))
+  {
+    stream->failed = true;
+    if (buffer)
+    {
+      close_source (&source);
+    }
+    free (buffer);
+    return false;
+  }
+  size_t len = 0;
+  bool tokenized = true, ended = false;
+  while (tokenized && !ended)
+  {
+    // fill the buffer, then tokenize the complete lines in it and keep
+    // the line that goes on for the next round
+    while (len < capacity && !ended)
+    {
+      ssize_t got = read_text (&source, buffer + len, capacity - len);
+      stream->failed = got < 0;
+      ended = got <= 0;
+      len += got > 0 ? (size_t) got : 0;
+    }
+    if (stream->failed)
+    {
+      break;
+    }
+    size_t lines = ended ? len : complete_lines (buffer, len);
+    if (lines == 0)
+    {
+      // a single line longer than the buffer
+      char *grown = realloc (buffer, capacity * 2);
+      if (!grown)
+      {
+        stream->failed = true;
+        break;
+      }
+      buffer = grown;
+      capacity *= 2;
+      continue;
+    }
+    tokenized = tokenize_corpus (buffer, lines, on_token, context);
+    stream->bytes += lines;
+    memmove (buffer, buffer + lines, len - lines);
+    len -= lines;
+  }
+  close_source (&source);
+  free (buffer);
+  return tokenized && !stream->failed;
+}
@@ -0,0 +1,150 @@
+#ifndef _CORPUS_READER_H_
+#define _CORPUS_READER_H_
+
+#include <stdlib.h> // For size_t
+#include <stdbool.h> // for bool
+
+/**
+ * A corpus file mapped read only into memory.
+ */
+typedef struct Corpus {
+    const char *data;
+    size_t len;
+} Corpus;
+
+/**
+ * What tokenize_stream read.
+ */
+typedef struct CorpusStream {
+    // bytes read from the descriptor, compressed if gzip
+    size_t bytes_read;
+    // bytes of text tokenized
+    size_t bytes;
+    bool gzip;
+    // the descriptor couldn't be read, the gzip data was corrupt or cut
+    // short, or a buffer couldn't be allocated
+    bool failed;
+} CorpusStream;
+
+/**
+ * Called for every token found by tokenize_corpus.
+ * @param token start of the token, inside the tokenized buffer (not null
+ * terminated)
+ * @param len number of bytes in the token
+ * @param line_start true if this is the first token of its line
+ * @param ends_sentence true if the token ends with a '.', found while
+ * scanning for its end
+ * @param context the context given to tokenize_corpus
+ * @return true to keep going, false to stop tokenizing.
+ */
+typedef bool (*token_function)(const char *token, size_t len,
+                               bool line_start, bool ends_sentence,
+                               void *context);
+
+/**
+ * Ways to find the delimiters of the corpus: a byte at a time, or 16
+ * (SSE2) or 32 (AVX2) bytes at a time on x86 CPUs that have them.
+ */
+typedef enum TokenizerKind {
+    // the fastest one the CPU supports
+    TOKENIZER_AUTO,
+    TOKENIZER_SCALAR,
+    TOKENIZER_SSE2,
+    TOKENIZER_AVX2
+} TokenizerKind;
+
+/**
+ * Memory-map the file at the given path.
+ * @param path
+ * @param corpus filled with the mapping on success
+ * @return true on success, false if the file can't be opened or mapped.
+ */
+bool corpus_map (const char *path, Corpus *corpus);
+
+/**
+ * Unmap a corpus mapped by corpus_map.
+ */
+void corpus_unmap (Corpus *corpus);
+
+/**
+ * Open the corpus at the given path the fastest way it can be read:
+ * regular files are mapped like corpus_map, unless they are gzip.
+ * Anything else, gzip files, pipes and "-" for stdin, is left open in
+ * stream_fd for tokenize_stream to read.
+ * @param path
+ * @param corpus filled with the mapping, empty if streamed
+ * @param stream_fd filled with the descriptor to stream, -1 if mapped
+ * @return true on success, false if the file can't be opened or mapped.
+ */
+bool corpus_open (const char *path, Corpus *corpus, int *stream_fd);
+
+/**
+ * Unmap or close what corpus_open opened (but not stdin).
+ */
+void corpus_close (Corpus *corpus, int stream_fd);
+
+/**
+ * @return true if the given tokenizer can run on this CPU.
+ */
+bool tokenizer_supported (TokenizerKind kind);
+
+/**
+ * Choose the tokenizer every later tokenize_corpus uses (TOKENIZER_AUTO
+ * until then). Call before tokenizing, not while other threads are.
+ * @return false (leaving the choice as is) if the CPU doesn't support it.
+ */
+bool tokenizer_select (TokenizerKind kind);
+
+/**
+ * @return the name of the tokenizer tokenize_corpus uses: "scalar",
+ * "sse2" or "avx2".
+ */
+const char *tokenizer_name (void);
+
+/**
+ * Split the buffer into words, in place and without copying. Words are
+ * separated by ' ', '\r' and '\n', and lines by '\n'. Lines may be of
+ * any length. The SSE2 and AVX2 tokenizers scan the buffer 64 bytes at
+ * a time, finding the delimiters, newlines and dots of each block with
+ * vector compares and walking the tokens of the block by bit masks.
+ * @param data the buffer to tokenize
+ * @param len number of bytes in data
+ * @param on_token called for every word in order
+ * @param context passed as is to on_token
+ * @return true if the whole buffer was tokenized, false if on_token
+ * stopped it.
+ */
+bool tokenize_corpus (const char *data, size_t len, token_function on_token,
+                      void *context);
+
+/**
+ * Tokenize a whole mapped corpus like tokenize_corpus, a chunk of lines
+ * at a time, dropping every chunk's whole pages once it was tokenized so
+ * the resident size stays bounded on huge files (a warning goes to
+ * stderr if they can't be). The corpus may be a shard anywhere in a
+ * mapping. Tokens must not be used after on_token returns.
+ * @return true if the whole corpus was tokenized, false if on_token
+ * stopped it.
+ */
+bool tokenize_mapped_corpus (const Corpus *corpus, token_function on_token,
+                             void *context);
+
+/**
+ * Tokenize everything that can be read from the descriptor like
+ * tokenize_corpus, inflating it first if it starts like gzip
+ * (concatenated members included). The text is read 16 MB at a time
+ * into one buffer and only its complete lines are tokenized, the line
+ * that goes on being kept for the next round, so memory stays bounded
+ * whatever the stream's size (the buffer only grows for a line longer
+ * than it). Tokens must not be used after on_token returns.
+ * @param fd
+ * @param on_token called for every word in order
+ * @param context passed as is to on_token
+ * @param stream filled with what was read
+ * @return true if the whole stream was tokenized, false if on_token
+ * stopped it or stream->failed.
+ */
+bool tokenize_stream (int fd, token_function on_token, void *context,
+                      CorpusStream *stream);
+
+#endif //_CORPUS_READER_H_
@@ -1,26 +1,33 @@
-#include "linked_list.h"
-#include "markov_chain.h"
-
-int add(LinkedList *link_list, void *data)
-{
-    Node *new_node = malloc(sizeof(Node));
-    if (new_node == NULL)
-    {
-        return 1;
-    }
-    *new_node = (Node) {data, NULL};
-
-    if (link_list->first == NULL)
-    {
-        link_list->first = new_node;
-        link_list->last = new_node;
-    }
-    else
-    {
-        link_list->last->next = new_node;
-        link_list->last = new_node;
-    }
-
-    link_list->size++;
-    return 0;
-}
+#include "linked_list.h"
+#include "markov_chain.h"
+#include "markov_stats.h"
+
+int add(LinkedList *link_list, void *data)
+{
+    STATS_ALLOC (sizeof (Node));
+    Node *new_node = malloc(sizeof(Node));
+    if (new_node == NULL)
+    {
+        return 1;
+    }
+    link_node (link_list, new_node, data);
+    return 0;
+}
+
+void link_node (LinkedList *link_list, Node *node, struct MarkovNode *data)
+{
+    *node = (Node) {data, NULL};
+
+    if (link_list->first == NULL)
+    {
+        link_list->first = node;
+        link_list->last = node;
+    }
+    else
+    {
+        link_list->last->next = node;
+        link_list->last = node;
+    }
+
+    link_list->size++;
+}
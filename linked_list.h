@@ -1,26 +1,35 @@
-#ifndef _LINKEDLIST_H_
-#define _LINKEDLIST_H_
-#include <stdlib.h> // For malloc()
-
-typedef struct Node {
-    struct MarkovNode *data;
-    struct Node *next;
-} Node;
-
-typedef struct LinkedList {
-    Node *first;
-    Node *last;
-    int size;
-} LinkedList;
-
-/**
- * Add data to new markov_node at the end of the given link list.
- * @param link_list Link list to add data to
- * @param data pointer to dynamically allocated data
- * @return 0 on success, 1 otherwise
- */
-int add (LinkedList *link_list, void *data);
-
-#endif //_LINKEDLIST_H_
-
-void print_frequencies(LinkedList *link_list); //TODO: delete later
+#ifndef _LINKEDLIST_H_
+#define _LINKEDLIST_H_
+#include <stdlib.h> // For malloc()
+
+typedef struct Node {
+    struct MarkovNode *data;
+    struct Node *next;
+} Node;
+
+typedef struct LinkedList {
+    Node *first;
+    Node *last;
+    int size;
+} LinkedList;
+
+/**
+ * Add data to new markov_node at the end of the given link list.
+ * @param link_list Link list to add data to
+ * @param data pointer to dynamically allocated data
+ * @return 0 on success, 1 otherwise
+ */
+int add (LinkedList *link_list, void *data);
+
+/**
+ * Like add, with a list node allocated by the caller (e.g. from a pool)
+ * instead of by malloc.
+ * @param link_list Link list to add data to
+ * @param node the list node to link at the end, owned by the caller
+ * @param data pointer to the markov_node it holds
+ */
+void link_node (LinkedList *link_list, Node *node, struct MarkovNode *data);
+
+#endif //_LINKEDLIST_H_
+
+void print_frequencies(LinkedList *link_list); //TODO: delete later
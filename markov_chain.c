@@ -1,222 +1,2767 @@
-#include "markov_chain.h"
-
-
-bool add_new_node_to_frequency_list(MarkovNode *first_node,
-                                    MarkovNode *second_node)
-{
-  if(first_node->freq_list_act_size < first_node->freq_list_full_size)
-  {
-    first_node->frequencies_list[first_node->freq_list_act_size]
-    .next_object = second_node;
-    first_node->frequencies_list[first_node->freq_list_act_size]
-        .frequency = 1;
-    first_node->freq_list_act_size += 1;
-    return true;
-  }
-  // In this case we don't have enough memory, and need to reallocate.
-  MarkovNodeFrequency *temp =
-      realloc (first_node->frequencies_list, (1 +
-      first_node->freq_list_act_size) * sizeof(MarkovNodeFrequency));
-  if(!temp)
-  {
-    free(first_node->frequencies_list);
-    first_node->frequencies_list = NULL;
-    return false;
-  }
-  first_node->frequencies_list = temp;
-  first_node->frequencies_list[first_node->freq_list_act_size]
-  .next_object = second_node;
-  first_node->frequencies_list[first_node->freq_list_act_size]
-      .frequency = 1;
-  first_node->freq_list_act_size += 1;
-  first_node->freq_list_full_size += 1;
-  return true;
-}
-
-Node *get_node_from_database (MarkovChain *markov_chain, void
-*data_ptr)
-{
-  Node *curr = markov_chain->database->first;
-  while(curr)
-  {
-    void *curr_s = curr->data->data;
-    if(markov_chain->comp_func(curr_s, data_ptr) == 0)
-    {
-      return curr;
-    }
-    curr = curr->next;
-  }
-  return NULL;
-}
-
-
-Node *add_to_database (MarkovChain *markov_chain, void *data_ptr)
-{
-  Node *curr_node = get_node_from_database (markov_chain, data_ptr);
-  if(!curr_node){
-    MarkovNode *new_mark_node = malloc (sizeof (MarkovNode));
-    if(!new_mark_node)
-    {
-      return NULL;
-    }
-    new_mark_node->data = markov_chain->copy_func(data_ptr);
-    new_mark_node->frequencies_list = NULL;
-    new_mark_node->freq_list_act_size = 0;
-    new_mark_node->freq_list_full_size = 0;
-    if (add (markov_chain->database, new_mark_node) != 0)
-    {
-      // Roll back allocation to avoid leak on add() failure
-      markov_chain->free_data(new_mark_node->data);
-      new_mark_node->data = NULL;
-      free(new_mark_node);
-      return NULL;
-    }
-    return get_node_from_database (markov_chain, data_ptr);
-  }
-  return curr_node;
-}
-
-bool add_node_to_frequencies_list (MarkovNode *first_node,
-                                   MarkovNode *second_node,
-                                   MarkovChain *markov_chain)
-{
-  MarkovNodeFrequency *freq_lst = first_node->frequencies_list;
-  // Adds 1 to the frequency parameter if second node exists in the
-  // list.
-  for(size_t i=0; i < first_node->freq_list_act_size; i++)
-  {
-    if(markov_chain->comp_func(freq_lst[i].next_object->data,
-        second_node->data)==0)
-    {
-      freq_lst[i].frequency += 1;
-      return true;
-    }
-  }
-  // otherwise, add the second node into the first one's frequency
-  // list.
-  if(add_new_node_to_frequency_list (first_node, second_node))
-  {
-    return true;
-  }
-  return false;
-}
-
-void free_database (MarkovChain **ptr_chain)
-{
-  // changed to last, cause apparently it goes from last to first...
-  Node *curr = (*ptr_chain)->database->first;
-  while(curr)
-  {
-    MarkovNode *curr_mark = curr->data;
-    (*ptr_chain)->free_data(curr_mark->data);
-    curr_mark->data = NULL;
-    free(curr_mark->frequencies_list);
-    curr_mark->frequencies_list = NULL;
-    free(curr_mark);
-    curr_mark = NULL;
-    Node *temp_next = curr->next;
-    free(curr);
-    curr = NULL;
-    curr = temp_next;
-  }
-  free((*ptr_chain)->database);
-  ((*ptr_chain)->database) = NULL;
-  free((*ptr_chain));
-  *ptr_chain = NULL;
-}
-int get_random_number (int max_number)
-{
-  return rand() % max_number;
-}
-
-Node *get_first_random_node_helper (MarkovChain *markov_chain,
-                              int* ind, Node *curr_node)
-{
-  while(markov_chain->is_last(curr_node->data->data) ||
-  curr_node->data->frequencies_list == NULL)
-  {
-    *ind = get_random_number (markov_chain->database->size);
-    curr_node = markov_chain->database->first;
-    for(int i=0; i < *ind; i++)
-    {
-      curr_node = curr_node->next;
-    }
-  }
-  return curr_node;
-}
-
-MarkovNode *get_first_random_node (MarkovChain *markov_chain)
-{
-  int ind = get_random_number (markov_chain->database->size);
-  Node *curr_node = markov_chain->database->first;
-  for(int i=0; i < ind; i++)
-  {
-    curr_node = curr_node->next;
-  }
-  curr_node = get_first_random_node_helper (markov_chain, &ind,
-                                         curr_node);
-  return curr_node->data;
-}
-
-MarkovNode *get_next_random_node (MarkovNode *state_struct_ptr)
-{
-  int total_freq = 0;
-  for (size_t i = 0; i < state_struct_ptr->freq_list_act_size; i++)
-  {
-    total_freq += state_struct_ptr->frequencies_list[i].frequency;
-  }
-  MarkovNode **mark_arr = malloc(total_freq * sizeof(MarkovNode *));
-  if (mark_arr == NULL)
-  {
-    fprintf(stdout, "Allocation failure: can't allocate an array.");
-    return NULL;
-  }
-  int k = 0;
-  for (size_t i = 0; i < state_struct_ptr->freq_list_act_size; i++) {
-    MarkovNodeFrequency freq = state_struct_ptr->frequencies_list[i];
-    for (int j = 0; j < freq.frequency; j++) {
-      mark_arr[k] = freq.next_object;
-      k++;
-    }
-  }
-  int rand_ind = get_random_number (total_freq);
-  MarkovNode *chosen_node = mark_arr[rand_ind];
-  free(mark_arr);
-  mark_arr = NULL;
-  return chosen_node;
-}
-
-
-void generate_tweet (MarkovChain *markov_chain, MarkovNode
-  *first_node, int max_length)
-/** First we'll create an array to hold pointers to chars, which we'll
- * receive from the Markov nodes. The array will be used to store
- * the tweet. **/
-{
-  int arr_len = 1;
-  void* tweet[MAX_TWEET_LEN] = {first_node->data};
-  MarkovNode *curr_node = first_node;
-  for(int i=1; i<max_length; i++)
-  {
-    curr_node = get_next_random_node (curr_node);
-    tweet[i] = curr_node->data;
-    if(markov_chain->is_last(curr_node->data) ||
-    curr_node->frequencies_list == NULL)
-    {
-      arr_len = i;
-      break;
-    }
-    arr_len = i;
-  }
-  for(int j=0; j<arr_len; j++)
-  {
-    markov_chain->print_func(tweet[j]);
-    markov_chain->print_func(" ");
-  }
-  markov_chain->print_func(tweet[arr_len]);
-  if(arr_len == MAX_TWEET_LEN-1)
-  {
-    markov_chain->print_func(".");
-  }
-  markov_chain->print_func("\n");
-}
+#include "markov_chain.h"
+#include <string.h> // For memset(), memcpy(), strlen()
+#include <fcntl.h> // For open()
+#include <sys/mman.h> // For mmap()
+#include <sys/stat.h> // For fstat()
+#include <unistd.h> // For close()
+#include <limits.h> // For CHAR_BIT
+#include <pthread.h> // For the batch generation thread pool
+#include "output_buffer.h"
+#include "markov_stats.h"
+#if defined(__x86_64__) || defined(__i386__)
+#define RNG_X86
+#include <immintrin.h> // For the AVX2 intrinsics
+#endif
+
+
+/**
+ * Append second_node to first_node's frequency list with a count of 1,
+ * doubling the list when it is full.
+ */
+static bool add_new_node_to_frequency_list(MarkovChain *markov_chain,
+                                           MarkovNode *first_node,
+                                           MarkovNode *second_node)
+{
+  if(first_node->freq_list_act_size == first_node->freq_list_full_size)
+  {
+    // In this case we don't have enough memory, and need to grow.
+    size_t old_size = first_node->freq_list_full_size;
+    size_t new_size = old_size ? old_size * 2 : 1;
+    MarkovNodeFrequency *temp = pool_alloc_array
+        (markov_chain->pool, new_size * sizeof (MarkovNodeFrequency));
+    if(!temp)
+    {
+      return false;
+    }
+    if (old_size)
+    {
+      memcpy (temp, first_node->frequencies_list,
+              old_size * sizeof (MarkovNodeFrequency));
+    }
+    pool_release_array (markov_chain->pool, first_node->frequencies_list,
+                        old_size * sizeof (MarkovNodeFrequency));
+    // the sampler is sized by the list, and out of date by now anyway
+    pool_release_array (markov_chain->pool, first_node->cumulative_freqs,
+                        old_size * sizeof (uint64_t));
+    first_node->cumulative_freqs = NULL;
+    first_node->frequencies_list = temp;
+    first_node->freq_list_full_size = new_size;
+  }
+  first_node->frequencies_list[first_node->freq_list_act_size]
+  .next_object = second_node;
+  first_node->frequencies_list[first_node->freq_list_act_size]
+      .frequency = 1;
+  first_node->freq_list_act_size += 1;
+  return true;
+}
+
+#define STATE_INDEX_INIT_CAPACITY 64
+
+/** Spreads weak hashes (like small ints) over the whole word. */
+static size_t mix_hash (size_t hash)
+{
+  unsigned long long h = hash;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return (size_t) h;
+}
+
+/**
+ * Find the slot holding data_ptr, or the empty slot it should go to.
+ */
+static StateIndexSlot *find_index_slot (MarkovChain *markov_chain,
+                                        void *data_ptr, size_t hash)
+{
+  StateIndex *index = &markov_chain->state_index;
+  size_t mask = index->capacity - 1;
+  size_t pos = hash & mask;
+  while (index->slots[pos].node)
+  {
+    STATS_ADD (STATS_LOOKUP_COMPARES, 1);
+    if (index->slots[pos].hash == hash &&
+        markov_chain->comp_func (index->slots[pos].node->data->data,
+                                 data_ptr) == 0)
+    {
+      return &index->slots[pos];
+    }
+    pos = (pos + 1) & mask;
+  }
+  return &index->slots[pos];
+}
+
+static bool grow_state_index (MarkovChain *markov_chain)
+{
+  StateIndex *index = &markov_chain->state_index;
+  size_t new_capacity = index->capacity ? index->capacity * 2 :
+                        STATE_INDEX_INIT_CAPACITY;
+  STATS_ALLOC (new_capacity * sizeof (StateIndexSlot));
+  StateIndexSlot *new_slots = calloc (new_capacity,
+                                      sizeof (StateIndexSlot));
+  if (!new_slots)
+  {
+    return false;
+  }
+  size_t mask = new_capacity - 1;
+  for (size_t i = 0; i < index->capacity; i++)
+  {
+    if (!index->slots[i].node)
+    {
+      continue;
+    }
+    size_t pos = index->slots[i].hash & mask;
+    while (new_slots[pos].node)
+    {
+      pos = (pos + 1) & mask;
+    }
+    new_slots[pos] = index->slots[i];
+  }
+  free (index->slots);
+  index->slots = new_slots;
+  index->capacity = new_capacity;
+  return true;
+}
+
+/**
+ * Make sure the index has room for one more state.
+ */
+static bool reserve_state_index (MarkovChain *markov_chain)
+{
+  StateIndex *index = &markov_chain->state_index;
+  size_t needed = (size_t) markov_chain->database->size + 1;
+  // keep the load factor under 3/4
+  while (needed * 4 > index->capacity * 3)
+  {
+    if (!grow_state_index (markov_chain))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static Node *scan_database (MarkovChain *markov_chain, void *data_ptr)
+{
+  Node *curr = markov_chain->database->first;
+  while(curr)
+  {
+    void *curr_s = curr->data->data;
+    STATS_ADD (STATS_LOOKUP_COMPARES, 1);
+    if(markov_chain->comp_func(curr_s, data_ptr) == 0)
+    {
+      return curr;
+    }
+    curr = curr->next;
+  }
+  return NULL;
+}
+
+Node *get_node_from_database (MarkovChain *markov_chain, void
+*data_ptr)
+{
+  STATS_ADD (STATS_LOOKUPS, 1);
+  if (!markov_chain->hash_func)
+  {
+    return scan_database (markov_chain, data_ptr);
+  }
+  if (markov_chain->state_index.capacity == 0)
+  {
+    return NULL;
+  }
+  size_t hash = mix_hash (markov_chain->hash_func (data_ptr));
+  return find_index_slot (markov_chain, data_ptr, hash)->node;
+}
+
+void *intern_context (MarkovChain *markov_chain, const uint32_t *word_ids)
+{
+  return (void *) arena_intern (markov_chain->contexts,
+                                (const char *) word_ids,
+                                (size_t) markov_chain->order *
+                                sizeof (uint32_t));
+}
+
+uint32_t context_word_id (const void *context, int i)
+{
+  uint32_t id;
+  memcpy (&id, (const char *) context + i * sizeof (uint32_t),
+          sizeof (uint32_t));
+  return id;
+}
+
+/**
+ * @return the (last) word of the given state: the state itself in a
+ * chain of order 1, the last word of its context otherwise.
+ */
+static void *state_word (MarkovChain *markov_chain, void *data)
+{
+  if (markov_chain->order <= 1)
+  {
+    return data;
+  }
+  return (void *) arena_string (markov_chain->arena, context_word_id
+      (data, markov_chain->order - 1));
+}
+
+/**
+ * Look the context of src_chain up in dst_chain, translating each of its
+ * words like merge_chain does.
+ * @return the context in dst_chain, NULL on failure.
+ */
+static void *translate_context (MarkovChain *dst_chain,
+                                MarkovChain *src_chain, void *src_context,
+                                translate_function translate, void *context)
+{
+  uint32_t word_ids[MAX_ORDER];
+  for (int i = 0; i < src_chain->order; i++)
+  {
+    void *word = (void *) arena_string (src_chain->arena, context_word_id
+        (src_context, i));
+    if (translate)
+    {
+      word = translate (word, context);
+    }
+    if (!word)
+    {
+      return NULL;
+    }
+    word_ids[i] = arena_string_id (word);
+  }
+  return intern_context (dst_chain, word_ids);
+}
+
+/**
+ * Fenwick tree helpers. The tree of n values lives in tree[0..n-1], with
+ * tree[i - 1] holding the sum of the lowbit(i) values ending at value i.
+ */
+static size_t lowbit (size_t i)
+{
+  return i & (~i + 1);
+}
+
+/** @return the sum of the values before pos. */
+static uint64_t fenwick_prefix (const uint64_t *tree, size_t pos)
+{
+  uint64_t sum = 0;
+  for (size_t i = pos; i > 0; i -= lowbit (i))
+  {
+    sum += tree[i - 1];
+  }
+  return sum;
+}
+
+static void fenwick_add (uint64_t *tree, size_t size, size_t pos,
+                         uint64_t delta)
+{
+  for (size_t i = pos + 1; i <= size; i += lowbit (i))
+  {
+    tree[i - 1] += delta;
+  }
+}
+
+/**
+ * Append a zero value to a tree of size - 1 values.
+ */
+static void fenwick_append_zero (uint64_t *tree, size_t size)
+{
+  tree[size - 1] = fenwick_prefix (tree, size - 1) -
+                   fenwick_prefix (tree, size - lowbit (size));
+}
+
+/**
+ * @return the first position whose running sum passes target, the same
+ * one search_cumulative finds in the running sums of the values.
+ */
+static size_t fenwick_search (const uint64_t *tree, size_t size,
+                              uint64_t target)
+{
+  size_t step = 1;
+  while (step * 2 <= size)
+  {
+    step *= 2;
+  }
+  size_t pos = 0;
+  for (; step > 0; step /= 2)
+  {
+    if (pos + step <= size && tree[pos + step - 1] <= target)
+    {
+      pos += step;
+      target -= tree[pos - 1];
+    }
+  }
+  return pos;
+}
+
+/**
+ * Make room for one more state in the per-state arrays.
+ */
+static bool reserve_state_arrays (MarkovChain *markov_chain)
+{
+  size_t size = (size_t) markov_chain->database->size;
+  if (size < markov_chain->nodes_capacity)
+  {
+    return true;
+  }
+  size_t new_capacity = markov_chain->nodes_capacity ?
+                        markov_chain->nodes_capacity * 2 :
+                        STATE_INDEX_INIT_CAPACITY;
+  // the node pointers and both trees
+  STATS_ALLOC (new_capacity * sizeof (MarkovNode *));
+  STATS_ALLOC (new_capacity * sizeof (uint64_t));
+  STATS_ALLOC (new_capacity * sizeof (uint64_t));
+  MarkovNode **nodes = realloc (markov_chain->nodes,
+                                new_capacity * sizeof (MarkovNode *));
+  if (!nodes)
+  {
+    return false;
+  }
+  markov_chain->nodes = nodes;
+  uint64_t *counts = realloc (markov_chain->start_counts,
+                              new_capacity * sizeof (uint64_t));
+  if (!counts)
+  {
+    return false;
+  }
+  markov_chain->start_counts = counts;
+  uint64_t *weights = realloc (markov_chain->start_weights,
+                               new_capacity * sizeof (uint64_t));
+  if (!weights)
+  {
+    return false;
+  }
+  markov_chain->start_weights = weights;
+  markov_chain->nodes_capacity = new_capacity;
+  return true;
+}
+
+static Node *append_new_state (MarkovChain *markov_chain, void *data_ptr)
+{
+  if (!markov_chain->pool)
+  {
+    markov_chain->pool = pool_create ();
+  }
+  if (!markov_chain->pool || !reserve_state_arrays (markov_chain))
+  {
+    return NULL;
+  }
+  Node *new_node = pool_alloc (markov_chain->pool, sizeof (Node));
+  MarkovNode *new_mark_node = pool_alloc (markov_chain->pool,
+                                          sizeof (MarkovNode));
+  if(!new_node || !new_mark_node)
+  {
+    return NULL;
+  }
+  // copying interns or allocates, and may fail. the pool takes the nodes
+  // back with the chain.
+  new_mark_node->data = markov_chain->copy_func(data_ptr);
+  if (!new_mark_node->data)
+  {
+    return NULL;
+  }
+  new_mark_node->index = (size_t) markov_chain->database->size;
+  new_mark_node->frequencies_list = NULL;
+  new_mark_node->freq_list_act_size = 0;
+  new_mark_node->freq_list_full_size = 0;
+  new_mark_node->successor_index = NULL;
+  new_mark_node->successor_index_capacity = 0;
+  new_mark_node->cumulative_freqs = NULL;
+  // nothing to sample yet
+  new_mark_node->sampler_valid = true;
+  new_mark_node->last_state = markov_chain->is_last
+      (state_word (markov_chain, new_mark_node->data));
+  link_node (markov_chain->database, new_node, new_mark_node);
+  size_t size = (size_t) markov_chain->database->size;
+  markov_chain->nodes[size - 1] = new_mark_node;
+  fenwick_append_zero (markov_chain->start_counts, size);
+  fenwick_append_zero (markov_chain->start_weights, size);
+  return markov_chain->database->last;
+}
+
+Node *add_to_database (MarkovChain *markov_chain, void *data_ptr)
+{
+  STATS_ADD (STATS_LOOKUPS, 1);
+  if (!markov_chain->hash_func)
+  {
+    Node *curr_node = scan_database (markov_chain, data_ptr);
+    return curr_node ? curr_node : append_new_state (markov_chain,
+                                                     data_ptr);
+  }
+  if (!reserve_state_index (markov_chain))
+  {
+    return NULL;
+  }
+  size_t hash = mix_hash (markov_chain->hash_func (data_ptr));
+  StateIndexSlot *slot = find_index_slot (markov_chain, data_ptr, hash);
+  if (slot->node)
+  {
+    return slot->node;
+  }
+  Node *new_node = append_new_state (markov_chain, data_ptr);
+  if (new_node)
+  {
+    *slot = (StateIndexSlot) {new_node, hash};
+    markov_chain->state_index.count++;
+  }
+  return new_node;
+}
+
+/**
+ * Successor lists up to this length are scanned directly, longer ones
+ * (hub words) get a successor_index.
+ */
+#define SUCCESSOR_INDEX_THRESHOLD 16
+
+static size_t hash_successor (MarkovNode *node)
+{
+  return mix_hash ((size_t) node >> 4);
+}
+
+static size_t *find_successor_slot (MarkovNode *first_node,
+                                    MarkovNode *second_node)
+{
+  size_t mask = first_node->successor_index_capacity - 1;
+  size_t pos = hash_successor (second_node) & mask;
+  while (first_node->successor_index[pos] != 0 &&
+         first_node->frequencies_list[first_node->successor_index[pos] - 1]
+             .next_object != second_node)
+  {
+    STATS_ADD (STATS_SUCCESSOR_COMPARES, 1);
+    pos = (pos + 1) & mask;
+  }
+  return &first_node->successor_index[pos];
+}
+
+/**
+ * (Re)build the successor index of the given node, so it has room for
+ * its whole frequencies list under a load factor of 1/2.
+ */
+static bool build_successor_index (SlabPool *pool, MarkovNode *node)
+{
+  size_t capacity = node->successor_index_capacity ?
+                    node->successor_index_capacity :
+                    SUCCESSOR_INDEX_THRESHOLD * 4;
+  while (capacity < node->freq_list_act_size * 2)
+  {
+    capacity *= 2;
+  }
+  size_t *new_index = pool_alloc_array (pool, capacity * sizeof (size_t));
+  if (!new_index)
+  {
+    return false;
+  }
+  memset (new_index, 0, capacity * sizeof (size_t));
+  pool_release_array (pool, node->successor_index,
+                      node->successor_index_capacity * sizeof (size_t));
+  node->successor_index = new_index;
+  node->successor_index_capacity = capacity;
+  for (size_t i = 0; i < node->freq_list_act_size; i++)
+  {
+    *find_successor_slot (node, node->frequencies_list[i].next_object) =
+        i + 1;
+  }
+  return true;
+}
+
+/**
+ * Return the position of second_node in first_node's frequencies list,
+ * or freq_list_act_size if it isn't there. States are unique in the
+ * database, so successors are compared by identity, not by comp_func.
+ */
+static size_t find_successor (MarkovNode *first_node,
+                              MarkovNode *second_node)
+{
+  if (first_node->successor_index)
+  {
+    size_t pos = *find_successor_slot (first_node, second_node);
+    return pos ? pos - 1 : first_node->freq_list_act_size;
+  }
+  MarkovNodeFrequency *freq_lst = first_node->frequencies_list;
+  size_t i = 0;
+  while (i < first_node->freq_list_act_size &&
+         freq_lst[i].next_object != second_node)
+  {
+    i++;
+  }
+  STATS_ADD (STATS_SUCCESSOR_COMPARES,
+             i < first_node->freq_list_act_size ? i + 1 : i);
+  return i;
+}
+
+/**
+ * Add count occurrences of second_node after first_node.
+ */
+static bool count_successor (MarkovChain *markov_chain,
+                             MarkovNode *first_node, MarkovNode *second_node,
+                             uint64_t count)
+{
+  // Adds 1 to the frequency parameter if second node exists in the
+  // list.
+  size_t pos = find_successor (first_node, second_node);
+  if (pos < first_node->freq_list_act_size)
+  {
+    first_node->frequencies_list[pos].frequency += count;
+    return true;
+  }
+  // otherwise, add the second node into the first one's frequency
+  // list.
+  if(!add_new_node_to_frequency_list (markov_chain, first_node,
+                                      second_node))
+  {
+    return false;
+  }
+  first_node->frequencies_list[pos].frequency = count;
+  if (first_node->successor_index)
+  {
+    if (first_node->freq_list_act_size * 2 >
+        first_node->successor_index_capacity)
+    {
+      return build_successor_index (markov_chain->pool, first_node);
+    }
+    *find_successor_slot (first_node, second_node) =
+        first_node->freq_list_act_size;
+    return true;
+  }
+  if (first_node->freq_list_act_size > SUCCESSOR_INDEX_THRESHOLD)
+  {
+    return build_successor_index (markov_chain->pool, first_node);
+  }
+  return true;
+}
+
+/**
+ * Queue the node's sampler to be rebuilt by build_samplers.
+ */
+static bool invalidate_sampler (MarkovChain *markov_chain, MarkovNode *node)
+{
+  if (!node->sampler_valid)
+  {
+    return true;
+  }
+  if (markov_chain->dirty_count == markov_chain->dirty_capacity)
+  {
+    size_t new_capacity = markov_chain->dirty_capacity ?
+                          markov_chain->dirty_capacity * 2 :
+                          STATE_INDEX_INIT_CAPACITY;
+    STATS_ALLOC (new_capacity * sizeof (MarkovNode *));
+    MarkovNode **dirty = realloc (markov_chain->dirty_nodes,
+                                  new_capacity * sizeof (MarkovNode *));
+    if (!dirty)
+    {
+      return false;
+    }
+    markov_chain->dirty_nodes = dirty;
+    markov_chain->dirty_capacity = new_capacity;
+  }
+  markov_chain->dirty_nodes[markov_chain->dirty_count++] = node;
+  node->sampler_valid = false;
+  return true;
+}
+
+/**
+ * Count second_node as following first_node count more times, updating
+ * the start states in place.
+ */
+static bool add_frequency (MarkovNode *first_node, MarkovNode *second_node,
+                           MarkovChain *markov_chain, uint64_t count)
+{
+  STATS_ADD (STATS_SUCCESSOR_UPDATES, 1);
+  if (!invalidate_sampler (markov_chain, first_node))
+  {
+    return false;
+  }
+  bool was_start = first_node->freq_list_act_size > 0;
+  if (!count_successor (markov_chain, first_node, second_node, count))
+  {
+    return false;
+  }
+  if (first_node->last_state)
+  {
+    return true;
+  }
+  size_t size = (size_t) markov_chain->database->size;
+  if (!was_start)
+  {
+    fenwick_add (markov_chain->start_counts, size, first_node->index, 1);
+    markov_chain->start_states_count++;
+  }
+  fenwick_add (markov_chain->start_weights, size, first_node->index, count);
+  markov_chain->start_weights_total += count;
+  return true;
+}
+
+bool add_node_to_frequencies_list (MarkovNode *first_node,
+                                   MarkovNode *second_node,
+                                   MarkovChain *markov_chain)
+{
+  return add_frequency (first_node, second_node, markov_chain, 1);
+}
+
+bool merge_chain (MarkovChain *dst_chain, MarkovChain *src_chain,
+                  translate_function translate, void *context)
+{
+  size_t src_size = (size_t) src_chain->database->size;
+  MarkovNode **mapped = malloc ((src_size ? src_size : 1) *
+                                sizeof (MarkovNode *));
+  if (!mapped)
+  {
+    return false;
+  }
+  // all the states first, so they keep their first occurrence order
+  for (Node *curr = src_chain->database->first; curr; curr = curr->next)
+  {
+    void *data = curr->data->data;
+    if (src_chain->order > 1)
+    {
+      data = translate_context (dst_chain, src_chain, data, translate,
+                                context);
+    }
+    else if (translate)
+    {
+      data = translate (data, context);
+    }
+    Node *dst_node = data ? add_to_database (dst_chain, data) : NULL;
+    if (!dst_node)
+    {
+      free (mapped);
+      return false;
+    }
+    mapped[curr->data->index] = dst_node->data;
+  }
+  for (Node *curr = src_chain->database->first; curr; curr = curr->next)
+  {
+    MarkovNode *src_node = curr->data;
+    for (size_t i = 0; i < src_node->freq_list_act_size; i++)
+    {
+      MarkovNodeFrequency *freq = &src_node->frequencies_list[i];
+      if (!add_frequency (mapped[src_node->index],
+                          mapped[freq->next_object->index], dst_chain,
+                          freq->frequency))
+      {
+        free (mapped);
+        return false;
+      }
+    }
+  }
+  free (mapped);
+  return true;
+}
+
+void free_database (MarkovChain **ptr_chain)
+{
+  // every node and array of the chain is in its pool, only data owned by
+  // the states has to be freed one by one.
+  if ((*ptr_chain)->free_data)
+  {
+    for (int i = 0; i < (*ptr_chain)->database->size; i++)
+    {
+      (*ptr_chain)->free_data ((*ptr_chain)->nodes[i]->data);
+    }
+  }
+  pool_free (&(*ptr_chain)->pool);
+  free((*ptr_chain)->state_index.slots);
+  (*ptr_chain)->state_index.slots = NULL;
+  free((*ptr_chain)->nodes);
+  (*ptr_chain)->nodes = NULL;
+  free((*ptr_chain)->start_counts);
+  (*ptr_chain)->start_counts = NULL;
+  free((*ptr_chain)->start_weights);
+  (*ptr_chain)->start_weights = NULL;
+  free((*ptr_chain)->dirty_nodes);
+  (*ptr_chain)->dirty_nodes = NULL;
+  arena_free (&(*ptr_chain)->arena);
+  arena_free (&(*ptr_chain)->contexts);
+  free((*ptr_chain)->database);
+  ((*ptr_chain)->database) = NULL;
+  free((*ptr_chain));
+  *ptr_chain = NULL;
+}
+int get_random_number (int max_number)
+{
+  return (int) markov_rng_bounded (markov_rng_default (),
+                                   (uint32_t) max_number);
+}
+
+/**
+ * Find the first entry whose running sum passes rand_ind, which is the
+ * same one the expanded "one slot per occurrence" array would give.
+ */
+static size_t search_cumulative (const uint64_t *cumulative, size_t size,
+                                 uint64_t rand_ind)
+{
+  size_t low = 0, high = size - 1;
+  while (low < high)
+  {
+    size_t mid = low + (high - low) / 2;
+    if (cumulative[mid] > rand_ind)
+    {
+      high = mid;
+    }
+    else
+    {
+      low = mid + 1;
+    }
+  }
+  return low;
+}
+
+/**
+ * Recompute the cumulative frequencies of the given node.
+ */
+static bool build_sampler (SlabPool *pool, MarkovNode *node)
+{
+  if (node->freq_list_act_size == 0)
+  {
+    node->sampler_valid = true;
+    return true;
+  }
+  uint64_t *cumulative = node->cumulative_freqs;
+  if (!cumulative)
+  {
+    cumulative = pool_alloc_array (pool, node->freq_list_full_size *
+                                         sizeof (uint64_t));
+  }
+  if (!cumulative)
+  {
+    return false;
+  }
+  uint64_t total_freq = 0;
+  for (size_t i = 0; i < node->freq_list_act_size; i++)
+  {
+    total_freq += node->frequencies_list[i].frequency;
+    cumulative[i] = total_freq;
+  }
+  node->cumulative_freqs = cumulative;
+  node->sampler_valid = true;
+  return true;
+}
+
+/**
+ * @return a random number in [0, max_number), from rng or, when rng is
+ * NULL, from the thread's default stream.
+ */
+static uint64_t draw_number (MarkovRng *rng, uint64_t max_number)
+{
+  return markov_rng_bounded64 (rng ? rng : markov_rng_default (),
+                               max_number);
+}
+
+/**
+ * Draw a start state from the chain's (already built) start states.
+ */
+static MarkovNode *draw_first_node (MarkovChain *markov_chain,
+                                    MarkovRng *rng)
+{
+  size_t count = markov_chain->start_states_count;
+  size_t size = (size_t) markov_chain->database->size;
+  if (count == 0)
+  {
+    return NULL;
+  }
+  if (!markov_chain->weighted_start)
+  {
+    uint64_t rand_ind = draw_number (rng, count);
+    return markov_chain->nodes[fenwick_search (markov_chain->start_counts,
+                                               size, rand_ind)];
+  }
+  uint64_t rand_ind = draw_number (rng, markov_chain->start_weights_total);
+  return markov_chain->nodes[fenwick_search (markov_chain->start_weights,
+                                             size, rand_ind)];
+}
+
+/**
+ * Draw a successor of node from its sampler or, when that is out of
+ * date, by summing its counts on the way (which picks the same one).
+ */
+static MarkovNode *draw_next_node (MarkovNode *node, MarkovRng *rng)
+{
+  size_t size = node->freq_list_act_size;
+  if (size == 0)
+  {
+    return NULL;
+  }
+  if (!node->sampler_valid)
+  {
+    uint64_t total_freq = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+      total_freq += node->frequencies_list[i].frequency;
+    }
+    uint64_t rand_ind = draw_number (rng, total_freq);
+    size_t i = 0;
+    for (uint64_t sum = node->frequencies_list[0].frequency; sum <= rand_ind;
+         sum += node->frequencies_list[i].frequency)
+    {
+      i++;
+    }
+    return node->frequencies_list[i].next_object;
+  }
+  uint64_t *cumulative = node->cumulative_freqs;
+  uint64_t rand_ind = draw_number (rng, cumulative[size - 1]);
+  return node->frequencies_list[search_cumulative (cumulative, size,
+                                                   rand_ind)].next_object;
+}
+
+bool build_samplers (MarkovChain *markov_chain)
+{
+  while (markov_chain->dirty_count > 0)
+  {
+    MarkovNode *node =
+        markov_chain->dirty_nodes[markov_chain->dirty_count - 1];
+    if (!node->sampler_valid &&
+        !build_sampler (markov_chain->pool, node))
+    {
+      return false;
+    }
+    markov_chain->dirty_count--;
+  }
+  return true;
+}
+
+MarkovNode *get_first_random_node (MarkovChain *markov_chain)
+{
+  return draw_first_node (markov_chain, NULL);
+}
+
+MarkovNode *get_next_random_node (MarkovNode *state_struct_ptr)
+{
+  return draw_next_node (state_struct_ptr, NULL);
+}
+
+
+/**
+ * Walk the chain from first_node until a last state, a state without
+ * successors or max_length words.
+ * @param rng the stream to draw from, NULL for the default stream
+ * @param tweet filled with the words of the walk: every word of the
+ * first state, then the (last) word of each following state
+ * @return the index of the last word in tweet.
+ */
+static int walk_tweet (MarkovChain *markov_chain, MarkovNode *first_node,
+                       MarkovRng *rng, void **tweet, int max_length)
+{
+  if (max_length > MAX_TWEET_LEN)
+  {
+    max_length = MAX_TWEET_LEN;
+  }
+  tweet[0] = first_node->data;
+  int arr_len = 0;
+  if (markov_chain->order > 1)
+  {
+    for (int i = 0; i < markov_chain->order; i++)
+    {
+      tweet[i] = (void *) arena_string (markov_chain->arena,
+                                        context_word_id (first_node->data,
+                                                         i));
+    }
+    arr_len = markov_chain->order - 1;
+  }
+  if (arr_len >= max_length)
+  {
+    // the first state alone is longer than the tweet may be
+    return max_length > 1 ? max_length - 1 : 0;
+  }
+  MarkovNode *curr_node = first_node;
+  for (int i = arr_len + 1; i < max_length; i++)
+  {
+    curr_node = rng ? draw_next_node (curr_node, rng)
+                    : get_next_random_node (curr_node);
+    if (curr_node == NULL)
+    {
+      break;
+    }
+    tweet[i] = state_word (markov_chain, curr_node->data);
+    arr_len = i;
+    if (markov_chain->is_last (tweet[i]) ||
+        curr_node->frequencies_list == NULL)
+    {
+      break;
+    }
+  }
+  return arr_len;
+}
+
+/**
+ * Append the words of a tweet to out, separated by spaces, the way
+ * generate_tweet prints them.
+ */
+static void append_tweet_words (OutputBuffer *out, append_function append,
+                                void **tweet, int arr_len)
+{
+  for (int j = 0; j < arr_len; j++)
+  {
+    append (tweet[j], out);
+    output_append (out, " ", 1);
+  }
+  append (tweet[arr_len], out);
+  if (arr_len == MAX_TWEET_LEN - 1)
+  {
+    output_append (out, ".", 1);
+  }
+  output_append (out, "\n", 1);
+}
+
+void generate_tweet (MarkovChain *markov_chain, MarkovNode
+  *first_node, int max_length)
+/** First we'll create an array to hold pointers to the data, which we'll
+ * receive from the Markov nodes. The array will be used to store
+ * the tweet. **/
+{
+  void* tweet[MAX_TWEET_LEN];
+  int arr_len = walk_tweet (markov_chain, first_node, NULL, tweet,
+                            max_length);
+  if (markov_chain->output && markov_chain->append_func)
+  {
+    append_tweet_words (markov_chain->output, markov_chain->append_func,
+                        tweet, arr_len);
+    return;
+  }
+  for(int j=0; j<arr_len; j++)
+  {
+    markov_chain->print_func(tweet[j]);
+    markov_chain->print_func(" ");
+  }
+  markov_chain->print_func(tweet[arr_len]);
+  if(arr_len == MAX_TWEET_LEN-1)
+  {
+    markov_chain->print_func(".");
+  }
+  markov_chain->print_func("\n");
+}
+
+#define MODEL_ALIGNMENT 8
+
+/**
+ * Appends the sections of a model image one after the other. The image
+ * starts at offset 0, so offsets in it are offsets in the file.
+ */
+typedef struct ModelWriter
+{
+    OutputBuffer *image;
+} ModelWriter;
+
+static void write_bytes (ModelWriter *writer, const void *data, size_t len)
+{
+  if (len > 0)
+  {
+    output_append (writer->image, data, len);
+  }
+}
+
+/**
+ * Pad the image up to the next aligned offset and return it.
+ */
+static uint64_t begin_section (ModelWriter *writer)
+{
+  static const char padding[MODEL_ALIGNMENT] = {0};
+  write_bytes (writer, padding, (MODEL_ALIGNMENT - writer->image->len %
+                                 MODEL_ALIGNMENT) % MODEL_ALIGNMENT);
+  return writer->image->len;
+}
+
+static uint64_t write_section (ModelWriter *writer, const void *data,
+                               size_t len)
+{
+  uint64_t offset = begin_section (writer);
+  write_bytes (writer, data, len);
+  return offset;
+}
+
+/**
+ * The id arrays of a model, built from a chain or from another model
+ * before being written.
+ */
+typedef struct ModelArrays
+{
+    // the strings, one after the other, borrowed; NULL to write those of
+    // the chain's arena
+    const char *strings;
+    uint32_t *string_offsets;
+    uint32_t *state_strings;
+    uint32_t *state_contexts;
+    uint8_t *state_flags;
+    uint32_t *succ_offsets;
+    uint32_t *succ_targets;
+    // of the header's count_bits each
+    void *succ_cumulative;
+    // NULL for exact counts
+    uint32_t *state_scales;
+    uint32_t *start_states;
+    uint64_t *start_cumulative;
+} ModelArrays;
+
+static void free_model_arrays (ModelArrays *arrays)
+{
+  free (arrays->string_offsets);
+  free (arrays->state_strings);
+  free (arrays->state_contexts);
+  free (arrays->state_flags);
+  free (arrays->succ_offsets);
+  free (arrays->succ_targets);
+  free (arrays->succ_cumulative);
+  free (arrays->state_scales);
+  free (arrays->start_states);
+  free (arrays->start_cumulative);
+}
+
+/**
+ * @return the smallest scale that fits the running counts of a state,
+ * each divided by it and rounded up (so none drops to 0), in 32 bits: 1
+ * unless the state was counted more than UINT32_MAX times.
+ */
+static uint64_t exact_scale (uint64_t total, size_t len)
+{
+  // the rounding adds less than 1 per successor
+  return total <= UINT32_MAX ? 1 : total / (UINT32_MAX - len) + 1;
+}
+
+/**
+ * Set the scale of a state, with the scales of every state (1 until
+ * set) allocated on first use.
+ * @return false in case of allocation error.
+ */
+static bool set_state_scale (ModelArrays *arrays, size_t num_states,
+                             size_t state, uint64_t scale)
+{
+  if (!arrays->state_scales)
+  {
+    arrays->state_scales = malloc ((num_states + 1) * sizeof (uint32_t));
+    if (!arrays->state_scales)
+    {
+      return false;
+    }
+    for (size_t i = 0; i < num_states; i++)
+    {
+      arrays->state_scales[i] = 1;
+    }
+  }
+  arrays->state_scales[state] = (uint32_t) scale;
+  return true;
+}
+
+/**
+ * Fill the header counts and the arrays of the model of the given chain.
+ */
+static bool build_model_arrays (MarkovChain *markov_chain,
+                                ModelHeader *header, ModelArrays *arrays)
+{
+  StringArena *arena = markov_chain->arena;
+  uint32_t num_strings = arena ? arena->count : 0;
+  size_t num_states = (size_t) markov_chain->database->size;
+  size_t num_edges = 0;
+  for (Node *curr = markov_chain->database->first; curr; curr = curr->next)
+  {
+    num_edges += curr->data->freq_list_act_size;
+  }
+  // +1 so empty models still get valid allocations
+  arrays->string_offsets = malloc ((num_strings + 1) * sizeof (uint32_t));
+  size_t context_len = markov_chain->order > 1 ?
+                       (size_t) markov_chain->order - 1 : 0;
+  arrays->state_strings = malloc ((num_states + 1) * sizeof (uint32_t));
+  arrays->state_contexts = malloc ((num_states * context_len + 1) *
+                                   sizeof (uint32_t));
+  arrays->state_flags = malloc (num_states + 1);
+  arrays->succ_offsets = malloc ((num_states + 1) * sizeof (uint32_t));
+  arrays->succ_targets = malloc ((num_edges + 1) * sizeof (uint32_t));
+  arrays->succ_cumulative = malloc ((num_edges + 1) * sizeof (uint32_t));
+  arrays->start_states = malloc ((num_states + 1) * sizeof (uint32_t));
+  arrays->start_cumulative = malloc ((num_states + 1) * sizeof (uint64_t));
+  if (!arrays->string_offsets || !arrays->state_strings ||
+      !arrays->state_contexts || !arrays->state_flags || !arrays->succ_offsets ||
+      !arrays->succ_targets || !arrays->succ_cumulative ||
+      !arrays->start_states || !arrays->start_cumulative)
+  {
+    return false;
+  }
+  uint32_t strings_size = 0;
+  for (uint32_t i = 0; i < num_strings; i++)
+  {
+    arrays->string_offsets[i] = strings_size;
+    strings_size += (uint32_t) strlen (arena_string (arena, i)) + 1;
+  }
+  uint32_t *succ_cumulative = arrays->succ_cumulative;
+  uint32_t edge = 0, starts = 0;
+  uint64_t start_total = 0;
+  for (Node *curr = markov_chain->database->first; curr; curr = curr->next)
+  {
+    MarkovNode *node = curr->data;
+    bool is_last = node->last_state;
+    // states that aren't strings have no string
+    arrays->state_strings[node->index] = arena ? arena_string_id
+        (state_word (markov_chain, node->data)) : MODEL_NO_STATE;
+    for (size_t i = 0; i < context_len; i++)
+    {
+      arrays->state_contexts[node->index * context_len + i] =
+          context_word_id (node->data, (int) i);
+    }
+    arrays->state_flags[node->index] = is_last ? MODEL_STATE_LAST : 0;
+    arrays->succ_offsets[node->index] = edge;
+    uint64_t total = 0;
+    for (size_t i = 0; i < node->freq_list_act_size; i++)
+    {
+      total += node->frequencies_list[i].frequency;
+    }
+    uint64_t scale = exact_scale (total, node->freq_list_act_size);
+    if (scale > 1 && !set_state_scale (arrays, num_states, node->index,
+                                       scale))
+    {
+      return false;
+    }
+    uint32_t scaled_total = 0;
+    for (size_t i = 0; i < node->freq_list_act_size; i++)
+    {
+      scaled_total += (uint32_t) ((node->frequencies_list[i].frequency +
+                                   scale - 1) / scale);
+      arrays->succ_targets[edge] =
+          (uint32_t) node->frequencies_list[i].next_object->index;
+      succ_cumulative[edge++] = scaled_total;
+    }
+    // sentences start by how often they did, whatever the scale
+    if (node->freq_list_act_size > 0 && !is_last)
+    {
+      start_total += total;
+      arrays->start_states[starts] = (uint32_t) node->index;
+      arrays->start_cumulative[starts++] = start_total;
+    }
+  }
+  arrays->succ_offsets[num_states] = edge;
+  header->num_strings = num_strings;
+  header->num_states = (uint32_t) num_states;
+  header->num_edges = edge;
+  header->num_starts = starts;
+  header->order = (uint32_t) context_len + 1;
+  header->count_bits = COMPACT_EXACT_BITS;
+  header->min_count = 1;
+  header->strings_size = strings_size;
+  return true;
+}
+
+/**
+ * Lay a model out in memory, exactly as it is saved to a file.
+ * @param header the counts of the model, its offsets are filled in
+ * @param arrays the arrays of the model
+ * @param arena where the strings are, when arrays->strings is NULL
+ * @param image filled with the model, to be freed by the caller
+ * @return true on success, false in case of allocation error.
+ */
+static bool write_model_image (ModelHeader *header, const ModelArrays *arrays,
+                               const StringArena *arena, OutputBuffer *image)
+{
+  memcpy (header->magic, MODEL_MAGIC, MODEL_MAGIC_LEN);
+  header->version = MODEL_VERSION;
+  ModelWriter writer = {image};
+  // placeholder, rewritten once every offset is known
+  write_bytes (&writer, header, sizeof (ModelHeader));
+  header->strings_offset = begin_section (&writer);
+  if (arrays->strings)
+  {
+    write_bytes (&writer, arrays->strings, header->strings_size);
+  }
+  for (uint32_t i = 0; !arrays->strings && i < header->num_strings; i++)
+  {
+    const char *str = arena_string (arena, i);
+    write_bytes (&writer, str, strlen (str) + 1);
+  }
+  header->string_offsets_offset = write_section
+      (&writer, arrays->string_offsets, header->num_strings *
+                                        sizeof (uint32_t));
+  header->state_strings_offset = write_section
+      (&writer, arrays->state_strings, header->num_states *
+                                       sizeof (uint32_t));
+  header->state_contexts_offset = write_section
+      (&writer, arrays->state_contexts, (size_t) header->num_states *
+                                        (header->order - 1) *
+                                        sizeof (uint32_t));
+  header->state_flags_offset = write_section
+      (&writer, arrays->state_flags, header->num_states);
+  header->succ_offsets_offset = write_section
+      (&writer, arrays->succ_offsets, (header->num_states + 1) *
+                                      sizeof (uint32_t));
+  header->succ_targets_offset = write_section
+      (&writer, arrays->succ_targets, header->num_edges *
+                                      sizeof (uint32_t));
+  header->succ_cumulative_offset = write_section
+      (&writer, arrays->succ_cumulative, header->num_edges *
+                                         (header->count_bits / CHAR_BIT));
+  header->state_scales_offset = arrays->state_scales ? write_section
+      (&writer, arrays->state_scales, header->num_states *
+                                      sizeof (uint32_t)) : 0;
+  header->start_states_offset = write_section
+      (&writer, arrays->start_states, header->num_starts *
+                                      sizeof (uint32_t));
+  header->start_cumulative_offset = write_section
+      (&writer, arrays->start_cumulative, header->num_starts *
+                                          sizeof (uint64_t));
+  header->file_size = image->len;
+  if (image->failed)
+  {
+    return false;
+  }
+  memcpy (image->data, header, sizeof (ModelHeader));
+  return true;
+}
+
+/**
+ * Lay the model of the given chain out in memory, exactly as it is saved
+ * to a file.
+ * @param image filled with the model, to be freed by the caller
+ * @return true on success, false in case of allocation error.
+ */
+static bool build_model_image (MarkovChain *markov_chain,
+                               OutputBuffer *image)
+{
+  ModelHeader header;
+  memset (&header, 0, sizeof (ModelHeader));
+  ModelArrays arrays = {NULL};
+  if (!build_model_arrays (markov_chain, &header, &arrays))
+  {
+    free_model_arrays (&arrays);
+    return false;
+  }
+  bool success = write_model_image (&header, &arrays, markov_chain->arena,
+                                    image);
+  free_model_arrays (&arrays);
+  return success;
+}
+
+bool save_model (MarkovChain *markov_chain, const char *path)
+{
+  if (!markov_chain->arena)
+  {
+    return false;
+  }
+  OutputBuffer image = {0};
+  if (!build_model_image (markov_chain, &image))
+  {
+    output_free (&image);
+    return false;
+  }
+  FILE *file = fopen (path, "wb");
+  bool success = file && fwrite (image.data, 1, image.len, file) ==
+                         image.len;
+  if (file && fclose (file) != 0)
+  {
+    success = false;
+  }
+  output_free (&image);
+  return success;
+}
+
+bool write_model (const MarkovModel *model, const char *path)
+{
+  if (model->state_data)
+  {
+    return false;
+  }
+  FILE *file = fopen (path, "wb");
+  bool success = file && fwrite (model->mapping, 1, model->mapping_len,
+                                 file) == model->mapping_len;
+  if (file && fclose (file) != 0)
+  {
+    success = false;
+  }
+  return success;
+}
+
+/**
+ * @return the i-th running count of the model, of whatever width.
+ */
+static uint32_t model_cumulative (const MarkovModel *model, uint32_t i)
+{
+  switch (model->header->count_bits)
+  {
+    case 8:
+      return ((const uint8_t *) model->succ_cumulative)[i];
+    case 16:
+      return ((const uint16_t *) model->succ_cumulative)[i];
+    default:
+      return ((const uint32_t *) model->succ_cumulative)[i];
+  }
+}
+
+/**
+ * Check that a section of count items of the given size lies inside the
+ * mapped file and is aligned.
+ */
+static bool section_fits (uint64_t offset, uint64_t count, size_t item_size,
+                          size_t file_len)
+{
+  return offset % MODEL_ALIGNMENT == 0 && offset <= file_len &&
+         count <= (file_len - offset) / item_size;
+}
+
+static bool validate_model (const ModelHeader *header, size_t file_len)
+{
+  return memcmp (header->magic, MODEL_MAGIC, MODEL_MAGIC_LEN) == 0 &&
+         header->version == MODEL_VERSION &&
+         header->file_size == file_len &&
+         section_fits (header->strings_offset, header->strings_size, 1,
+                       file_len) &&
+         section_fits (header->string_offsets_offset, header->num_strings,
+                       sizeof (uint32_t), file_len) &&
+         section_fits (header->state_strings_offset, header->num_states,
+                       sizeof (uint32_t), file_len) &&
+         header->order >= 1 && header->order <= MAX_ORDER &&
+         section_fits (header->state_contexts_offset,
+                       (uint64_t) header->num_states * (header->order - 1),
+                       sizeof (uint32_t), file_len) &&
+         section_fits (header->state_flags_offset, header->num_states, 1,
+                       file_len) &&
+         section_fits (header->succ_offsets_offset,
+                       (uint64_t) header->num_states + 1,
+                       sizeof (uint32_t), file_len) &&
+         section_fits (header->succ_targets_offset, header->num_edges,
+                       sizeof (uint32_t), file_len) &&
+         (header->count_bits == 8 || header->count_bits == 16 ||
+          header->count_bits == COMPACT_EXACT_BITS) &&
+         section_fits (header->succ_cumulative_offset, header->num_edges,
+                       header->count_bits / CHAR_BIT, file_len) &&
+         (header->state_scales_offset == 0 ||
+          section_fits (header->state_scales_offset, header->num_states,
+                        sizeof (uint32_t), file_len)) &&
+         section_fits (header->start_states_offset, header->num_starts,
+                       sizeof (uint32_t), file_len) &&
+         section_fits (header->start_cumulative_offset, header->num_starts,
+                       sizeof (uint64_t), file_len);
+}
+
+/**
+ * Check what validate_model can't tell from the header: that every
+ * string ends inside the file, that every state and string id in the
+ * arrays is in range, and that the offsets and running counts never go
+ * down, so a corrupt file can't make generation read out of bounds.
+ */
+static bool validate_model_arrays (const MarkovModel *model)
+{
+  const ModelHeader *header = model->header;
+  if (header->strings_size > 0 &&
+      model->strings[header->strings_size - 1] != '\0')
+  {
+    return false;
+  }
+  for (uint32_t i = 0; i < header->num_strings; i++)
+  {
+    if (model->string_offsets[i] >= header->strings_size)
+    {
+      return false;
+    }
+  }
+  size_t context_len = header->order - 1;
+  for (uint32_t state = 0; state < header->num_states; state++)
+  {
+    if (model->state_strings[state] >= header->num_strings)
+    {
+      return false;
+    }
+    for (size_t i = 0; i < context_len; i++)
+    {
+      if (model->state_contexts[state * context_len + i] >=
+          header->num_strings)
+      {
+        return false;
+      }
+    }
+  }
+  if (model->succ_offsets[0] != 0 ||
+      model->succ_offsets[header->num_states] != header->num_edges)
+  {
+    return false;
+  }
+  for (uint32_t state = 0; state < header->num_states; state++)
+  {
+    uint32_t begin = model->succ_offsets[state];
+    uint32_t end = model->succ_offsets[state + 1];
+    if (end < begin ||
+        (model->state_scales && model->state_scales[state] == 0))
+    {
+      return false;
+    }
+    uint32_t total = 0;
+    for (uint32_t edge = begin; edge < end; edge++)
+    {
+      if (model->succ_targets[edge] >= header->num_states ||
+          model_cumulative (model, edge) < total)
+      {
+        return false;
+      }
+      total = model_cumulative (model, edge);
+    }
+    // a state is only saved with successors it was counted with
+    if (end > begin && total == 0)
+    {
+      return false;
+    }
+  }
+  uint64_t start_total = 0;
+  for (uint32_t i = 0; i < header->num_starts; i++)
+  {
+    if (model->start_states[i] >= header->num_states ||
+        model->start_cumulative[i] < start_total)
+    {
+      return false;
+    }
+    start_total = model->start_cumulative[i];
+  }
+  return true;
+}
+
+/**
+ * Point a new model at the sections of a model image.
+ * @param mapped true if the image is mapped, false if it's on the heap
+ * @return the model, NULL if the image isn't a valid model of this
+ * version or in case of allocation error.
+ */
+static MarkovModel *model_from_image (void *image, size_t len, bool mapped)
+{
+  const ModelHeader *header = image;
+  if (len < sizeof (ModelHeader) || !validate_model (header, len))
+  {
+    return NULL;
+  }
+  MarkovModel *model = calloc (1, sizeof (MarkovModel));
+  if (!model)
+  {
+    return NULL;
+  }
+  const char *base = image;
+  *model = (MarkovModel) {
+      header,
+      base + header->strings_offset,
+      (const uint32_t *) (base + header->string_offsets_offset),
+      (const uint32_t *) (base + header->state_strings_offset),
+      (const uint32_t *) (base + header->state_contexts_offset),
+      (const uint8_t *) (base + header->state_flags_offset),
+      (const uint32_t *) (base + header->succ_offsets_offset),
+      (const uint32_t *) (base + header->succ_targets_offset),
+      base + header->succ_cumulative_offset,
+      header->state_scales_offset ?
+      (const uint32_t *) (base + header->state_scales_offset) : NULL,
+      (const uint32_t *) (base + header->start_states_offset),
+      (const uint64_t *) (base + header->start_cumulative_offset),
+      false, NULL, NULL, image, len, mapped};
+  return model;
+}
+
+MarkovModel *load_model (const char *path)
+{
+  int fd = open (path, O_RDONLY);
+  if (fd < 0)
+  {
+    return NULL;
+  }
+  struct stat file_stat;
+  if (fstat (fd, &file_stat) != 0 ||
+      (size_t) file_stat.st_size < sizeof (ModelHeader))
+  {
+    close (fd);
+    return NULL;
+  }
+  size_t len = (size_t) file_stat.st_size;
+  void *mapping = mmap (NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (mapping == MAP_FAILED)
+  {
+    return NULL;
+  }
+  MarkovModel *model = model_from_image (mapping, len, true);
+  if (model && !validate_model_arrays (model))
+  {
+    free (model);
+    model = NULL;
+  }
+  if (!model)
+  {
+    munmap (mapping, len);
+  }
+  return model;
+}
+
+void free_model (MarkovModel **ptr_model)
+{
+  if (!*ptr_model)
+  {
+    return;
+  }
+  MarkovModel *model = *ptr_model;
+  if (model->state_data)
+  {
+    for (uint32_t i = 0; model->free_data && i < model->header->num_states;
+         i++)
+    {
+      model->free_data (model->state_data[i]);
+    }
+    free (model->state_data);
+  }
+  if (model->mapped)
+  {
+    munmap (model->mapping, model->mapping_len);
+  }
+  else
+  {
+    free (model->mapping);
+  }
+  free (*ptr_model);
+  *ptr_model = NULL;
+}
+
+MarkovModel *freeze_chain (MarkovChain **ptr_chain)
+{
+  MarkovChain *markov_chain = *ptr_chain;
+  OutputBuffer image = {0};
+  if (!build_samplers (markov_chain) ||
+      !build_model_image (markov_chain, &image))
+  {
+    output_free (&image);
+    return NULL;
+  }
+  // the image is final, give back the slack of its doubling
+  char *shrunk = realloc (image.data, image.len);
+  if (shrunk)
+  {
+    image.data = shrunk;
+  }
+  void **state_data = NULL;
+  size_t num_states = (size_t) markov_chain->database->size;
+  if (!markov_chain->arena)
+  {
+    state_data = malloc ((num_states + 1) * sizeof (void *));
+    if (!state_data)
+    {
+      output_free (&image);
+      return NULL;
+    }
+    for (size_t i = 0; i < num_states; i++)
+    {
+      state_data[i] = markov_chain->nodes[i]->data;
+    }
+  }
+  MarkovModel *model = model_from_image (image.data, image.len, false);
+  if (!model)
+  {
+    free (state_data);
+    output_free (&image);
+    return NULL;
+  }
+  model->weighted_start = markov_chain->weighted_start;
+  model->state_data = state_data;
+  // the strings of a chain with an arena are copied into the image, its
+  // other data is now owned by the model
+  model->free_data = state_data ? markov_chain->free_data : NULL;
+  markov_chain->free_data = state_data ? NULL : markov_chain->free_data;
+  free_database (ptr_chain);
+  return model;
+}
+
+void *model_state_data (const MarkovModel *model, uint32_t state)
+{
+  return model->state_data ? model->state_data[state] : NULL;
+}
+
+uint64_t model_edge_count (const MarkovModel *model, uint32_t state,
+                           uint32_t edge)
+{
+  uint32_t count = model_cumulative (model, edge);
+  if (edge > model->succ_offsets[state])
+  {
+    count -= model_cumulative (model, edge - 1);
+  }
+  return model->state_scales ?
+         (uint64_t) count * model->state_scales[state] : count;
+}
+
+/**
+ * @return the state of the model as a state of the chain: its string,
+ * or its context interned in the chain, NULL in case of allocation error.
+ */
+static void *thaw_state_data (MarkovChain *markov_chain,
+                               const MarkovModel *model, uint32_t state)
+{
+  if (markov_chain->order <= 1)
+  {
+    return (void *) arena_string (markov_chain->arena,
+                                  model->state_strings[state]);
+  }
+  uint32_t word_ids[MAX_ORDER];
+  size_t context_len = (size_t) markov_chain->order - 1;
+  memcpy (word_ids, model->state_contexts + state * context_len,
+          context_len * sizeof (uint32_t));
+  word_ids[context_len] = model->state_strings[state];
+  return intern_context (markov_chain, word_ids);
+}
+
+bool load_model_into_chain (MarkovChain *markov_chain,
+                            const MarkovModel *model)
+{
+  const ModelHeader *header = model->header;
+  int order = markov_chain->order > 1 ? markov_chain->order : 1;
+  if (!markov_chain->arena || markov_chain->database->size != 0 ||
+      markov_chain->arena->count != 0 || (uint32_t) order != header->order)
+  {
+    return false;
+  }
+  // the model's strings are distinct, so they get the same ids again
+  for (uint32_t i = 0; i < header->num_strings; i++)
+  {
+    const char *str = model->strings + model->string_offsets[i];
+    const char *interned = arena_intern (markov_chain->arena, str,
+                                         strlen (str));
+    if (!interned || arena_string_id (interned) != i)
+    {
+      return false;
+    }
+  }
+  for (uint32_t state = 0; state < header->num_states; state++)
+  {
+    void *data = thaw_state_data (markov_chain, model, state);
+    Node *node = data ? add_to_database (markov_chain, data) : NULL;
+    if (!node || node->data->index != state)
+    {
+      return false;
+    }
+  }
+  for (uint32_t state = 0; state < header->num_states; state++)
+  {
+    uint32_t begin = model->succ_offsets[state];
+    for (uint32_t edge = begin; edge < model->succ_offsets[state + 1];
+         edge++)
+    {
+      uint64_t count = model_edge_count (model, state, edge);
+      if (!add_frequency (markov_chain->nodes[state],
+                          markov_chain->nodes[model->succ_targets[edge]],
+                          markov_chain, count))
+      {
+        return false;
+      }
+    }
+  }
+  return build_samplers (markov_chain);
+}
+
+const char *model_state_string (const MarkovModel *model, uint32_t state)
+{
+  return model->strings +
+         model->string_offsets[model->state_strings[state]];
+}
+
+/**
+ * Like search_cumulative, over the range [low, high) of a model array of
+ * running counts of the given type.
+ */
+#define SEARCH_MODEL_CUMULATIVE(name, type) \
+static uint32_t name (const type *cumulative, uint32_t low, uint32_t high, \
+                      uint64_t rand_ind) \
+{ \
+  high--; \
+  while (low < high) \
+  { \
+    uint32_t mid = low + (high - low) / 2; \
+    if (cumulative[mid] > rand_ind) \
+    { \
+      high = mid; \
+    } \
+    else \
+    { \
+      low = mid + 1; \
+    } \
+  } \
+  return low; \
+}
+
+SEARCH_MODEL_CUMULATIVE (search_model_cumulative8, uint8_t)
+SEARCH_MODEL_CUMULATIVE (search_model_cumulative16, uint16_t)
+SEARCH_MODEL_CUMULATIVE (search_model_cumulative, uint32_t)
+SEARCH_MODEL_CUMULATIVE (search_model_starts, uint64_t)
+
+static uint32_t draw_model_first_state (const MarkovModel *model,
+                                        MarkovRng *rng)
+{
+  uint32_t count = model->header->num_starts;
+  if (count == 0)
+  {
+    return MODEL_NO_STATE;
+  }
+  if (!model->weighted_start)
+  {
+    return model->start_states[draw_number (rng, count)];
+  }
+  uint64_t rand_ind = draw_number (rng, model->start_cumulative[count - 1]);
+  return model->start_states[search_model_starts
+      (model->start_cumulative, 0, count, rand_ind)];
+}
+
+static uint32_t draw_model_next_state (const MarkovModel *model,
+                                       uint32_t state, MarkovRng *rng)
+{
+  uint32_t begin = model->succ_offsets[state];
+  uint32_t end = model->succ_offsets[state + 1];
+  if (begin == end)
+  {
+    return MODEL_NO_STATE;
+  }
+  uint32_t rand_ind = (uint32_t) draw_number
+      (rng, model_cumulative (model, end - 1));
+  uint32_t edge;
+  switch (model->header->count_bits)
+  {
+    case 8:
+      edge = search_model_cumulative8 (model->succ_cumulative, begin, end,
+                                       rand_ind);
+      break;
+    case 16:
+      edge = search_model_cumulative16 (model->succ_cumulative, begin, end,
+                                        rand_ind);
+      break;
+    default:
+      edge = search_model_cumulative (model->succ_cumulative, begin, end,
+                                      rand_ind);
+  }
+  return model->succ_targets[edge];
+}
+
+uint32_t model_first_random_state (const MarkovModel *model)
+{
+  return draw_model_first_state (model, NULL);
+}
+
+uint32_t model_next_random_state (const MarkovModel *model, uint32_t state)
+{
+  return draw_model_next_state (model, state, NULL);
+}
+
+/**
+ * Like walk_tweet, for a loaded model.
+ * @param tweet filled with the strings of the words of the walk
+ * @return the index of the last word in tweet.
+ */
+static int walk_model_tweet (const MarkovModel *model, uint32_t first_state,
+                             MarkovRng *rng, const char **tweet,
+                             int max_length)
+{
+  if (max_length > MAX_TWEET_LEN)
+  {
+    max_length = MAX_TWEET_LEN;
+  }
+  int arr_len = (int) model->header->order - 1;
+  const uint32_t *context = model->state_contexts +
+                            (size_t) first_state * (size_t) arr_len;
+  for (int i = 0; i < arr_len; i++)
+  {
+    tweet[i] = model->strings + model->string_offsets[context[i]];
+  }
+  tweet[arr_len] = model_state_string (model, first_state);
+  if (arr_len >= max_length)
+  {
+    // the first state alone is longer than the tweet may be
+    return max_length > 1 ? max_length - 1 : 0;
+  }
+  uint32_t curr_state = first_state;
+  for (int i = arr_len + 1; i < max_length; i++)
+  {
+    curr_state = draw_model_next_state (model, curr_state, rng);
+    if (curr_state == MODEL_NO_STATE)
+    {
+      break;
+    }
+    tweet[i] = model_state_string (model, curr_state);
+    arr_len = i;
+    if ((model->state_flags[curr_state] & MODEL_STATE_LAST) ||
+        model->succ_offsets[curr_state] ==
+        model->succ_offsets[curr_state + 1])
+    {
+      break;
+    }
+  }
+  return arr_len;
+}
+
+void generate_tweet_from_model (const MarkovModel *model,
+                                uint32_t first_state, int max_length)
+{
+  const char *tweet[MAX_TWEET_LEN];
+  int arr_len = walk_model_tweet (model, first_state, NULL, tweet,
+                                  max_length);
+  for (int j = 0; j < arr_len; j++)
+  {
+    fputs (tweet[j], stdout);
+    fputc (' ', stdout);
+  }
+  fputs (tweet[arr_len], stdout);
+  if (arr_len == MAX_TWEET_LEN - 1)
+  {
+    fputc ('.', stdout);
+  }
+  fputc ('\n', stdout);
+}
+
+#define BATCH_BLOCK_TWEETS 1024
+#define BATCH_SLOTS_PER_THREAD 2
+#define TWEET_NUMBER_LEN 32
+
+#define DEFAULT_RNG_SEED 1
+
+static const uint64_t rng_jump_polynomial[4] = {
+    0x180EC6D33CFD0ABAULL, 0xD5A61266F0C9392CULL,
+    0xA9582618E03FC9AAULL, 0x39ABDC4529B1661CULL};
+
+static __thread MarkovRng default_rng;
+static __thread bool default_rng_seeded;
+
+void markov_rng_seed (MarkovRng *rng, uint64_t seed, uint64_t stream)
+{
+  // splitmix64 from a point of its own for every seed and stream
+  uint64_t z = markov_rng_mix (seed) ^
+               markov_rng_mix (stream * RNG_GOLDEN_GAMMA + 1);
+  for (int i = 0; i < 4; i++)
+  {
+    z += RNG_GOLDEN_GAMMA;
+    rng->state[i] = markov_rng_mix (z);
+  }
+}
+
+void markov_rng_jump (MarkovRng *rng)
+{
+  uint64_t jumped[4] = {0, 0, 0, 0};
+  for (int word = 0; word < 4; word++)
+  {
+    for (int bit = 0; bit < 64; bit++)
+    {
+      if (rng_jump_polynomial[word] & (1ULL << bit))
+      {
+        for (int i = 0; i < 4; i++)
+        {
+          jumped[i] ^= rng->state[i];
+        }
+      }
+      markov_rng_next (rng);
+    }
+  }
+  memcpy (rng->state, jumped, sizeof (jumped));
+}
+
+void markov_rng_split (MarkovRng *rng, MarkovRng *child)
+{
+  *child = *rng;
+  markov_rng_jump (rng);
+}
+
+MarkovRng *markov_rng_default (void)
+{
+  if (!default_rng_seeded)
+  {
+    markov_rng_seed_default (DEFAULT_RNG_SEED);
+  }
+  return &default_rng;
+}
+
+void markov_rng_seed_default (uint64_t seed)
+{
+  markov_rng_seed (&default_rng, seed, 0);
+  default_rng_seeded = true;
+}
+
+void markov_rng_batch_seed (MarkovRngBatch *batch, uint64_t seed,
+                            uint64_t stream)
+{
+  MarkovRng lane;
+  markov_rng_seed (&lane, seed, stream);
+  for (int k = 0; k < RNG_BATCH_LANES; k++)
+  {
+    if (k > 0)
+    {
+      markov_rng_jump (&lane);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+      batch->state[i][k] = lane.state[i];
+    }
+  }
+}
+
+/**
+ * @return the next 64 bits of one lane of the batch.
+ */
+static uint64_t batch_lane_next (MarkovRngBatch *batch, int k)
+{
+  MarkovRng lane = {{batch->state[0][k], batch->state[1][k],
+                     batch->state[2][k], batch->state[3][k]}};
+  uint64_t result = markov_rng_next (&lane);
+  for (int i = 0; i < 4; i++)
+  {
+    batch->state[i][k] = lane.state[i];
+  }
+  return result;
+}
+
+/**
+ * Scale the draws of a group of lanes into their bounds like
+ * markov_rng_bounded, drawing again from a lane whose draw would be
+ * biased.
+ */
+static void bound_group (MarkovRngBatch *batch, const uint64_t *draws,
+                         const uint32_t *bounds, uint32_t *out)
+{
+  for (int k = 0; k < RNG_BATCH_LANES; k++)
+  {
+    uint64_t product = (draws[k] >> 32) * bounds[k];
+    if ((uint32_t) product < bounds[k])
+    {
+      uint32_t threshold = -bounds[k] % bounds[k];
+      while ((uint32_t) product < threshold)
+      {
+        product = (batch_lane_next (batch, k) >> 32) * bounds[k];
+      }
+    }
+    out[k] = (uint32_t) (product >> 32);
+  }
+}
+
+static void batch_next_scalar (MarkovRngBatch *batch, uint64_t *draws)
+{
+  for (int k = 0; k < RNG_BATCH_LANES; k++)
+  {
+    draws[k] = batch_lane_next (batch, k);
+  }
+}
+
+static bool rng_use_avx2 (void)
+{
+#ifdef RNG_X86
+  return __builtin_cpu_supports ("avx2");
+#else
+  return false;
+#endif
+}
+
+#ifdef RNG_X86
+/**
+ * The batch's state, one vector per word, kept in registers while the
+ * AVX2 kernels fill an array.
+ */
+typedef struct BatchVectors {
+    __m256i s0, s1, s2, s3;
+} BatchVectors;
+
+__attribute__ ((target ("avx2")))
+static inline BatchVectors load_batch (const MarkovRngBatch *batch)
+{
+  return (BatchVectors) {
+      _mm256_loadu_si256 ((const __m256i *) batch->state[0]),
+      _mm256_loadu_si256 ((const __m256i *) batch->state[1]),
+      _mm256_loadu_si256 ((const __m256i *) batch->state[2]),
+      _mm256_loadu_si256 ((const __m256i *) batch->state[3])};
+}
+
+__attribute__ ((target ("avx2")))
+static inline void store_batch (MarkovRngBatch *batch, BatchVectors v)
+{
+  _mm256_storeu_si256 ((__m256i *) batch->state[0], v.s0);
+  _mm256_storeu_si256 ((__m256i *) batch->state[1], v.s1);
+  _mm256_storeu_si256 ((__m256i *) batch->state[2], v.s2);
+  _mm256_storeu_si256 ((__m256i *) batch->state[3], v.s3);
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256i rotl_avx2 (__m256i x, int k)
+{
+  return _mm256_or_si256 (_mm256_slli_epi64 (x, k),
+                          _mm256_srli_epi64 (x, 64 - k));
+}
+
+/**
+ * Step every lane at once, like batch_next_scalar.
+ * @return the lanes' draws.
+ */
+__attribute__ ((target ("avx2")))
+static inline __m256i next_avx2 (BatchVectors *v)
+{
+  // rotl (s1 * 5, 7) * 9, the multiplications as shifts and adds
+  __m256i times5 = _mm256_add_epi64 (_mm256_slli_epi64 (v->s1, 2), v->s1);
+  __m256i rotated = rotl_avx2 (times5, 7);
+  __m256i result = _mm256_add_epi64 (_mm256_slli_epi64 (rotated, 3),
+                                     rotated);
+  __m256i t = _mm256_slli_epi64 (v->s1, 17);
+  v->s2 = _mm256_xor_si256 (v->s2, v->s0);
+  v->s3 = _mm256_xor_si256 (v->s3, v->s1);
+  v->s1 = _mm256_xor_si256 (v->s1, v->s2);
+  v->s0 = _mm256_xor_si256 (v->s0, v->s3);
+  v->s2 = _mm256_xor_si256 (v->s2, t);
+  v->s3 = rotl_avx2 (v->s3, 45);
+  return result;
+}
+
+/**
+ * markov_rng_batch_fill of whole groups, with AVX2.
+ */
+__attribute__ ((target ("avx2")))
+static void batch_fill_avx2 (MarkovRngBatch *batch, uint64_t *out,
+                             size_t groups)
+{
+  BatchVectors v = load_batch (batch);
+  for (size_t i = 0; i < groups; i++)
+  {
+    _mm256_storeu_si256 ((__m256i *) (out + i * RNG_BATCH_LANES),
+                         next_avx2 (&v));
+  }
+  store_batch (batch, v);
+}
+
+/**
+ * markov_rng_batch_bounded of whole groups, with AVX2: the draws are
+ * scaled into their bounds four at a time, and only the groups with a
+ * draw that may be biased go through bound_group.
+ */
+__attribute__ ((target ("avx2")))
+static void batch_bounded_avx2 (MarkovRngBatch *batch,
+                                const uint32_t *bounds, uint32_t *out,
+                                size_t groups)
+{
+  const __m256i even_words = _mm256_setr_epi32 (1, 3, 5, 7, 1, 3, 5, 7);
+  const __m256i low_words = _mm256_set1_epi64x (UINT32_MAX);
+  BatchVectors v = load_batch (batch);
+  for (size_t i = 0; i < groups * RNG_BATCH_LANES; i += RNG_BATCH_LANES)
+  {
+    __m256i draws = next_avx2 (&v);
+    __m256i bound = _mm256_cvtepu32_epi64
+        (_mm_loadu_si128 ((const __m128i *) (bounds + i)));
+    __m256i product = _mm256_mul_epu32 (_mm256_srli_epi64 (draws, 32),
+                                        bound);
+    __m256i low = _mm256_and_si256 (product, low_words);
+    if (_mm256_movemask_pd (_mm256_castsi256_pd
+        (_mm256_cmpgt_epi64 (bound, low))))
+    {
+      uint64_t lanes[RNG_BATCH_LANES];
+      _mm256_storeu_si256 ((__m256i *) lanes, draws);
+      store_batch (batch, v);
+      bound_group (batch, lanes, bounds + i, out + i);
+      v = load_batch (batch);
+      continue;
+    }
+    // the high word of every product, packed into four numbers
+    __m256i scaled = _mm256_permutevar8x32_epi32 (product, even_words);
+    _mm_storeu_si128 ((__m128i *) (out + i),
+                      _mm256_castsi256_si128 (scaled));
+  }
+  store_batch (batch, v);
+}
+#endif
+
+const char *markov_rng_kernel_name (void)
+{
+  return rng_use_avx2 () ? "avx2" : "scalar";
+}
+
+void markov_rng_batch_fill (MarkovRngBatch *batch, uint64_t *out,
+                            size_t count)
+{
+  size_t i = 0;
+#ifdef RNG_X86
+  if (rng_use_avx2 ())
+  {
+    batch_fill_avx2 (batch, out, count / RNG_BATCH_LANES);
+    i = count - count % RNG_BATCH_LANES;
+  }
+#endif
+  for (; i + RNG_BATCH_LANES <= count; i += RNG_BATCH_LANES)
+  {
+    batch_next_scalar (batch, out + i);
+  }
+  if (i < count)
+  {
+    uint64_t draws[RNG_BATCH_LANES];
+    batch_next_scalar (batch, draws);
+    memcpy (out + i, draws, (count - i) * sizeof (uint64_t));
+  }
+}
+
+void markov_rng_batch_bounded (MarkovRngBatch *batch, const uint32_t *bounds,
+                               uint32_t *out, size_t count)
+{
+  uint64_t draws[RNG_BATCH_LANES];
+  size_t i = 0;
+#ifdef RNG_X86
+  if (rng_use_avx2 ())
+  {
+    batch_bounded_avx2 (batch, bounds, out, count / RNG_BATCH_LANES);
+    i = count - count % RNG_BATCH_LANES;
+  }
+#endif
+  for (; i + RNG_BATCH_LANES <= count; i += RNG_BATCH_LANES)
+  {
+    batch_next_scalar (batch, draws);
+    bound_group (batch, draws, bounds + i, out + i);
+  }
+  if (i < count)
+  {
+    // the lanes past the end draw for a bound of 1, and are dropped
+    uint32_t last_bounds[RNG_BATCH_LANES] = {1, 1, 1, 1};
+    uint32_t last_out[RNG_BATCH_LANES];
+    memcpy (last_bounds, bounds + i, (count - i) * sizeof (uint32_t));
+    batch_next_scalar (batch, draws);
+    bound_group (batch, draws, last_bounds, last_out);
+    memcpy (out + i, last_out, (count - i) * sizeof (uint32_t));
+  }
+}
+
+/** The append_function of null terminated strings. */
+static void append_string (void *data, OutputBuffer *out)
+{
+  output_append_str (out, data);
+}
+
+/**
+ * Append one "Tweet <number>: ..." line of the given words.
+ */
+static void append_numbered_tweet (OutputBuffer *out, int number,
+                                   append_function append, void **tweet,
+                                   int arr_len)
+{
+  char prefix[TWEET_NUMBER_LEN];
+  int prefix_len = snprintf (prefix, sizeof (prefix), "Tweet %d: ", number);
+  output_append (out, prefix, (size_t) prefix_len);
+  append_tweet_words (out, append, tweet, arr_len);
+}
+
+/**
+ * Render count tweets starting at tweet first_tweet (0 based) into out.
+ * @return false in case of allocation error.
+ */
+typedef bool (*render_function)(const void *source, int first_tweet,
+                                int count, uint64_t seed,
+                                OutputBuffer *out);
+
+static bool render_chain_tweets (const void *source, int first_tweet,
+                                 int count, uint64_t seed,
+                                 OutputBuffer *out)
+{
+  MarkovChain *markov_chain = (MarkovChain *) source;
+  append_function append = markov_chain->append_func ?
+                           markov_chain->append_func : append_string;
+  for (int i = first_tweet; i < first_tweet + count; i++)
+  {
+    MarkovRng rng;
+    markov_rng_seed (&rng, seed, (uint64_t) i);
+    void *tweet[MAX_TWEET_LEN];
+    int arr_len = walk_tweet (markov_chain,
+                              draw_first_node (markov_chain, &rng), &rng,
+                              tweet, MAX_TWEET_LEN);
+    append_numbered_tweet (out, i + 1, append, tweet, arr_len);
+  }
+  return !out->failed;
+}
+
+bool append_model_tweets (const MarkovModel *model, int first_tweet,
+                          int count, uint64_t seed, int max_length,
+                          OutputBuffer *out)
+{
+  for (int i = first_tweet; i < first_tweet + count; i++)
+  {
+    MarkovRng rng;
+    markov_rng_seed (&rng, seed, (uint64_t) i);
+    const char *tweet[MAX_TWEET_LEN];
+    int arr_len = walk_model_tweet (model,
+                                    draw_model_first_state (model, &rng),
+                                    &rng, tweet, max_length);
+    append_numbered_tweet (out, i + 1, append_string, (void **) tweet,
+                           arr_len);
+  }
+  return !out->failed;
+}
+
+static bool render_model_tweets (const void *source, int first_tweet,
+                                 int count, uint64_t seed,
+                                 OutputBuffer *out)
+{
+  return append_model_tweets (source, first_tweet, count, seed,
+                              MAX_TWEET_LEN, out);
+}
+
+/**
+ * A block of rendered tweets, waiting to be written. Block b always
+ * goes to slot b % slot_count, and is only rendered once block
+ * b - slot_count was written.
+ */
+typedef struct BatchSlot {
+    OutputBuffer text;
+    int block;
+    bool done;
+} BatchSlot;
+
+/**
+ * Shared state of a batch: workers take the next block under lock and
+ * render it outside of it, the calling thread writes blocks in order.
+ */
+typedef struct Batch {
+    render_function render;
+    const void *source;
+    uint64_t seed;
+    int tweet_count;
+    int block_count;
+    int next_block;
+    int written_blocks;
+    BatchSlot *slots;
+    int slot_count;
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t block_done;
+    pthread_cond_t slot_free;
+} Batch;
+
+static int batch_block_len (const Batch *batch, int block)
+{
+  int left = batch->tweet_count - block * BATCH_BLOCK_TWEETS;
+  return left < BATCH_BLOCK_TWEETS ? left : BATCH_BLOCK_TWEETS;
+}
+
+static void *batch_worker (void *arg)
+{
+  Batch *batch = arg;
+  pthread_mutex_lock (&batch->lock);
+  while (!batch->failed && batch->next_block < batch->block_count)
+  {
+    int block = batch->next_block;
+    if (block >= batch->written_blocks + batch->slot_count)
+    {
+      pthread_cond_wait (&batch->slot_free, &batch->lock);
+      continue;
+    }
+    batch->next_block++;
+    BatchSlot *slot = &batch->slots[block % batch->slot_count];
+    pthread_mutex_unlock (&batch->lock);
+    STATS_CLOCK (render_start);
+    bool rendered = batch->render (batch->source,
+                                   block * BATCH_BLOCK_TWEETS,
+                                   batch_block_len (batch, block),
+                                   batch->seed, &slot->text);
+    STATS_SINCE (STATS_GENERATE_NS, render_start);
+    pthread_mutex_lock (&batch->lock);
+    slot->block = block;
+    slot->done = true;
+    batch->failed = batch->failed || !rendered;
+    pthread_cond_broadcast (&batch->block_done);
+  }
+  pthread_mutex_unlock (&batch->lock);
+  return NULL;
+}
+
+/**
+ * Write the batch's blocks to fd in order, as the workers finish them.
+ */
+static void write_batch_blocks (Batch *batch, int fd)
+{
+  for (int block = 0; block < batch->block_count; block++)
+  {
+    BatchSlot *slot = &batch->slots[block % batch->slot_count];
+    pthread_mutex_lock (&batch->lock);
+    while (!batch->failed && !(slot->done && slot->block == block))
+    {
+      pthread_cond_wait (&batch->block_done, &batch->lock);
+    }
+    bool failed = batch->failed;
+    pthread_mutex_unlock (&batch->lock);
+    if (failed)
+    {
+      return;
+    }
+    STATS_CLOCK (write_start);
+    bool written = output_flush_fd (&slot->text, fd);
+    STATS_SINCE (STATS_OUTPUT_NS, write_start);
+    pthread_mutex_lock (&batch->lock);
+    slot->done = false;
+    batch->written_blocks++;
+    batch->failed = batch->failed || !written;
+    pthread_cond_broadcast (&batch->slot_free);
+    pthread_mutex_unlock (&batch->lock);
+  }
+}
+
+static bool run_batch (render_function render, const void *source,
+                       int tweet_count, int thread_count, uint64_t seed,
+                       int fd)
+{
+  // the lock and conditions are only initialized for the workers
+  Batch batch = {
+      .render = render, .source = source, .seed = seed,
+      .tweet_count = tweet_count,
+      .block_count = (tweet_count + BATCH_BLOCK_TWEETS - 1) /
+                     BATCH_BLOCK_TWEETS};
+  if (thread_count <= 1)
+  {
+    // nothing to overlap, render and write each block in turn
+    OutputBuffer text = {0};
+    bool success = true;
+    for (int block = 0; success && block < batch.block_count; block++)
+    {
+      STATS_CLOCK (render_start);
+      success = render (source, block * BATCH_BLOCK_TWEETS,
+                        batch_block_len (&batch, block), seed, &text);
+      STATS_SINCE (STATS_GENERATE_NS, render_start);
+      STATS_CLOCK (write_start);
+      success = success && output_flush_fd (&text, fd);
+      STATS_SINCE (STATS_OUTPUT_NS, write_start);
+    }
+    output_free (&text);
+    return success;
+  }
+  batch.slot_count = thread_count * BATCH_SLOTS_PER_THREAD;
+  batch.slots = calloc ((size_t) batch.slot_count, sizeof (BatchSlot));
+  pthread_t *threads = malloc ((size_t) thread_count * sizeof (pthread_t));
+  if (!batch.slots || !threads)
+  {
+    free (batch.slots);
+    free (threads);
+    return false;
+  }
+  pthread_mutex_init (&batch.lock, NULL);
+  pthread_cond_init (&batch.block_done, NULL);
+  pthread_cond_init (&batch.slot_free, NULL);
+  int started = 0;
+  while (started < thread_count &&
+         pthread_create (&threads[started], NULL, batch_worker,
+                         &batch) == 0)
+  {
+    started++;
+  }
+  if (started == thread_count)
+  {
+    write_batch_blocks (&batch, fd);
+  }
+  // wake any worker still waiting for a slot, so it sees the failure
+  pthread_mutex_lock (&batch.lock);
+  batch.failed = batch.failed || started < thread_count;
+  pthread_cond_broadcast (&batch.slot_free);
+  pthread_mutex_unlock (&batch.lock);
+  for (int i = 0; i < started; i++)
+  {
+    pthread_join (threads[i], NULL);
+  }
+  pthread_cond_destroy (&batch.slot_free);
+  pthread_cond_destroy (&batch.block_done);
+  pthread_mutex_destroy (&batch.lock);
+  for (int i = 0; i < batch.slot_count; i++)
+  {
+    output_free (&batch.slots[i].text);
+  }
+  free (batch.slots);
+  free (threads);
+  return !batch.failed;
+}
+
+bool generate_tweets_batch (MarkovChain *markov_chain, int tweet_count,
+                            int thread_count, uint64_t seed, int fd)
+{
+  // the workers only read the chain, so every lazy table is built first
+  if (!build_samplers (markov_chain))
+  {
+    return false;
+  }
+  if (tweet_count > 0 && markov_chain->start_states_count == 0)
+  {
+    return false;
+  }
+  return run_batch (render_chain_tweets, markov_chain, tweet_count,
+                    thread_count, seed, fd);
+}
+
+bool generate_model_tweets_batch (const MarkovModel *model, int tweet_count,
+                                  int thread_count, uint64_t seed, int fd)
+{
+  if (tweet_count > 0 && model->header->num_starts == 0)
+  {
+    return false;
+  }
+  return run_batch (render_model_tweets, model, tweet_count, thread_count,
+                    seed, fd);
+}
+
+/**
+ * The counts a state keeps in a compacted model, and what they divide by.
+ */
+typedef struct CompactState
+{
+    // the count each successor keeps, 0 for the dropped ones
+    uint32_t *kept;
+    uint32_t scale;
+} CompactState;
+
+/**
+ * @return the sum of the kept counts of a state, each divided by scale
+ * and rounded to the nearest.
+ */
+static uint64_t scaled_sum (const uint32_t *kept, uint32_t len,
+                            uint64_t scale)
+{
+  uint64_t sum = 0;
+  for (uint32_t i = 0; i < len; i++)
+  {
+    sum += (kept[i] + scale / 2) / scale;
+  }
+  return sum;
+}
+
+/**
+ * Scale the kept counts of a state down to a total of at most max_total,
+ * by the smallest scale that does it, and drop those rounded to 0. Keeps
+ * at least the largest count, as a count of 1.
+ * @return the scale.
+ */
+static uint32_t quantize_counts (uint32_t *kept, uint32_t len,
+                                 uint64_t total, uint64_t max_total)
+{
+  // the sum only falls as the scale grows, and is 0 past twice the total
+  uint64_t low = (total + max_total - 1) / max_total;
+  uint64_t high = 2 * total + 1;
+  low = low < 1 ? 1 : low;
+  while (low < high)
+  {
+    uint64_t mid = low + (high - low) / 2;
+    if (scaled_sum (kept, len, mid) <= max_total)
+    {
+      high = mid;
+    }
+    else
+    {
+      low = mid + 1;
+    }
+  }
+  if (scaled_sum (kept, len, low) == 0)
+  {
+    // too many even counts to tell apart: keep only the first largest
+    uint32_t largest = 0;
+    for (uint32_t i = 0; i < len; i++)
+    {
+      largest = kept[i] > kept[largest] ? i : largest;
+    }
+    uint32_t scale = kept[largest];
+    memset (kept, 0, len * sizeof (uint32_t));
+    kept[largest] = 1;
+    return scale;
+  }
+  for (uint32_t i = 0; i < len; i++)
+  {
+    kept[i] = (uint32_t) ((kept[i] + low / 2) / low);
+  }
+  return (uint32_t) low;
+}
+
+/**
+ * Prune and quantize the successors of every state.
+ * @param kept filled with the count of every edge of the model in the
+ * compacted one (divided by its state's scale), 0 for the dropped edges
+ * @param scales filled with each state's scale
+ */
+static void compact_counts (const MarkovModel *model,
+                            const CompactOptions *options, uint32_t *kept,
+                            uint32_t *scales, CompactReport *report)
+{
+  const ModelHeader *header = model->header;
+  uint64_t max_total = ((uint64_t) 1 << options->count_bits) - 1;
+  double weighted_divergence = 0, all_counts = 0, dropped = 0;
+  for (uint32_t state = 0; state < header->num_states; state++)
+  {
+    uint32_t begin = model->succ_offsets[state];
+    uint32_t len = model->succ_offsets[state + 1] - begin;
+    // counts are kept divided by the model's own scale, so they fit
+    uint32_t model_scale = model->state_scales ?
+                           model->state_scales[state] : 1;
+    uint64_t total = 0, kept_total = 0;
+    for (uint32_t i = 0; i < len; i++)
+    {
+      uint64_t count = model_edge_count (model, state, begin + i);
+      kept[begin + i] = count >= options->min_count ?
+                        (uint32_t) (count / model_scale) : 0;
+      total += count;
+      kept_total += kept[begin + i];
+    }
+    scales[state] = model_scale;
+    if (options->count_bits < COMPACT_EXACT_BITS && kept_total > 0)
+    {
+      scales[state] = model_scale * quantize_counts
+          (kept + begin, len, kept_total, max_total);
+      kept_total = scaled_sum (kept + begin, len, 1);
+    }
+    if (total == 0)
+    {
+      continue;
+    }
+    // total variation distance between the successor distributions
+    double divergence = 0;
+    for (uint32_t i = 0; i < len; i++)
+    {
+      double before = (double) model_edge_count (model, state, begin + i) /
+                      (double) total;
+      double after = kept_total ? (double) kept[begin + i] /
+                                  (double) kept_total : 0;
+      divergence += (before > after ? before - after : after - before) / 2;
+      dropped += kept[begin + i] ? 0 : before * (double) total;
+    }
+    divergence = kept_total ? divergence : 1;
+    weighted_divergence += divergence * (double) total;
+    all_counts += (double) total;
+    if (divergence > report->max_divergence)
+    {
+      report->max_divergence = divergence;
+    }
+  }
+  report->mean_divergence = all_counts ? weighted_divergence / all_counts
+                                       : 0;
+  report->dropped_share = all_counts ? dropped / all_counts : 0;
+}
+
+/**
+ * Number the states and strings the compacted model keeps, in their
+ * order in the model.
+ * @param state_ids filled with the new index of every state,
+ * MODEL_NO_STATE for the dropped ones
+ * @param string_ids filled with the new id of every string,
+ * MODEL_NO_STATE for the dropped ones
+ */
+static void number_kept (const MarkovModel *model, const uint32_t *kept,
+                         bool drop_states, uint32_t *state_ids,
+                         uint32_t *string_ids, ModelHeader *compacted)
+{
+  const ModelHeader *header = model->header;
+  size_t context_len = header->order - 1;
+  for (uint32_t state = 0; state < header->num_states; state++)
+  {
+    state_ids[state] = drop_states ? MODEL_NO_STATE : 0;
+  }
+  for (uint32_t state = 0; drop_states && state < header->num_states;
+       state++)
+  {
+    for (uint32_t edge = model->succ_offsets[state];
+         edge < model->succ_offsets[state + 1]; edge++)
+    {
+      if (kept[edge])
+      {
+        state_ids[state] = 0;
+        state_ids[model->succ_targets[edge]] = 0;
+      }
+    }
+  }
+  for (uint32_t i = 0; i < header->num_strings; i++)
+  {
+    string_ids[i] = MODEL_NO_STATE;
+  }
+  uint32_t num_states = 0;
+  for (uint32_t state = 0; state < header->num_states; state++)
+  {
+    if (state_ids[state] == MODEL_NO_STATE)
+    {
+      continue;
+    }
+    state_ids[state] = num_states++;
+    string_ids[model->state_strings[state]] = 0;
+    for (size_t i = 0; i < context_len; i++)
+    {
+      string_ids[model->state_contexts[state * context_len + i]] = 0;
+    }
+  }
+  uint32_t num_strings = 0, strings_size = 0;
+  for (uint32_t i = 0; i < header->num_strings; i++)
+  {
+    if (string_ids[i] != MODEL_NO_STATE)
+    {
+      string_ids[i] = num_strings++;
+      strings_size += (uint32_t) strlen (model->strings +
+                                         model->string_offsets[i]) + 1;
+    }
+  }
+  compacted->num_states = num_states;
+  compacted->num_strings = num_strings;
+  compacted->strings_size = strings_size;
+}
+
+static void store_cumulative (void *cumulative, int count_bits,
+                              uint32_t i, uint32_t value)
+{
+  switch (count_bits)
+  {
+    case 8:
+      ((uint8_t *) cumulative)[i] = (uint8_t) value;
+      break;
+    case 16:
+      ((uint16_t *) cumulative)[i] = (uint16_t) value;
+      break;
+    default:
+      ((uint32_t *) cumulative)[i] = value;
+  }
+}
+
+/**
+ * Fill the arrays of the compacted model, given what it keeps.
+ * @return true on success, false in case of allocation error.
+ */
+static bool build_compact_arrays (const MarkovModel *model,
+                                  const uint32_t *kept,
+                                  const uint32_t *scales,
+                                  const uint32_t *state_ids,
+                                  const uint32_t *string_ids,
+                                  ModelHeader *compacted,
+                                  ModelArrays *arrays, char **strings)
+{
+  const ModelHeader *header = model->header;
+  size_t context_len = header->order - 1;
+  size_t num_states = compacted->num_states;
+  size_t num_edges = 0;
+  for (uint32_t edge = 0; edge < header->num_edges; edge++)
+  {
+    num_edges += kept[edge] > 0;
+  }
+  int count_bits = (int) compacted->count_bits;
+  // +1 so empty models still get valid allocations
+  *strings = malloc (compacted->strings_size + 1);
+  arrays->string_offsets = malloc ((compacted->num_strings + 1) *
+                                   sizeof (uint32_t));
+  arrays->state_strings = malloc ((num_states + 1) * sizeof (uint32_t));
+  arrays->state_contexts = malloc ((num_states * context_len + 1) *
+                                   sizeof (uint32_t));
+  arrays->state_flags = malloc (num_states + 1);
+  arrays->succ_offsets = malloc ((num_states + 1) * sizeof (uint32_t));
+  arrays->succ_targets = malloc ((num_edges + 1) * sizeof (uint32_t));
+  arrays->succ_cumulative = malloc ((num_edges + 1) *
+                                    (size_t) (count_bits / CHAR_BIT));
+  arrays->state_scales = malloc ((num_states + 1) * sizeof (uint32_t));
+  arrays->start_states = malloc ((num_states + 1) * sizeof (uint32_t));
+  arrays->start_cumulative = malloc ((num_states + 1) * sizeof (uint64_t));
+  if (!*strings || !arrays->string_offsets || !arrays->state_strings ||
+      !arrays->state_contexts || !arrays->state_flags ||
+      !arrays->succ_offsets || !arrays->succ_targets ||
+      !arrays->succ_cumulative || !arrays->state_scales ||
+      !arrays->start_states || !arrays->start_cumulative)
+  {
+    return false;
+  }
+  uint32_t strings_size = 0;
+  for (uint32_t i = 0; i < header->num_strings; i++)
+  {
+    if (string_ids[i] != MODEL_NO_STATE)
+    {
+      const char *str = model->strings + model->string_offsets[i];
+      size_t len = strlen (str) + 1;
+      arrays->string_offsets[string_ids[i]] = strings_size;
+      memcpy (*strings + strings_size, str, len);
+      strings_size += (uint32_t) len;
+    }
+  }
+  uint32_t edge = 0, starts = 0;
+  uint64_t start_total = 0;
+  for (uint32_t state = 0; state < header->num_states; state++)
+  {
+    uint32_t id = state_ids[state];
+    if (id == MODEL_NO_STATE)
+    {
+      continue;
+    }
+    arrays->state_strings[id] = string_ids[model->state_strings[state]];
+    for (size_t i = 0; i < context_len; i++)
+    {
+      arrays->state_contexts[id * context_len + i] =
+          string_ids[model->state_contexts[state * context_len + i]];
+    }
+    arrays->state_flags[id] = model->state_flags[state];
+    arrays->succ_offsets[id] = edge;
+    arrays->state_scales[id] = scales[state];
+    uint32_t total = 0;
+    for (uint32_t old = model->succ_offsets[state];
+         old < model->succ_offsets[state + 1]; old++)
+    {
+      if (kept[old])
+      {
+        total += kept[old];
+        arrays->succ_targets[edge] = state_ids[model->succ_targets[old]];
+        store_cumulative (arrays->succ_cumulative, count_bits, edge++,
+                          total);
+      }
+    }
+    // sentences start by how often they did, whatever the scale
+    if (total > 0 && !(model->state_flags[state] & MODEL_STATE_LAST))
+    {
+      start_total += (uint64_t) total * scales[state];
+      arrays->start_states[starts] = id;
+      arrays->start_cumulative[starts++] = start_total;
+    }
+  }
+  arrays->succ_offsets[num_states] = edge;
+  arrays->strings = *strings;
+  bool scaled = false;
+  for (uint32_t state = 0; state < header->num_states; state++)
+  {
+    scaled = scaled || (state_ids[state] != MODEL_NO_STATE &&
+                        scales[state] > 1);
+  }
+  if (!scaled)
+  {
+    // counts that all fit unscaled need no scales
+    free (arrays->state_scales);
+    arrays->state_scales = NULL;
+  }
+  compacted->num_edges = edge;
+  compacted->num_starts = starts;
+  return true;
+}
+
+MarkovModel *compact_model (const MarkovModel *model,
+                            const CompactOptions *options,
+                            CompactReport *report)
+{
+  const ModelHeader *header = model->header;
+  if (model->state_data || options->min_count < 1 ||
+      (options->count_bits != 8 && options->count_bits != 16 &&
+       options->count_bits != COMPACT_EXACT_BITS))
+  {
+    return NULL;
+  }
+  memset (report, 0, sizeof (CompactReport));
+  // +1 so empty models still get valid allocations
+  uint32_t *kept = malloc ((header->num_edges + 1) * sizeof (uint32_t));
+  uint32_t *scales = malloc ((header->num_states + 1) * sizeof (uint32_t));
+  uint32_t *state_ids = malloc ((header->num_states + 1) *
+                                sizeof (uint32_t));
+  uint32_t *string_ids = malloc ((header->num_strings + 1) *
+                                 sizeof (uint32_t));
+  ModelHeader compacted;
+  memset (&compacted, 0, sizeof (ModelHeader));
+  ModelArrays arrays = {NULL};
+  char *strings = NULL;
+  OutputBuffer image = {0};
+  MarkovModel *result = NULL;
+  if (kept && scales && state_ids && string_ids)
+  {
+    compact_counts (model, options, kept, scales, report);
+    number_kept (model, kept, options->drop_states, state_ids, string_ids,
+                 &compacted);
+    compacted.order = header->order;
+    compacted.count_bits = (uint32_t) options->count_bits;
+    compacted.min_count = options->min_count > header->min_count ?
+                          options->min_count : header->min_count;
+    if (build_compact_arrays (model, kept, scales, state_ids, string_ids,
+                              &compacted, &arrays, &strings) &&
+        write_model_image (&compacted, &arrays, NULL, &image))
+    {
+      char *shrunk = realloc (image.data, image.len);
+      image.data = shrunk ? shrunk : image.data;
+      result = model_from_image (image.data, image.len, false);
+    }
+  }
+  if (result)
+  {
+    result->weighted_start = model->weighted_start;
+    report->bytes_before = model->mapping_len;
+    report->bytes_after = result->mapping_len;
+    report->states_before = header->num_states;
+    report->states_after = compacted.num_states;
+    report->edges_before = header->num_edges;
+    report->edges_after = compacted.num_edges;
+    report->strings_before = header->num_strings;
+    report->strings_after = compacted.num_strings;
+  }
+  else
+  {
+    output_free (&image);
+  }
+  free_model_arrays (&arrays);
+  free (strings);
+  free (kept);
+  free (scales);
+  free (state_ids);
+  free (string_ids);
+  return result;
+}
@@ -1,150 +1,767 @@
-#ifndef _MARKOV_CHAIN_H
-#define _MARKOV_CHAIN_H
-
-#include "linked_list.h"
-#include <stdio.h>  // For printf(), sscanf()
-#include <stdlib.h> // For exit(), malloc()
-#include <stdbool.h> // for bool
-
-#define ALLOCATION_ERROR_MASSAGE \
-"Allocation failure: Failed to allocate new memory\n"
-#define MAX_TWEET_LEN 20
-#define MAX_WORD_LEN 100
-
-
-/***************************/
-/*   insert typedefs here  */
-/***************************/
-
-typedef void (*print_function)(void *);
-typedef int (*comp_function)(void *, void *);
-typedef void (*free_function)(void *);
-typedef void* (*copy_function)(void *);
-typedef bool (*is_last_function)(void *);
-
-/***************************/
-
-
-
-/***************************/
-/*        STRUCTS          */
-/***************************/
-
-typedef struct MarkovNodeFrequency MarkovNodeFrequency;
-
-typedef struct MarkovNode
-{
-    void *data;
-    MarkovNodeFrequency *frequencies_list;
-    // includes the size we allocated for the frequency list
-    size_t freq_list_full_size;
-    // includes the actual size the list holds
-    size_t freq_list_act_size;
-} MarkovNode;
-
-typedef struct MarkovNodeFrequency {
-    MarkovNode *next_object;
-    int frequency;
-} MarkovNodeFrequency;
-
-/* DO NOT ADD or CHANGE variable names in this struct */
-typedef struct MarkovChain {
-    LinkedList *database;
-
-    // pointer to a func that receives data
-    // from a generic type and prints it.
-    // returns void.
-    print_function print_func;
-
-    // pointer to a func that gets 2 pointers of
-    // generic data type(same one) and compare between them */
-    // returns: - a positive value if the first is bigger
-    //          - a negative value if the second is bigger
-    //          - 0 if equal
-    comp_function comp_func;
-
-    // a pointer to a function that gets a
-    // pointer of generic data type and frees it.
-    // returns void.
-    free_function free_data;
-
-    // a pointer to a function that  gets a pointer of
-    // generic data type and returns a newly allocated copy of it
-    // returns a generic pointer.
-    copy_function copy_func;
-
-    //  a pointer to function that gets a
-    //  pointer of generic data type and returns:
-    //      - true if it's the last state.
-    //      - false otherwise.
-    is_last_function is_last;
-} MarkovChain;
-
-/**
- * Get one random state from the given markov_chain's database.
- * @param markov_chain
- * @return
- */
-MarkovNode* get_first_random_node(MarkovChain *markov_chain);
-
-/**
- * Choose randomly the next state, depend on it's occurrence frequency.
- * @param state_struct_ptr MarkovNode to choose from
- * @return MarkovNode of the chosen state
- */
-MarkovNode* get_next_random_node(MarkovNode *state_struct_ptr);
-
-/**
- * Receive markov_chain, generate and print random sentence out of it.
- * The sentence most have at least 2 words in it.
- * @param markov_chain
- * @param first_node markov_node to start with, if NULL- choose a
- * random markov_node
- * @param  max_length maximum length of chain to generate
- */
-void generate_tweet(MarkovChain *markov_chain, MarkovNode *
-first_node, int max_length);
-
-//
-// * Free markov_chain and all of it's content from memory
-// * @param markov_chain markov_chain to free
-// */
-//void free_database(MarkovChain **markov_chain);
-
-
-/** Free markov_chain and all of it's content from memory
-* @param data generic pointer that holds markov_chain to free
-*/
-void free_database(MarkovChain **ptr_chain);
-/**
- * Add the second markov_node to the counter list of the first
- * markov_node. If already in list, update it's counter value.
- * @param first_node
- * @param second_node
- * @param markov_chain
- * @return success/failure: true if the process was successful,
- * false if in case of allocation error.
- */
-bool add_node_to_frequencies_list(MarkovNode *first_node, MarkovNode
-*second_node, MarkovChain *markov_chain);
-
-/**
-* Check if data_ptr is in database. If so, return the markov_node
- * wrapping it in the markov_chain, otherwise return NULL.
- * @param markov_chain the chain to look in its database
- * @param data_ptr the state to look for
- * @return Pointer to the Node wrapping given state, NULL if state
- * not in database.
- */
-Node* get_node_from_database(MarkovChain *markov_chain, void *data_ptr);
-
-/**
-* If data_ptr in markov_chain, return it's node. Otherwise, create new
- * node, add to end of markov_chain's database and return it.
- * @param markov_chain the chain to look in its database
- * @param data_ptr the state to look for
- * @return node wrapping given data_ptr in given chain's database
- */
-Node* add_to_database(MarkovChain *markov_chain, void *data_ptr);
-
-#endif /* MARKOV_CHAIN_H */
+#ifndef _MARKOV_CHAIN_H
+#define _MARKOV_CHAIN_H
+
+#include "linked_list.h"
+#include "string_arena.h"
+#include "output_buffer.h"
+#include "slab_pool.h"
+#include <stdio.h>  // For printf(), sscanf()
+#include <stdlib.h> // For exit(), malloc()
+#include <stdbool.h> // for bool
+
+#define ALLOCATION_ERROR_MASSAGE \
+"Allocation failure: Failed to allocate new memory\n"
+#define MAX_TWEET_LEN 20
+#define MAX_WORD_LEN 100
+#define MAX_ORDER 8
+
+
+/***************************/
+/*   insert typedefs here  */
+/***************************/
+
+typedef void (*print_function)(void *);
+typedef int (*comp_function)(void *, void *);
+typedef void (*free_function)(void *);
+typedef void* (*copy_function)(void *);
+typedef bool (*is_last_function)(void *);
+typedef size_t (*hash_function)(void *);
+typedef void* (*translate_function)(void *, void *);
+typedef void (*append_function)(void *, OutputBuffer *);
+
+/***************************/
+
+
+
+/***************************/
+/*        STRUCTS          */
+/***************************/
+
+typedef struct MarkovNodeFrequency MarkovNodeFrequency;
+
+typedef struct MarkovNode
+{
+    void *data;
+    MarkovNodeFrequency *frequencies_list;
+    // includes the size we allocated for the frequency list, doubled
+    // whenever it fills up
+    size_t freq_list_full_size;
+    // includes the actual size the list holds
+    size_t freq_list_act_size;
+    // position of the node in the database list
+    size_t index;
+    // hash of successor pointer -> (position in frequencies_list + 1),
+    // 0 marks an empty slot. NULL while the list is short enough to be
+    // scanned directly.
+    size_t *successor_index;
+    // always a power of 2 (or 0 while there is no successor_index)
+    size_t successor_index_capacity;
+    // running sum of the frequencies in frequencies_list, sampled by
+    // binary search. rebuilt by build_samplers when sampler_valid is
+    // false. has room for freq_list_full_size sums, NULL until built.
+    uint64_t *cumulative_freqs;
+    bool sampler_valid;
+    // is_last of the node's (last) word, checked once when it's added
+    bool last_state;
+} MarkovNode;
+
+typedef struct MarkovNodeFrequency {
+    MarkovNode *next_object;
+    uint64_t frequency;
+} MarkovNodeFrequency;
+
+typedef struct StateIndexSlot {
+    Node *node;
+    size_t hash;
+} StateIndexSlot;
+
+/**
+ * Open addressing hash index over the database nodes. The LinkedList
+ * still owns the nodes and keeps their insertion order, the index only
+ * points into it. A zeroed index is valid, it grows as states are added.
+ */
+typedef struct StateIndex {
+    StateIndexSlot *slots;
+    // always a power of 2 (or 0 before the first insert)
+    size_t capacity;
+    size_t count;
+} StateIndex;
+
+/* DO NOT CHANGE the existing variable names in this struct */
+typedef struct MarkovChain {
+    LinkedList *database;
+
+    // pointer to a func that receives data
+    // from a generic type and prints it.
+    // returns void.
+    print_function print_func;
+
+    // pointer to a func that gets 2 pointers of
+    // generic data type(same one) and compare between them */
+    // returns: - a positive value if the first is bigger
+    //          - a negative value if the second is bigger
+    //          - 0 if equal
+    comp_function comp_func;
+
+    // pointer to a func that gets a pointer of generic data type and
+    // returns its hash. equal data (by comp_func) must hash the same.
+    // may be NULL, in which case lookups scan the whole database. set it
+    // before the first state is added, only states added with it are
+    // indexed.
+    hash_function hash_func;
+
+    // a pointer to a function that gets a
+    // pointer of generic data type and frees it.
+    // returns void.
+    // may be NULL when the data is owned by someone else (e.g. arena).
+    free_function free_data;
+
+    // a pointer to a function that  gets a pointer of
+    // generic data type and returns a newly allocated copy of it
+    // returns a generic pointer.
+    copy_function copy_func;
+
+    //  a pointer to function that gets a
+    //  pointer of generic data type and returns:
+    //      - true if it's the last state.
+    //      - false otherwise.
+    is_last_function is_last;
+
+    // pointer to a func that gets a pointer of generic data type and
+    // appends its text to the given buffer, like print_func would print
+    // it. may be NULL, in which case only print_func is used.
+    append_function append_func;
+
+    // if set (together with append_func), generate_tweet renders into
+    // this buffer instead of printing, and the caller writes it out.
+    OutputBuffer *output;
+
+    // optional string arena the states point into. owned by the chain,
+    // released with it in free_database.
+    StringArena *arena;
+
+    // number of words in each state. chains of order > 1 (which need an
+    // arena) have contexts as states: the arena ids of order consecutive
+    // words, oldest first, interned in contexts. 0 is the same as 1.
+    int order;
+    StringArena *contexts;
+
+    // the list nodes and states of database and their arrays, freed in
+    // one go by free_database. created with the first state, so states
+    // must be added through add_to_database.
+    SlabPool *pool;
+
+    // hash index over database, maintained by add_to_database.
+    StateIndex state_index;
+
+    // when true, get_first_random_node draws states by how often they
+    // occurred instead of uniformly.
+    bool weighted_start;
+
+    // every state, by its index.
+    MarkovNode **nodes;
+    size_t nodes_capacity;
+
+    // Fenwick trees over the states by index, updated by every count in
+    // O(log n): start_counts holds 1 for each state a sentence may start
+    // from (not last, with successors) and start_weights how often it
+    // occurred, so start states are drawn in index order either way.
+    // 64 bit, so the counts of a corpus of billions of words still fit.
+    uint64_t *start_counts;
+    uint64_t *start_weights;
+    size_t start_states_count;
+    uint64_t start_weights_total;
+
+    // states whose samplers went out of date since the last
+    // build_samplers, so it only rebuilds those.
+    MarkovNode **dirty_nodes;
+    size_t dirty_count;
+    size_t dirty_capacity;
+} MarkovChain;
+
+/**
+ * Get one random state from the given markov_chain's database, which
+ * isn't last and has successors. One random draw, no list walk.
+ * @param markov_chain
+ * @return the chosen MarkovNode, NULL if no state can start a sentence
+ * or in case of allocation error.
+ */
+MarkovNode* get_first_random_node(MarkovChain *markov_chain);
+
+/**
+ * Choose randomly the next state, depend on it's occurrence frequency.
+ * Never allocates: a node whose counts changed since the last
+ * build_samplers is drawn from by scanning its list.
+ * @param state_struct_ptr MarkovNode to choose from
+ * @return MarkovNode of the chosen state, NULL if it has no successors.
+ */
+MarkovNode* get_next_random_node(MarkovNode *state_struct_ptr);
+
+/**
+ * Build the sampling tables of every state whose counts changed since
+ * the last call, up front so that generation never allocates. Call after
+ * training, and again after every incremental update: it only costs as
+ * much as the states the update touched.
+ * @param markov_chain
+ * @return true on success, false in case of allocation error.
+ */
+bool build_samplers(MarkovChain *markov_chain);
+
+/**
+ * Receive markov_chain, generate and print random sentence out of it.
+ * The sentence most have at least 2 words in it. When the chain has an
+ * output buffer and an append_func, the sentence is appended to the
+ * buffer instead, to be written out by the caller (output_flush_fd).
+ * @param markov_chain
+ * @param first_node markov_node to start with, if NULL- choose a
+ * random markov_node
+ * @param  max_length maximum length of chain to generate; a first state
+ * of more words (order > 1) is cut to its first max_length words
+ */
+void generate_tweet(MarkovChain *markov_chain, MarkovNode *
+first_node, int max_length);
+
+//
+// * Free markov_chain and all of it's content from memory
+// * @param markov_chain markov_chain to free
+// */
+//void free_database(MarkovChain **markov_chain);
+
+
+/** Free markov_chain and all of it's content from memory
+* @param data generic pointer that holds markov_chain to free
+*/
+void free_database(MarkovChain **ptr_chain);
+/**
+ * Add the second markov_node to the counter list of the first
+ * markov_node. If already in list, update it's counter value.
+ * @param first_node
+ * @param second_node
+ * @param markov_chain
+ * @return success/failure: true if the process was successful,
+ * false if in case of allocation error.
+ */
+bool add_node_to_frequencies_list(MarkovNode *first_node, MarkovNode
+*second_node, MarkovChain *markov_chain);
+
+/**
+* Check if data_ptr is in database. If so, return the markov_node
+ * wrapping it in the markov_chain, otherwise return NULL.
+ * @param markov_chain the chain to look in its database
+ * @param data_ptr the state to look for
+ * @return Pointer to the Node wrapping given state, NULL if state
+ * not in database.
+ */
+Node* get_node_from_database(MarkovChain *markov_chain, void *data_ptr);
+
+/**
+* If data_ptr in markov_chain, return it's node. Otherwise, create new
+ * node, add to end of markov_chain's database and return it.
+ * @param markov_chain the chain to look in its database
+ * @param data_ptr the state to look for
+ * @return node wrapping given data_ptr in given chain's database
+ */
+Node* add_to_database(MarkovChain *markov_chain, void *data_ptr);
+
+/**
+ * Add every state and transition count of src_chain to dst_chain.
+ * States new to dst_chain are appended in src_chain's order, so merging
+ * chains built from consecutive parts of a corpus gives exactly the
+ * chain built from the whole corpus.
+ * @param dst_chain the chain to add to
+ * @param src_chain the chain to add from, left unchanged
+ * @param translate if not NULL, called with each src state and context
+ * and returns the matching state to look up in dst_chain (e.g. the same
+ * word interned in dst_chain's arena). NULL on failure.
+ * @param context passed as is to translate
+ * @return true on success, false in case of allocation error.
+ */
+bool merge_chain(MarkovChain *dst_chain, MarkovChain *src_chain,
+                 translate_function translate, void *context);
+
+/**
+ * Intern a context of the chain's order words in its contexts arena.
+ * Equal contexts get the same pointer, and the arena ids of contexts
+ * can be compared and hashed like those of words.
+ * @param markov_chain a chain of order > 1
+ * @param word_ids the arena ids of the words, oldest first
+ * @return the context, NULL in case of allocation error.
+ */
+void *intern_context(MarkovChain *markov_chain, const uint32_t *word_ids);
+
+/**
+ * @return the arena id of the i-th word of the context (oldest first).
+ */
+uint32_t context_word_id(const void *context, int i);
+
+/***************************/
+/*      SAVED MODELS       */
+/***************************/
+
+#define MODEL_MAGIC "MKVMODEL"
+#define MODEL_MAGIC_LEN 8
+#define MODEL_VERSION 4
+#define MODEL_NO_STATE UINT32_MAX
+
+/**
+ * Header of a saved model file. Every section is an array starting at
+ * the given offset from the start of the file, 8 byte aligned, so a
+ * mapped file is used as is. States and strings are referred to by
+ * their 32 bit index.
+ */
+typedef struct ModelHeader {
+    char magic[MODEL_MAGIC_LEN];
+    uint32_t version;
+    uint32_t num_strings;
+    uint32_t num_states;
+    uint32_t num_edges;
+    uint32_t num_starts;
+    // number of words in each state
+    uint32_t order;
+    // bits of each running count in succ_cumulative: 32, or 16 or 8 in a
+    // model compacted with scaled counts
+    uint32_t count_bits;
+    // successors counted fewer times were dropped by compact_model, 1 if
+    // none were
+    uint32_t min_count;
+    // char[]: the strings, each null terminated
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    // uint32_t[num_strings]: where each string starts in strings
+    uint64_t string_offsets_offset;
+    // uint32_t[num_states]: string of the (last) word of each state
+    uint64_t state_strings_offset;
+    // uint32_t[num_states * (order - 1)]: strings of the words before the
+    // last one in each state's context, oldest first
+    uint64_t state_contexts_offset;
+    // uint8_t[num_states]: MODEL_STATE_LAST if the state is last
+    uint64_t state_flags_offset;
+    // uint32_t[num_states + 1]: where each state's successors start
+    uint64_t succ_offsets_offset;
+    // uint32_t[num_edges]: successor states
+    uint64_t succ_targets_offset;
+    // uint<count_bits>_t[num_edges]: running sum of the counts of each
+    // state's successors
+    uint64_t succ_cumulative_offset;
+    // uint32_t[num_states]: what each state's counts were divided by, to
+    // fit in count_bits; 0 (no section) when none were
+    uint64_t state_scales_offset;
+    // uint32_t[num_starts]: states a sentence may start from
+    uint64_t start_states_offset;
+    // uint64_t[num_starts]: running sum of their occurrence counts
+    uint64_t start_cumulative_offset;
+    uint64_t file_size;
+} ModelHeader;
+
+#define MODEL_STATE_LAST 1
+
+/**
+ * A read-only trained model, with every array pointing straight into
+ * its (mapped) file, or into the image a chain was frozen into.
+ */
+typedef struct MarkovModel {
+    const ModelHeader *header;
+    const char *strings;
+    const uint32_t *string_offsets;
+    const uint32_t *state_strings;
+    const uint32_t *state_contexts;
+    const uint8_t *state_flags;
+    const uint32_t *succ_offsets;
+    const uint32_t *succ_targets;
+    // uint8_t, uint16_t or uint32_t, by header->count_bits
+    const void *succ_cumulative;
+    // NULL when the counts aren't scaled
+    const uint32_t *state_scales;
+    const uint32_t *start_states;
+    const uint64_t *start_cumulative;
+    // when true, start states are drawn by their occurrence count
+    bool weighted_start;
+    // void*[num_states]: data of each state of a frozen chain, NULL for a
+    // loaded model
+    void **state_data;
+    // frees each of state_data, may be NULL
+    free_function free_data;
+    void *mapping;
+    size_t mapping_len;
+    // true if mapping is a mapped file, false if it's on the heap
+    bool mapped;
+} MarkovModel;
+
+/**
+ * Save a trained chain of strings to a model file. The chain's states
+ * must be strings interned in its arena.
+ * @param markov_chain
+ * @param path the file to write
+ * @return true on success, false if the chain has no arena, the file
+ * can't be written or in case of allocation error.
+ */
+bool save_model(MarkovChain *markov_chain, const char *path);
+
+/**
+ * Fill an empty chain with the states and counts of a loaded model, so
+ * that it can be trained further. States keep their model index, so the
+ * chain generates exactly what the model does.
+ * @param markov_chain an empty chain of the model's order, with an arena
+ * (and a contexts arena for orders above 1) and string callbacks
+ * @param model
+ * @return true on success, false if the chain doesn't fit the model or in
+ * case of allocation error.
+ */
+bool load_model_into_chain(MarkovChain *markov_chain,
+                           const MarkovModel *model);
+
+/**
+ * Map a model file saved by save_model. Nothing is copied or fixed up;
+ * the file is only checked, in one pass over its arrays, so that a
+ * corrupt or truncated file is rejected instead of read out of bounds.
+ * @param path
+ * @return the model, NULL if the file can't be mapped or isn't a valid
+ * model of this version.
+ */
+MarkovModel *load_model(const char *path);
+
+/**
+ * Freeze a trained chain into a model: a single block holding every
+ * state's successors and running counts in flat arrays of 32 bit
+ * indices, instead of a node, a list entry and an index slot per state
+ * and edge. The chain's state data is moved over to the model, which
+ * generates exactly what the chain does (a state counted more than
+ * UINT32_MAX times keeps its counts divided by a scale, like a compacted
+ * model, and draws its successors by those).
+ * Freezing works for a chain of any data; chains of strings (with an
+ * arena) also keep their strings, so model_state_string can be used.
+ * @param ptr_chain pointer to the chain, freed and set to NULL on success
+ * @return the model, NULL in case of allocation error (the chain is then
+ * left as is).
+ */
+MarkovModel *freeze_chain(MarkovChain **ptr_chain);
+
+/**
+ * @return the data of the given state of a frozen chain.
+ */
+void *model_state_data(const MarkovModel *model, uint32_t state);
+
+/**
+ * Unmap (or free) the given model, with the data of a frozen chain, and
+ * free it.
+ * @param ptr_model pointer to the model, set to NULL
+ */
+void free_model(MarkovModel **ptr_model);
+
+/**
+ * @return the string of the (last) word of the given state of the model.
+ */
+const char *model_state_string(const MarkovModel *model, uint32_t state);
+
+/**
+ * @return how many times the given successor of the given state was
+ * counted (approximately, in a model with scaled counts).
+ * @param model
+ * @param state
+ * @param edge an index between succ_offsets[state] and
+ * succ_offsets[state + 1]
+ */
+uint64_t model_edge_count(const MarkovModel *model, uint32_t state,
+                          uint32_t edge);
+
+/**
+ * Write a model, loaded, frozen or compacted, to a file that load_model
+ * maps back.
+ * @return true on success, false if the model has state data (it
+ * isn't a model of strings) or the file can't be written.
+ */
+bool write_model(const MarkovModel *model, const char *path);
+
+/**
+ * Like get_first_random_node, for a loaded model.
+ * @return a random state to start from, MODEL_NO_STATE if there's none.
+ */
+uint32_t model_first_random_state(const MarkovModel *model);
+
+/**
+ * Like get_next_random_node, for a loaded model.
+ * @return a random successor of state, MODEL_NO_STATE if it has none.
+ */
+uint32_t model_next_random_state(const MarkovModel *model, uint32_t state);
+
+/**
+ * Like generate_tweet, for a loaded model.
+ * @param model
+ * @param first_state state to start with
+ * @param max_length maximum length of chain to generate
+ */
+void generate_tweet_from_model(const MarkovModel *model,
+                               uint32_t first_state, int max_length);
+
+/***************************/
+/*    BATCH GENERATION     */
+/***************************/
+
+/**
+ * A seeded random stream: xoshiro256**, with 256 bits of state and a
+ * period of 2^256 - 1. markov_rng_seed expands a seed and a stream number
+ * into the state with splitmix64, so every (seed, stream) pair draws its
+ * own numbers, and unlike rand() a stream can be used by one thread
+ * without locking.
+ */
+typedef struct MarkovRng {
+    uint64_t state[4];
+} MarkovRng;
+
+/**
+ * Seed rng with the given stream of the given seed.
+ */
+void markov_rng_seed(MarkovRng *rng, uint64_t seed, uint64_t stream);
+
+/**
+ * Move rng 2^128 draws ahead, as if it drew that many numbers.
+ */
+void markov_rng_jump(MarkovRng *rng);
+
+/**
+ * Hand the next 2^128 draws of rng to child and jump rng past them, so
+ * the streams split off one after the other never overlap.
+ */
+void markov_rng_split(MarkovRng *rng, MarkovRng *child);
+
+/**
+ * @return the calling thread's own stream, which the functions given a
+ * NULL rng (and get_random_number) draw from. It starts as stream 0 of
+ * seed 1 in every thread, like rand() before srand().
+ */
+MarkovRng *markov_rng_default(void);
+
+/**
+ * Seed the calling thread's default stream with stream 0 of the given
+ * seed, the replacement for srand().
+ */
+void markov_rng_seed_default(uint64_t seed);
+
+/**
+ * @return a random number in [0, max_number) from the thread's default
+ * stream, unbiased like markov_rng_bounded. max_number must be positive.
+ */
+int get_random_number(int max_number);
+
+#define RNG_GOLDEN_GAMMA 0x9E3779B97F4A7C15ULL
+
+/** The splitmix64 finalizer. */
+static inline uint64_t markov_rng_mix (uint64_t z)
+{
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static inline uint64_t markov_rng_rotl (uint64_t x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+/**
+ * @return the next 64 random bits of rng.
+ */
+static inline uint64_t markov_rng_next (MarkovRng *rng)
+{
+  uint64_t *s = rng->state;
+  uint64_t result = markov_rng_rotl (s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = markov_rng_rotl (s[3], 45);
+  return result;
+}
+
+/**
+ * @return a random number in [0, bound), bound must be positive. Every
+ * number is equally likely: the draw is scaled by a multiplication
+ * (Lemire's method) instead of a division, and the few draws that would
+ * make the low numbers more likely are drawn again. Inline, so loops
+ * drawing for many streams at once don't pay a call per draw.
+ */
+static inline uint32_t markov_rng_bounded (MarkovRng *rng, uint32_t bound)
+{
+  uint64_t product = (markov_rng_next (rng) >> 32) * bound;
+  if ((uint32_t) product < bound)
+  {
+    uint32_t threshold = -bound % bound;
+    while ((uint32_t) product < threshold)
+    {
+      product = (markov_rng_next (rng) >> 32) * bound;
+    }
+  }
+  return (uint32_t) (product >> 32);
+}
+
+/**
+ * markov_rng_bounded for any 64 bit bound. Bounds that fit in 32 bits are
+ * drawn by markov_rng_bounded itself, so they give the same numbers.
+ */
+static inline uint64_t markov_rng_bounded64 (MarkovRng *rng, uint64_t bound)
+{
+  if (bound <= UINT32_MAX)
+  {
+    return markov_rng_bounded (rng, (uint32_t) bound);
+  }
+  unsigned __int128 product =
+      (unsigned __int128) markov_rng_next (rng) * bound;
+  if ((uint64_t) product < bound)
+  {
+    uint64_t threshold = -bound % bound;
+    while ((uint64_t) product < threshold)
+    {
+      product = (unsigned __int128) markov_rng_next (rng) * bound;
+    }
+  }
+  return (uint64_t) (product >> 64);
+}
+
+// streams a MarkovRngBatch steps side by side
+#define RNG_BATCH_LANES 4
+
+/**
+ * RNG_BATCH_LANES xoshiro256** streams drawn from together, to fill
+ * arrays of numbers. Lane i is lane 0 jumped i times, and word j of lane
+ * i's state is state[j][i], so one AVX2 instruction steps a word of
+ * every lane at once.
+ */
+typedef struct MarkovRngBatch {
+    uint64_t state[4][RNG_BATCH_LANES];
+} MarkovRngBatch;
+
+/**
+ * Seed the batch with the given stream of the given seed: its lane 0 is
+ * the MarkovRng markov_rng_seed makes of them.
+ */
+void markov_rng_batch_seed(MarkovRngBatch *batch, uint64_t seed,
+                           uint64_t stream);
+
+/**
+ * Fill out with count random 64 bit numbers, RNG_BATCH_LANES at a time:
+ * out[i] is from lane i % RNG_BATCH_LANES. The numbers of the last group
+ * that don't fit are dropped, so what a batch draws depends only on its
+ * seed and the counts asked for, whichever kernel draws it.
+ */
+void markov_rng_batch_fill(MarkovRngBatch *batch, uint64_t *out,
+                           size_t count);
+
+/**
+ * Fill out with count random numbers, out[i] in [0, bounds[i]), each as
+ * unbiased as markov_rng_bounded's, RNG_BATCH_LANES at a time like
+ * markov_rng_batch_fill. A lane draws again from its own stream for the
+ * few numbers that would be biased.
+ * @param batch
+ * @param bounds count positive bounds
+ * @param out
+ * @param count
+ */
+void markov_rng_batch_bounded(MarkovRngBatch *batch, const uint32_t *bounds,
+                              uint32_t *out, size_t count);
+
+/**
+ * @return "avx2" or "scalar": the kernel the batch draws use on this CPU.
+ */
+const char *markov_rng_kernel_name(void);
+
+/**
+ * Generate tweet_count tweets of strings on a pool of thread_count
+ * threads, and write them in order to fd as "Tweet <i>: ..." lines.
+ * Tweet i is drawn from its own stream of seed, so the output for a
+ * given seed is the same for any thread count.
+ * @param markov_chain a chain with an append_func, or whose states are
+ * null terminated strings. Its samplers are built here, before the
+ * threads start.
+ * @param tweet_count
+ * @param thread_count number of threads to generate with, at least 1
+ * @param seed
+ * @param fd the file descriptor to write to
+ * @return true on success, false if no state can start a tweet, a thread
+ * can't be started, a write failed or in case of allocation error.
+ */
+bool generate_tweets_batch(MarkovChain *markov_chain, int tweet_count,
+                           int thread_count, uint64_t seed, int fd);
+
+/**
+ * Like generate_tweets_batch, for a loaded model.
+ */
+bool generate_model_tweets_batch(const MarkovModel *model, int tweet_count,
+                                 int thread_count, uint64_t seed, int fd);
+
+/**
+ * Append tweets first_tweet + 1 to first_tweet + count of the given seed
+ * to out, exactly as generate_model_tweets_batch writes them. Only reads
+ * the model, so any number of threads can render from it at once.
+ * @param model a model with at least one start state
+ * @param first_tweet number of tweets before the first one to render
+ * @param count
+ * @param seed
+ * @param max_length maximum number of words in a tweet, up to
+ * MAX_TWEET_LEN
+ * @param out
+ * @return false in case of allocation error.
+ */
+bool append_model_tweets(const MarkovModel *model, int first_tweet,
+                         int count, uint64_t seed, int max_length,
+                         OutputBuffer *out);
+
+/***************************/
+/*    MODEL COMPACTION     */
+/***************************/
+
+#define COMPACT_EXACT_BITS 32
+
+/**
+ * What compact_model drops and how it stores counts.
+ */
+typedef struct CompactOptions {
+    // successors counted fewer times are dropped, 1 keeps them all
+    uint32_t min_count;
+    // drop the states no kept successor leads to or from, with their
+    // strings
+    bool drop_states;
+    // bits of each running count: COMPACT_EXACT_BITS, or 16 or 8 to
+    // divide each state's counts by the smallest scale that fits them
+    // (successors that round down to 0 are dropped)
+    int count_bits;
+} CompactOptions;
+
+/**
+ * What compact_model saved and what it cost.
+ */
+typedef struct CompactReport {
+    size_t bytes_before;
+    size_t bytes_after;
+    uint32_t states_before;
+    uint32_t states_after;
+    uint32_t edges_before;
+    uint32_t edges_after;
+    uint32_t strings_before;
+    uint32_t strings_after;
+    // total variation distance between each state's successor
+    // distribution before and after, averaged weighing each state by its
+    // counts, and its largest value
+    double mean_divergence;
+    double max_divergence;
+    // share of all successor counts that were dropped
+    double dropped_share;
+} CompactReport;
+
+/**
+ * Build a smaller copy of a model of strings: drop rare successors and
+ * the states left out, and store the counts in fewer bits. The copy
+ * generates from the kept successors in the same proportions, up to the
+ * rounding of scaled counts.
+ * @param model a loaded or frozen model of strings (not of state data)
+ * @param options
+ * @param report filled with the sizes before and after and the divergence
+ * @return the compacted model, NULL if the model has state data, the
+ * options are invalid or in case of allocation error.
+ */
+MarkovModel *compact_model(const MarkovModel *model,
+                           const CompactOptions *options,
+                           CompactReport *report);
+
+#endif /* MARKOV_CHAIN_H */
@@ -0,0 +1,136 @@
+#include "markov_stats.h"
+
+#ifdef MARKOV_STATS
+
+#include <time.h> // For clock_gettime()
+#include "markov_chain.h"
+
+#define NS_IN_SEC 1000000000.0
+// bucket 0 counts states with no successors, bucket b > 0 those with
+// 2^(b-1) to 2^b - 1 of them
+#define HISTOGRAM_BUCKETS 33
+
+uint64_t markov_stats[STATS_COUNTER_COUNT];
+
+static const char *counter_names[STATS_COUNTER_COUNT] = {
+    "read_sec", "tokenize_sec", "insert_sec", "generate_sec", "output_sec",
+    "lookups", "lookup_compares", "successor_updates",
+    "successor_compares", "allocations", "allocated_bytes"};
+
+static bool is_phase (int counter)
+{
+  return counter <= STATS_OUTPUT_NS;
+}
+
+uint64_t stats_clock_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * (uint64_t) NS_IN_SEC +
+         (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Count the states of the model by the length of their successor lists.
+ * @return the number of buckets in use.
+ */
+static int successor_histogram (const struct MarkovModel *model,
+                                uint64_t *buckets)
+{
+  int used = 0;
+  for (uint32_t state = 0; model && state < model->header->num_states;
+       state++)
+  {
+    uint32_t len = model->succ_offsets[state + 1] -
+                   model->succ_offsets[state];
+    int bucket = 0;
+    while (len)
+    {
+      bucket++;
+      len >>= 1;
+    }
+    buckets[bucket]++;
+    used = bucket + 1 > used ? bucket + 1 : used;
+  }
+  return used;
+}
+
+static uint64_t bucket_min (int bucket)
+{
+  return bucket ? (uint64_t) 1 << (bucket - 1) : 0;
+}
+
+static uint64_t bucket_max (int bucket)
+{
+  return bucket ? ((uint64_t) 1 << bucket) - 1 : 0;
+}
+
+static void report_text (FILE *file, const uint64_t *buckets, int used)
+{
+  for (int i = 0; i < STATS_COUNTER_COUNT; i++)
+  {
+    if (is_phase (i))
+    {
+      fprintf (file, "%-24s %16.6f\n", counter_names[i],
+               (double) markov_stats[i] / NS_IN_SEC);
+    }
+    else
+    {
+      fprintf (file, "%-24s %16llu\n", counter_names[i],
+               (unsigned long long) markov_stats[i]);
+    }
+  }
+  for (int bucket = 0; bucket < used; bucket++)
+  {
+    char range[64];
+    snprintf (range, sizeof (range), "successors_%llu-%llu",
+              (unsigned long long) bucket_min (bucket),
+              (unsigned long long) bucket_max (bucket));
+    fprintf (file, "%-24s %16llu states\n", range,
+             (unsigned long long) buckets[bucket]);
+  }
+}
+
+static void report_json (FILE *file, const uint64_t *buckets, int used)
+{
+  fputc ('{', file);
+  for (int i = 0; i < STATS_COUNTER_COUNT; i++)
+  {
+    if (is_phase (i))
+    {
+      fprintf (file, "\"%s\":%.6f,", counter_names[i],
+               (double) markov_stats[i] / NS_IN_SEC);
+    }
+    else
+    {
+      fprintf (file, "\"%s\":%llu,", counter_names[i],
+               (unsigned long long) markov_stats[i]);
+    }
+  }
+  fputs ("\"successor_histogram\":[", file);
+  for (int bucket = 0; bucket < used; bucket++)
+  {
+    fprintf (file, "%s{\"min\":%llu,\"max\":%llu,\"states\":%llu}",
+             bucket ? "," : "", (unsigned long long) bucket_min (bucket),
+             (unsigned long long) bucket_max (bucket),
+             (unsigned long long) buckets[bucket]);
+  }
+  fputs ("]}\n", file);
+}
+
+void stats_report (FILE *file, const struct MarkovModel *model, bool json)
+{
+  uint64_t buckets[HISTOGRAM_BUCKETS] = {0};
+  int used = successor_histogram (model, buckets);
+  if (json)
+  {
+    report_json (file, buckets, used);
+  }
+  else
+  {
+    report_text (file, buckets, used);
+  }
+  fflush (file);
+}
+
+#endif // MARKOV_STATS
@@ -0,0 +1,86 @@
+#ifndef _MARKOV_STATS_H_
+#define _MARKOV_STATS_H_
+
+#include <stdint.h> // For uint64_t
+#include <stdbool.h> // for bool
+#include <stdio.h> // For FILE
+
+/**
+ * Optional instrumentation of the chain and the drivers, reported by
+ * their --stats flag. It is only compiled in with -DMARKOV_STATS: without
+ * it every STATS_ macro expands to nothing, so a normal build has no
+ * counters, no clock reads and no report.
+ */
+
+/**
+ * Everything that is counted. The *_NS counters are the wall time of a
+ * phase, summed over the threads that ran it.
+ */
+typedef enum StatsCounter {
+    // mapping the corpus or a model file
+    STATS_READ_NS,
+    // splitting the corpus into words and interning them
+    STATS_TOKENIZE_NS,
+    // adding states and successor counts to the chain
+    STATS_INSERT_NS,
+    // walking the chain and rendering tweets or games
+    STATS_GENERATE_NS,
+    // writing the rendered text out
+    STATS_OUTPUT_NS,
+    // get_node_from_database and add_to_database calls
+    STATS_LOOKUPS,
+    // comp_func calls made by them
+    STATS_LOOKUP_COMPARES,
+    // add_node_to_frequencies_list calls, and counts merged in
+    STATS_SUCCESSOR_UPDATES,
+    // successors (or successor index slots) looked at by them
+    STATS_SUCCESSOR_COMPARES,
+    // allocations made while building a chain
+    STATS_ALLOCATIONS,
+    // bytes requested by them
+    STATS_ALLOCATED_BYTES,
+    STATS_COUNTER_COUNT
+} StatsCounter;
+
+#ifdef MARKOV_STATS
+
+extern uint64_t markov_stats[STATS_COUNTER_COUNT];
+
+/** Add n to the given counter, from any thread. */
+static inline void stats_add (StatsCounter counter, uint64_t n)
+{
+  __atomic_fetch_add (&markov_stats[counter], n, __ATOMIC_RELAXED);
+}
+
+/** @return a monotonic clock in nanoseconds. */
+uint64_t stats_clock_ns (void);
+
+struct MarkovModel;
+
+/**
+ * Write every counter, and the histogram of the model's successor list
+ * lengths, to the given file.
+ * @param model the model generated from, may be NULL
+ * @param json true for one JSON object, false for aligned text lines
+ */
+void stats_report (FILE *file, const struct MarkovModel *model, bool json);
+
+#define STATS_ADD(counter, n) stats_add ((counter), (n))
+#define STATS_ALLOC(bytes) \
+  (stats_add (STATS_ALLOCATIONS, 1), stats_add (STATS_ALLOCATED_BYTES, \
+                                                (bytes)))
+// declares a clock reading named var, for STATS_SINCE
+#define STATS_CLOCK(var) uint64_t var = stats_clock_ns ()
+#define STATS_SINCE(counter, var) \
+  stats_add ((counter), stats_clock_ns () - (var))
+
+#else
+
+#define STATS_ADD(counter, n) ((void) 0)
+#define STATS_ALLOC(bytes) ((void) 0)
+#define STATS_CLOCK(var) ((void) 0)
+#define STATS_SINCE(counter, var) ((void) 0)
+
+#endif // MARKOV_STATS
+
+#endif //_MARKOV_STATS_H_
@@ -0,0 +1,67 @@
+#include "output_buffer.h"
+#include <string.h> // For memcpy(), strlen()
+#include <errno.h> // For errno
+#include <unistd.h> // For write()
+
+#define OUTPUT_INIT_CAPACITY 4096
+
+void output_append (OutputBuffer *buffer, const char *str, size_t len)
+{
+  if (buffer->len + len > buffer->capacity)
+  {
+    size_t new_capacity = buffer->capacity ? buffer->capacity
+                                           : OUTPUT_INIT_CAPACITY;
+    while (new_capacity < buffer->len + len)
+    {
+      new_capacity *= 2;
+    }
+    char *new_data = realloc (buffer->data, new_capacity);
+    if (!new_data)
+    {
+      buffer->failed = true;
+      return;
+    }
+    buffer->data = new_data;
+    buffer->capacity = new_capacity;
+  }
+  memcpy (buffer->data + buffer->len, str, len);
+  buffer->len += len;
+}
+
+void output_append_str (OutputBuffer *buffer, const char *str)
+{
+  output_append (buffer, str, strlen (str));
+}
+
+bool output_flush_fd (OutputBuffer *buffer, int fd)
+{
+  bool success = !buffer->failed;
+  size_t written = 0;
+  while (written < buffer->len)
+  {
+    ssize_t result = write (fd, buffer->data + written,
+                            buffer->len - written);
+    if (result < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (result <= 0)
+    {
+      success = false;
+      break;
+    }
+    written += (size_t) result;
+  }
+  buffer->len = 0;
+  buffer->failed = false;
+  return success;
+}
+
+void output_free (OutputBuffer *buffer)
+{
+  free (buffer->data);
+  buffer->data = NULL;
+  buffer->len = 0;
+  buffer->capacity = 0;
+  buffer->failed = false;
+}
@@ -0,0 +1,41 @@
+#ifndef _OUTPUT_BUFFER_H_
+#define _OUTPUT_BUFFER_H_
+
+#include <stdlib.h> // For size_t
+#include <stdbool.h> // for bool
+
+/**
+ * A growable block of text, rendered in memory and written out in one
+ * go. A zeroed OutputBuffer is a valid empty buffer.
+ */
+typedef struct OutputBuffer {
+    char *data;
+    size_t len;
+    size_t capacity;
+    // set once an append failed to allocate, the text is then incomplete
+    bool failed;
+} OutputBuffer;
+
+/**
+ * Append len bytes of str to the buffer.
+ */
+void output_append (OutputBuffer *buffer, const char *str, size_t len);
+
+/**
+ * Append a null terminated string to the buffer.
+ */
+void output_append_str (OutputBuffer *buffer, const char *str);
+
+/**
+ * Write the whole buffer to the given file descriptor and empty it.
+ * @return true on success, false if the write failed or an append
+ * failed before.
+ */
+bool output_flush_fd (OutputBuffer *buffer, int fd);
+
+/**
+ * Free the buffer's memory, leaving it empty.
+ */
+void output_free (OutputBuffer *buffer);
+
+#endif //_OUTPUT_BUFFER_H_
@@ -0,0 +1,132 @@
+#include "slab_pool.h"
+#include "markov_stats.h"
+
+#define POOL_ALIGNMENT 16
+
+SlabPool *pool_create (void)
+{
+  SlabPool *pool = calloc (1, sizeof (SlabPool));
+  if (pool)
+  {
+    pool->next_slab_size = POOL_SLAB_INIT_SIZE;
+  }
+  return pool;
+}
+
+static size_t align_size (size_t size)
+{
+  return (size + POOL_ALIGNMENT - 1) & ~(size_t) (POOL_ALIGNMENT - 1);
+}
+
+static PoolSlab *open_slab (SlabPool *pool, size_t size)
+{
+  STATS_ALLOC (sizeof (PoolSlab) + size);
+  PoolSlab *slab = malloc (sizeof (PoolSlab) + size);
+  if (!slab)
+  {
+    return NULL;
+  }
+  slab->used = 0;
+  slab->size = size;
+  pool->bytes += sizeof (PoolSlab) + size;
+  return slab;
+}
+
+void *pool_alloc (SlabPool *pool, size_t size)
+{
+  size = align_size (size);
+  PoolSlab *slab = pool->slabs;
+  if (slab && slab->size - slab->used >= size)
+  {
+    char *mem = (char *) slab->align + slab->used;
+    slab->used += size;
+    return mem;
+  }
+  if (size > pool->next_slab_size / 2)
+  {
+    // a big object gets a slab of its own, behind the current one so
+    // what is left of that one isn't wasted
+    slab = open_slab (pool, size);
+    if (!slab)
+    {
+      return NULL;
+    }
+    slab->used = size;
+    PoolSlab **link = pool->slabs ? &pool->slabs->next : &pool->slabs;
+    slab->next = *link;
+    *link = slab;
+    return slab->align;
+  }
+  slab = open_slab (pool, pool->next_slab_size);
+  if (!slab)
+  {
+    return NULL;
+  }
+  if (pool->next_slab_size < POOL_SLAB_MAX_SIZE)
+  {
+    pool->next_slab_size *= 2;
+  }
+  slab->next = pool->slabs;
+  pool->slabs = slab;
+  slab->used = size;
+  return slab->align;
+}
+
+/**
+ * @return the class of arrays of the given size: their chunks are
+ * 2^class bytes.
+ */
+static int size_class (size_t size)
+{
+  int chunk_class = POOL_MIN_CLASS;
+  while (((size_t) 1 << chunk_class) < size)
+  {
+    chunk_class++;
+  }
+  return chunk_class;
+}
+
+size_t pool_array_size (size_t size)
+{
+  return (size_t) 1 << size_class (size);
+}
+
+void *pool_alloc_array (SlabPool *pool, size_t size)
+{
+  int chunk_class = size_class (size);
+  void *chunk = pool->free_chunks[chunk_class];
+  if (chunk)
+  {
+    pool->free_chunks[chunk_class] = *(void **) chunk;
+    return chunk;
+  }
+  return pool_alloc (pool, (size_t) 1 << chunk_class);
+}
+
+void pool_release_array (SlabPool *pool, void *chunk, size_t size)
+{
+  if (!chunk)
+  {
+    return;
+  }
+  int chunk_class = size_class (size);
+  *(void **) chunk = pool->free_chunks[chunk_class];
+  pool->free_chunks[chunk_class] = chunk;
+}
+
+void pool_free (SlabPool **ptr_pool)
+{
+  if (!*ptr_pool)
+  {
+    return;
+  }
+  PoolSlab *slab = (*ptr_pool)->slabs;
+  while (slab)
+  {
+    PoolSlab *next = slab->next;
+    free (slab);
+    slab = next;
+  }
+  free (*ptr_pool);
+  *ptr_pool = NULL;
+}
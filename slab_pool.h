@@ -0,0 +1,83 @@
+#ifndef _SLAB_POOL_H_
+#define _SLAB_POOL_H_
+
+#include <stdlib.h> // For size_t
+#include <stdbool.h> // for bool
+
+#define POOL_SLAB_INIT_SIZE (64 * 1024)
+#define POOL_SLAB_MAX_SIZE (4 * 1024 * 1024)
+// chunks of arrays are 2^POOL_MIN_CLASS bytes and up
+#define POOL_MIN_CLASS 4
+#define POOL_CLASSES 48
+
+/**
+ * One chunk of pool memory. Slabs are never moved, so pointers into them
+ * stay valid until the pool is freed.
+ */
+typedef struct PoolSlab {
+    struct PoolSlab *next;
+    size_t used;
+    size_t size;
+    // keeps data aligned for any type
+    long double align[];
+} PoolSlab;
+
+/**
+ * Memory for objects that live as long as their owner (the list and
+ * chain nodes of a chain, and their arrays). Objects are bumped out of
+ * slabs that double in size up to POOL_SLAB_MAX_SIZE. Growable arrays
+ * come in power of 2 size classes, and an array that outgrows its chunk
+ * hands it back to be reused by the next array of that class. Nothing is
+ * freed on its own: pool_free frees every slab, one free() each.
+ */
+typedef struct SlabPool {
+    // newest slab first
+    PoolSlab *slabs;
+    // size of the next slab to open
+    size_t next_slab_size;
+    // released chunks of 2^class bytes, linked through their first word
+    void *free_chunks[POOL_CLASSES];
+    // bytes taken from the heap by the slabs
+    size_t bytes;
+} SlabPool;
+
+/**
+ * Allocate a new empty pool.
+ * @return the pool, NULL in case of allocation error.
+ */
+SlabPool *pool_create (void);
+
+/**
+ * Allocate size bytes, aligned for any type, that live until the pool is
+ * freed.
+ * @return the memory, NULL in case of allocation error.
+ */
+void *pool_alloc (SlabPool *pool, size_t size);
+
+/**
+ * @return the number of bytes an array asked for with the given size
+ * really gets, the size rounded up to its class.
+ */
+size_t pool_array_size (size_t size);
+
+/**
+ * Allocate a chunk of pool_array_size (size) bytes, reusing a released
+ * chunk of its class when there is one.
+ * @return the chunk, NULL in case of allocation error.
+ */
+void *pool_alloc_array (SlabPool *pool, size_t size);
+
+/**
+ * Hand a chunk back to the pool, to be reused by pool_alloc_array.
+ * @param chunk a chunk from pool_alloc_array, may be NULL
+ * @param size the size it was asked for with
+ */
+void pool_release_array (SlabPool *pool, void *chunk, size_t size);
+
+/**
+ * Free the pool and everything allocated from it.
+ * @param ptr_pool pointer to the pool, set to NULL
+ */
+void pool_free (SlabPool **ptr_pool);
+
+#endif //_SLAB_POOL_H_
@@ -1,314 +1,1067 @@
-#include <string.h> // For strlen(), strcmp(), strcpy()
-#include "markov_chain.h"
-#include <stddef.h>
-
-#define SEED_ARG 1
-#define TWEET_COUNT_ARG 2
-#define ARG_COUNT 2
-
-#define DECIMAL 10
-
-#define MAX(X, Y) (((X) < (Y)) ? (Y) : (X))
-
-#define EMPTY (-1)
-#define BOARD_SIZE 100
-#define MAX_GENERATION_LENGTH 60
-
-#define DICE_MAX 6
-#define NUM_OF_TRANSITIONS 20
-
-/**
- * represents the transitions by ladders and snakes in the game
- * each tuple (x,y) represents a ladder from x to if x<y or a snake otherwise
- */
-const int transitions[][2] = {{13, 4},
-                              {85, 17},
-                              {95, 67},
-                              {97, 58},
-                              {66, 89},
-                              {87, 31},
-                              {57, 83},
-                              {91, 25},
-                              {28, 50},
-                              {35, 11},
-                              {8,  30},
-                              {41, 62},
-                              {81, 43},
-                              {69, 32},
-                              {20, 39},
-                              {33, 70},
-                              {79, 99},
-                              {23, 76},
-                              {15, 47},
-                              {61, 14}};
-
-/**
- * struct represents a Cell in the game board
- */
-typedef struct Cell
-{
-    int number; // Cell number 1-100
-    int ladder_to;  // ladder_to represents the jump of
-    // the ladder in case there is one from this square
-    int snake_to;  // snake_to represents the jump of
-    // the snake in case there is one from this square
-    //both ladder_to and snake_to should be
-    // -1 if the Cell doesn't have them
-} Cell;
-
-static bool is_last_cell (Cell *suspect_cell)
-{
-  if (suspect_cell->number == BOARD_SIZE)
-  {
-    return true;
-  }
-  return false;
-}
-
-static Cell *copy_cell (Cell *org_cell)
-{
-  Cell *new_cell = malloc (sizeof (Cell));
-  if(!new_cell)
-  {
-    printf("Allocation failure: couldn't copy a cell.");
-    return NULL;
-  }
-  memcpy (new_cell, org_cell, sizeof (Cell));
-  return new_cell;
-}
-
-int compare_cells (Cell *first_cell, Cell *second_cell)
-{
-  int first_cell_coord = first_cell->number;
-  int second_cell_coord = second_cell->number;
-  return first_cell_coord - second_cell_coord;
-}
-
-void print_cell (void *data)
-{
-  Cell *cell_to_check = (Cell *) data;
-  if (cell_to_check->ladder_to != EMPTY)
-  {
-    printf ("%s %d", "-ladder to", cell_to_check->ladder_to);
-  }
-  if (cell_to_check->snake_to != EMPTY)
-  {
-    printf ("%s %d", "-snake to", cell_to_check->snake_to);
-  }
-}
-
-/** Error handler **/
-static int handle_error (char *error_msg)
-{
-  printf ("%s", error_msg);
-  return EXIT_FAILURE;
-}
-
-static int create_board (Cell *cells[BOARD_SIZE])
-{
-  for (int i = 0; i < BOARD_SIZE; i++)
-  {
-    cells[i] = malloc (sizeof (Cell));
-    if (cells[i] == NULL)
-    {
-      for (int j = 0; j < i; j++)
-      {
-        free (cells[j]);
-      }
-      handle_error (ALLOCATION_ERROR_MASSAGE);
-      return EXIT_FAILURE;
-    }
-    *(cells[i]) = (Cell) {i + 1, EMPTY, EMPTY};
-  }
-
-  for (int i = 0; i < NUM_OF_TRANSITIONS; i++)
-  {
-    int from = transitions[i][0];
-    int to = transitions[i][1];
-    if (from < to)
-    {
-      cells[from - 1]->ladder_to = to;
-    }
-    else
-    {
-      cells[from - 1]->snake_to = to;
-    }
-  }
-  return EXIT_SUCCESS;
-}
-
-/**
- * fills database
- * @param markov_chain
- * @return EXIT_SUCCESS or EXIT_FAILURE
- */
-static int fill_database (MarkovChain *markov_chain)
-{
-  Cell *cells[BOARD_SIZE];
-  if (create_board (cells) == EXIT_FAILURE)
-  {
-    return EXIT_FAILURE;
-  }
-  MarkovNode *from_node = NULL, *to_node = NULL;
-  size_t index_to;
-  for (size_t i = 0; i < BOARD_SIZE; i++)
-  {
-    add_to_database (markov_chain, cells[i]);
-  }
-
-  for (size_t i = 0; i < BOARD_SIZE; i++)
-  {
-    from_node = get_node_from_database (markov_chain, cells[i])->data;
-
-    if (cells[i]->snake_to != EMPTY || cells[i]->ladder_to != EMPTY)
-    {
-      index_to = MAX(cells[i]->snake_to, cells[i]->ladder_to) - 1;
-      to_node = get_node_from_database (markov_chain, cells[index_to])
-          ->data;
-      add_node_to_frequencies_list (from_node, to_node, markov_chain);
-    }
-    else
-    {
-      for (int j = 1; j <= DICE_MAX; j++)
-      {
-        index_to = ((Cell *) (from_node->data))->number + j - 1;
-        if (index_to >= BOARD_SIZE)
-        {
-          break;
-        }
-        to_node = get_node_from_database (markov_chain, cells[index_to])
-            ->data;
-        add_node_to_frequencies_list (from_node, to_node, markov_chain);
-      }
-    }
-  }
-  // free temp arr
-  for (size_t i = 0; i < BOARD_SIZE; i++)
-  {
-    free (cells[i]);
-  }
-  return EXIT_SUCCESS;
-}
-
-Cell **generate_game (MarkovChain *main_chain, int max_length, size_t
-*track_len)
-{
-  MarkovNode *curr_mark_node = (MarkovNode *) main_chain
-      ->database->first->data;
-  Cell **cell_track = malloc (sizeof (Cell *) * max_length);
-  if(cell_track == NULL)
-  {
-    printf("Allocation failure: couldn't set an array of cells.");
-    return NULL;
-  }
-  cell_track[0] = (Cell *) curr_mark_node->data;
-  for (int i = 1; i < max_length; i++)
-  {
-    curr_mark_node = get_next_random_node (curr_mark_node);
-    if (curr_mark_node == NULL)
-    {
-      free(cell_track);
-      return NULL;
-    }
-    cell_track[i] = (Cell *) curr_mark_node->data;
-    *track_len += 1;
-    if (main_chain->is_last (curr_mark_node->data) ||
-        curr_mark_node->frequencies_list == NULL)
-    {
-      break;
-    }
-  }
-  return cell_track;
-}
-
-int set_snake_chain_attributes(MarkovChain *main_chain)
-{
-  main_chain->copy_func = (copy_function) &copy_cell;
-  main_chain->print_func = (print_function) &print_cell;
-  main_chain->is_last = (is_last_function) &is_last_cell;
-  main_chain->comp_func = (comp_function) &compare_cells;
-  main_chain->free_data = (free_function) &free;
-  main_chain->database = malloc (sizeof (LinkedList));
-  if(main_chain->database == NULL)
-  {
-    free(main_chain);
-    fprintf (stdout, "Allocation failure: couldn't allocate a "
-                     "database.\n");
-    return EXIT_FAILURE;
-  }
-  // initialize linked list fields to a known state
-  main_chain->database->first = NULL;
-  main_chain->database->last = NULL;
-  main_chain->database->size = 0;
-  return EXIT_SUCCESS;
-}
-
-int print_tracks(MarkovChain *main_chain, int
-amount_of_games_to_generate)
-{
-  size_t track_len = 0;
-  for (int i = 1; i <= amount_of_games_to_generate; i++)
-  {
-    printf ("%s %d%s ", "Random Walk", i, ":");
-    Cell **cell_track = generate_game
-        (main_chain, MAX_GENERATION_LENGTH, &track_len);
-    if(cell_track == NULL)
-    {
-      return EXIT_FAILURE;
-    }
-    for(size_t j=0; j <= track_len; j++)
-    {
-      printf ("%s%d%s", "[", cell_track[j]->number, "]");
-      main_chain->print_func (cell_track[j]);
-      if(!(j == track_len && main_chain->is_last(cell_track[j])))
-      {
-        printf(" %s ", "->");
-      }
-    }
-    printf ("%c", '\n');
-    track_len = 0;
-    free(cell_track);
-    cell_track = NULL;
-  }
-  return EXIT_SUCCESS;
-}
-/**
- * @param argc num of arguments
- * @param argv 1) Seed
- *             2) Number of sentences to generate
- * @return EXIT_SUCCESS or EXIT_FAILURE
- */
-int main (int argc, char *argv[])
-{
-  unsigned int seed = (int) strtol (argv[SEED_ARG], NULL, DECIMAL);
-  srand (seed);
-  int amount_of_games_to_generate = (int) strtol
-      (argv[TWEET_COUNT_ARG], NULL, DECIMAL);
-  if (argc != ARG_COUNT + 1)
-  {
-    return EXIT_FAILURE;
-  }
-  MarkovChain* main_chain = malloc ((sizeof (MarkovChain)));
-  if(main_chain == NULL)
-  {
-    printf("Allocation failure: couldn't create the Markov chain.");
-    return EXIT_FAILURE;
-  }
-  if(set_snake_chain_attributes (main_chain) == EXIT_FAILURE)
-  {
-    return EXIT_FAILURE;
-  }
-  if (fill_database (main_chain) == EXIT_FAILURE)
-  {
-    free_database (&main_chain);
-    return EXIT_FAILURE;
-  }
-  if(print_tracks(main_chain, amount_of_games_to_generate) ==
-  EXIT_FAILURE)
-  {
-    free_database (&main_chain);
-    return EXIT_FAILURE;
-  }
-  free_database (&main_chain);
-  return EXIT_SUCCESS;
-}
+#include <string.h> // For strlen(), strcmp(), strcpy()
+#include <time.h> // For clock_gettime()
+#include "markov_chain.h"
+#include "snakes_and_ladders.h"
+#include "chain_analytics.h"
+#include "walk_simulation.h"
+#include "markov_stats.h"
+#include <stddef.h>
+
+#define SEED_ARG 1
+#define TWEET_COUNT_ARG 2
+#define ARG_COUNT 2
+#define STATS_OPTION "--stats"
+#define STATS_JSON_OPTION "--stats=json"
+#define ANALYTICS_OPTION "--analytics"
+#define SIMULATE_OPTION "--simulate"
+#define MAX_MOVES_OPTION "--max-moves"
+#define THREADS_OPTION "--threads"
+#define BOARD_OPTION "--board"
+#define BOARD_SIZE_OPTION "--board-size"
+#define DICE_OPTION "--dice"
+#define TRANSITIONS_OPTION "--transitions"
+// generated boards get one ladder or snake per this many cells, like the
+// classic one
+#define DEFAULT_TRANSITION_SHARE 5
+#define DEFAULT_MAX_MOVES 1000
+#define MAX_THREADS 256
+#define NS_IN_MS 1000000.0
+#define MS_IN_SEC 1000.0
+#define METHOD_LEN 64
+
+#define DECIMAL 10
+
+#define MAX(X, Y) (((X) < (Y)) ? (Y) : (X))
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+
+#define EMPTY (-1)
+
+#define NUM_OF_TRANSITIONS 20
+#define BOARD_LINE_LEN 256
+
+/**
+ * represents the transitions by ladders and snakes in the game
+ * each tuple (x,y) represents a ladder from x to if x<y or a snake otherwise
+ */
+const int transitions[][2] = {{13, 4},
+                              {85, 17},
+                              {95, 67},
+                              {97, 58},
+                              {66, 89},
+                              {87, 31},
+                              {57, 83},
+                              {91, 25},
+                              {28, 50},
+                              {35, 11},
+                              {8,  30},
+                              {41, 62},
+                              {81, 43},
+                              {69, 32},
+                              {20, 39},
+                              {33, 70},
+                              {79, 99},
+                              {23, 76},
+                              {15, 47},
+                              {61, 14}};
+
+static bool is_last_cell (Cell *suspect_cell)
+{
+  return suspect_cell->last;
+}
+
+static Cell *copy_cell (Cell *org_cell)
+{
+  Cell *new_cell = malloc (sizeof (Cell));
+  if(!new_cell)
+  {
+    printf("Allocation failure: couldn't copy a cell.");
+    return NULL;
+  }
+  memcpy (new_cell, org_cell, sizeof (Cell));
+  return new_cell;
+}
+
+int compare_cells (Cell *first_cell, Cell *second_cell)
+{
+  int first_cell_coord = first_cell->number;
+  int second_cell_coord = second_cell->number;
+  return first_cell_coord - second_cell_coord;
+}
+
+size_t hash_cell (Cell *cell)
+{
+  return (size_t) cell->number;
+}
+
+void print_cell (void *data)
+{
+  Cell *cell_to_check = (Cell *) data;
+  if (cell_to_check->ladder_to != EMPTY)
+  {
+    printf ("%s %d", "-ladder to", cell_to_check->ladder_to);
+  }
+  if (cell_to_check->snake_to != EMPTY)
+  {
+    printf ("%s %d", "-snake to", cell_to_check->snake_to);
+  }
+}
+
+/** Error handler **/
+static int handle_error (char *error_msg)
+{
+  printf ("%s", error_msg);
+  return EXIT_FAILURE;
+}
+
+/**
+ * Give the board size cells without ladders or snakes.
+ * @return EXIT_SUCCESS or EXIT_FAILURE in case of allocation error.
+ */
+static int set_board_size (Board *board, long size)
+{
+  board->cells = malloc ((size_t) size * sizeof (Cell));
+  if (!board->cells)
+  {
+    return handle_error (ALLOCATION_ERROR_MASSAGE);
+  }
+  board->size = (int) size;
+  for (int i = 0; i < board->size; i++)
+  {
+    board->cells[i] = (Cell) {i + 1, EMPTY, EMPTY, i + 1 == board->size};
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Put a ladder from the cell numbered from to the cell numbered to if
+ * from < to, a snake otherwise.
+ * @return false if either cell is off the board, from is the last cell,
+ * they're the same cell or from already has a ladder or a snake.
+ */
+static bool add_transition (Board *board, long from, long to)
+{
+  if (from < 1 || from >= board->size || to < 1 || to > board->size ||
+      from == to || board->cells[from - 1].ladder_to != EMPTY ||
+      board->cells[from - 1].snake_to != EMPTY)
+  {
+    return false;
+  }
+  if (from < to)
+  {
+    board->cells[from - 1].ladder_to = (int) to;
+  }
+  else
+  {
+    board->cells[from - 1].snake_to = (int) to;
+  }
+  return true;
+}
+
+int board_classic (Board *board)
+{
+  *board = (Board) {0, DICE_MAX, 0, NULL};
+  if (set_board_size (board, BOARD_SIZE) == EXIT_FAILURE)
+  {
+    return EXIT_FAILURE;
+  }
+  for (int i = 0; i < NUM_OF_TRANSITIONS; i++)
+  {
+    add_transition (board, transitions[i][0], transitions[i][1]);
+  }
+  board->transition_count = NUM_OF_TRANSITIONS;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Read one line of a board file into the board.
+ * @return false if the line isn't valid.
+ */
+static bool read_board_line (Board *board, const char *line, bool
+*allocation_failed)
+{
+  char first_char;
+  long first, second;
+  if (sscanf (line, " %c", &first_char) != 1 || first_char == '#')
+  {
+    return true;
+  }
+  if (sscanf (line, " size %ld", &first) == 1)
+  {
+    if (board->cells || first < 2 || first > BOARD_MAX_SIZE)
+    {
+      return false;
+    }
+    *allocation_failed = set_board_size (board, first) == EXIT_FAILURE;
+    return !*allocation_failed;
+  }
+  if (sscanf (line, " dice %ld", &first) == 1)
+  {
+    board->dice_max = (int) first;
+    return first >= 1 && first <= BOARD_MAX_DICE;
+  }
+  if (sscanf (line, "%ld %ld", &first, &second) == 2 && board->cells &&
+      add_transition (board, first, second))
+  {
+    board->transition_count++;
+    return true;
+  }
+  return false;
+}
+
+int board_load (const char *path, Board *board)
+{
+  *board = (Board) {0, DICE_MAX, 0, NULL};
+  FILE *file = fopen (path, "r");
+  if (!file)
+  {
+    fprintf (stdout, "Error: file can't be opened\n");
+    return EXIT_FAILURE;
+  }
+  char line[BOARD_LINE_LEN];
+  int line_number = 0;
+  bool valid = true, allocation_failed = false;
+  while (valid && fgets (line, sizeof (line), file))
+  {
+    line_number++;
+    valid = read_board_line (board, line, &allocation_failed);
+  }
+  fclose (file);
+  if (!valid || !board->cells)
+  {
+    if (!allocation_failed)
+    {
+      fprintf (stdout, "Error: %s isn't a valid board file (line %d)\n",
+               path, line_number);
+    }
+    board_free (board);
+    return EXIT_FAILURE;
+  }
+  if (board_check_reachable (board) == EXIT_FAILURE)
+  {
+    board_free (board);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+int board_generate (int size, int dice_max, int transition_count,
+                    uint64_t seed, Board *board)
+{
+  *board = (Board) {0, dice_max, 0, NULL};
+  uint8_t *used = calloc ((size_t) size + 1, 1);
+  if (!used || set_board_size (board, size) == EXIT_FAILURE)
+  {
+    free (used);
+    board_free (board);
+    return handle_error (ALLOCATION_ERROR_MASSAGE);
+  }
+  MarkovRng rng;
+  markov_rng_seed (&rng, seed, 0);
+  // ladders and snakes join two cells between the first and the last,
+  // none of them already joined, so no move takes two of them at once
+  uint32_t inner = (uint32_t) size - 2;
+  uint32_t span = inner < BOARD_MAX_JUMP ? inner : BOARD_MAX_JUMP;
+  while (board->transition_count < transition_count)
+  {
+    long from = 2 + (long) markov_rng_bounded (&rng, inner);
+    long jump = 1 + (long) markov_rng_bounded (&rng, span);
+    long to = markov_rng_bounded (&rng, 2) ? from + jump : from - jump;
+    if (to >= 2 && to < size && !used[from] && !used[to])
+    {
+      add_transition (board, from, to);
+      used[from] = used[to] = 1;
+      board->transition_count++;
+    }
+  }
+  free (used);
+  if (board_check_reachable (board) == EXIT_FAILURE)
+  {
+    board_free (board);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+void board_free (Board *board)
+{
+  free (board->cells);
+  board->cells = NULL;
+  board->size = 0;
+  board->transition_count = 0;
+}
+
+/**
+ * @return the index of the cell a move from the cell at index i by a
+ * ladder, a snake or the j-th face of the dice leads to, -1 if the roll
+ * goes past the last cell.
+ */
+static int move_target (const Board *board, int i, int j)
+{
+  const Cell *cell = &board->cells[i];
+  if (cell->snake_to != EMPTY || cell->ladder_to != EMPTY)
+  {
+    return MAX(cell->snake_to, cell->ladder_to) - 1;
+  }
+  return i + j < board->size ? i + j : -1;
+}
+
+/**
+ * @return the number of moves out of a cell: one by its ladder or snake,
+ * else one for each face of the dice that doesn't roll past the last
+ * cell.
+ */
+static int move_count (const Board *board, int i)
+{
+  const Cell *cell = &board->cells[i];
+  if (cell->snake_to != EMPTY || cell->ladder_to != EMPTY)
+  {
+    return 1;
+  }
+  int left = board->size - 1 - i;
+  return left < board->dice_max ? left : board->dice_max;
+}
+
+/**
+ * @return the highest cell at or below cell index that's still open in
+ * the forest, -1 if there's none. Halves the path it follows.
+ */
+static int find_open_cell (int *open, int index)
+{
+  while (index >= 0 && open[index] != index)
+  {
+    int below = open[index];
+    if (below >= 0)
+    {
+      open[index] = open[below];
+    }
+    index = below;
+  }
+  return index;
+}
+
+int board_check_reachable (const Board *board)
+{
+  int size = board->size;
+  // the ladders and snakes into each cell, by cell index
+  int *into_offsets = calloc ((size_t) size + 1, sizeof (int));
+  int *into = malloc (((size_t) board->transition_count + 1) * sizeof (int));
+  // each cell without a ladder or a snake that isn't reached yet points
+  // at itself, the others at the cell before them
+  int *open = malloc ((size_t) size * sizeof (int));
+  int *queue = malloc ((size_t) size * sizeof (int));
+  uint8_t *reached = calloc ((size_t) size, 1);
+  if (!into_offsets || !into || !open || !queue || !reached)
+  {
+    free (into_offsets);
+    free (into);
+    free (open);
+    free (queue);
+    free (reached);
+    return handle_error (ALLOCATION_ERROR_MASSAGE);
+  }
+  for (int i = 0; i < size; i++)
+  {
+    bool jumps = board->cells[i].ladder_to != EMPTY ||
+                 board->cells[i].snake_to != EMPTY;
+    open[i] = jumps ? i - 1 : i;
+    if (jumps)
+    {
+      into_offsets[move_target (board, i, 1) + 1]++;
+    }
+  }
+  for (int i = 0; i < size; i++)
+  {
+    into_offsets[i + 1] += into_offsets[i];
+  }
+  for (int i = 0; i < size; i++)
+  {
+    if (open[i] != i)
+    {
+      into[into_offsets[move_target (board, i, 1)]++] = i;
+    }
+  }
+  // every offset moved to the next one's, shift them back
+  for (int i = size; i > 0; i--)
+  {
+    into_offsets[i] = into_offsets[i - 1];
+  }
+  into_offsets[0] = 0;
+  // search back from the last cell: a cell whose ladder or snake leads to
+  // a reached cell is reached, and so is every open cell at most
+  // dice_max cells before one, each taken out of the forest once
+  int last = size - 1, tail = 0;
+  open[last] = last - 1;
+  reached[last] = 1;
+  queue[tail++] = last;
+  for (int head = 0; head < tail; head++)
+  {
+    int cell = queue[head];
+    for (int slot = into_offsets[cell]; slot < into_offsets[cell + 1];
+         slot++)
+    {
+      reached[into[slot]] = 1;
+      queue[tail++] = into[slot];
+    }
+    int lowest = MAX(cell - board->dice_max, 0);
+    for (int before = find_open_cell (open, cell - 1); before >= lowest;
+         before = find_open_cell (open, before - 1))
+    {
+      open[before] = before - 1;
+      reached[before] = 1;
+      queue[tail++] = before;
+    }
+  }
+  int stuck = 0;
+  while (stuck < size && reached[stuck])
+  {
+    stuck++;
+  }
+  free (into_offsets);
+  free (into);
+  free (open);
+  free (queue);
+  free (reached);
+  if (stuck < size)
+  {
+    fprintf (stdout, "Error: the last cell can't be reached from cell %d "
+                     "with a %d faced dice\n", stuck + 1, board->dice_max);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * fills database. Cell i + 1 is added as state i, so the moves are
+ * counted straight between the chain's nodes, without lookups.
+ * @param markov_chain
+ * @param board
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+static int fill_database (MarkovChain *markov_chain, const Board *board)
+{
+  for (int i = 0; i < board->size; i++)
+  {
+    if (!add_to_database (markov_chain, (void *) &board->cells[i]))
+    {
+      return handle_error (ALLOCATION_ERROR_MASSAGE);
+    }
+  }
+  MarkovNode **nodes = markov_chain->nodes;
+  for (int i = 0; i < board->size; i++)
+  {
+    for (int j = 1; j <= move_count (board, i); j++)
+    {
+      if (!add_node_to_frequencies_list (nodes[i], nodes[move_target
+          (board, i, j)], markov_chain))
+      {
+        return handle_error (ALLOCATION_ERROR_MASSAGE);
+      }
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+int fill_cell_chain (CellChain *cell_chain, const Board *board)
+{
+  for (int i = 0; i < board->size; i++)
+  {
+    if (cell_chain_add (cell_chain, board->cells[i]) == TYPED_NO_STATE)
+    {
+      return handle_error (ALLOCATION_ERROR_MASSAGE);
+    }
+  }
+  for (int i = 0; i < board->size; i++)
+  {
+    for (int j = 1; j <= move_count (board, i); j++)
+    {
+      if (!cell_chain_count (cell_chain, (uint32_t) i, (uint32_t)
+          move_target (board, i, j)))
+      {
+        return handle_error (ALLOCATION_ERROR_MASSAGE);
+      }
+    }
+  }
+  if (!cell_chain_build_samplers (cell_chain))
+  {
+    return handle_error (ALLOCATION_ERROR_MASSAGE);
+  }
+  return EXIT_SUCCESS;
+}
+
+Cell **generate_game (const MarkovModel *board, int max_length, size_t
+*track_len)
+{
+  uint32_t curr_state = 0;
+  Cell **cell_track = malloc (sizeof (Cell *) * max_length);
+  if(cell_track == NULL)
+  {
+    printf("Allocation failure: couldn't set an array of cells.");
+    return NULL;
+  }
+  cell_track[0] = model_state_data (board, curr_state);
+  for (int i = 1; i < max_length; i++)
+  {
+    curr_state = model_next_random_state (board, curr_state);
+    if (curr_state == MODEL_NO_STATE)
+    {
+      free(cell_track);
+      return NULL;
+    }
+    cell_track[i] = model_state_data (board, curr_state);
+    *track_len += 1;
+    if ((board->state_flags[curr_state] & MODEL_STATE_LAST) ||
+        board->succ_offsets[curr_state] ==
+        board->succ_offsets[curr_state + 1])
+    {
+      break;
+    }
+  }
+  return cell_track;
+}
+
+int set_snake_chain_attributes(MarkovChain *main_chain)
+{
+  main_chain->copy_func = (copy_function) &copy_cell;
+  main_chain->print_func = (print_function) &print_cell;
+  main_chain->is_last = (is_last_function) &is_last_cell;
+  main_chain->comp_func = (comp_function) &compare_cells;
+  main_chain->hash_func = (hash_function) &hash_cell;
+  main_chain->free_data = (free_function) &free;
+  main_chain->database = malloc (sizeof (LinkedList));
+  if(main_chain->database == NULL)
+  {
+    free(main_chain);
+    fprintf (stdout, "Allocation failure: couldn't allocate a "
+                     "database.\n");
+    return EXIT_FAILURE;
+  }
+  // initialize linked list fields to a known state
+  main_chain->database->first = NULL;
+  main_chain->database->last = NULL;
+  main_chain->database->size = 0;
+  return EXIT_SUCCESS;
+}
+
+MarkovChain *create_snake_chain (const Board *board)
+{
+  MarkovChain* main_chain = calloc (1, sizeof (MarkovChain));
+  if(main_chain == NULL)
+  {
+    printf("Allocation failure: couldn't create the Markov chain.");
+    return NULL;
+  }
+  if(set_snake_chain_attributes (main_chain) == EXIT_FAILURE)
+  {
+    return NULL;
+  }
+  STATS_CLOCK (insert_start);
+  bool filled = fill_database (main_chain, board) == EXIT_SUCCESS &&
+                build_samplers (main_chain);
+  STATS_SINCE (STATS_INSERT_NS, insert_start);
+  if (!filled)
+  {
+    free_database (&main_chain);
+    return NULL;
+  }
+  return main_chain;
+}
+
+MarkovModel *create_snake_board (const Board *board)
+{
+  MarkovChain *main_chain = create_snake_chain (board);
+  if (main_chain == NULL)
+  {
+    return NULL;
+  }
+  MarkovModel *model = freeze_chain (&main_chain);
+  if (model == NULL)
+  {
+    printf("Allocation failure: couldn't freeze the Markov chain.");
+    free_database (&main_chain);
+  }
+  return model;
+}
+
+int print_tracks(const MarkovModel *board, int
+amount_of_games_to_generate)
+{
+  size_t track_len = 0;
+  for (int i = 1; i <= amount_of_games_to_generate; i++)
+  {
+    STATS_CLOCK (generate_start);
+    Cell **cell_track = generate_game
+        (board, MAX_GENERATION_LENGTH, &track_len);
+    STATS_SINCE (STATS_GENERATE_NS, generate_start);
+    if(cell_track == NULL)
+    {
+      return EXIT_FAILURE;
+    }
+    STATS_CLOCK (output_start);
+    printf ("%s %d%s ", "Random Walk", i, ":");
+    for(size_t j=0; j <= track_len; j++)
+    {
+      printf ("%s%d%s", "[", cell_track[j]->number, "]");
+      print_cell (cell_track[j]);
+      if(!(j == track_len && is_last_cell(cell_track[j])))
+      {
+        printf(" %s ", "->");
+      }
+    }
+    printf ("%c", '\n');
+    STATS_SINCE (STATS_OUTPUT_NS, output_start);
+    track_len = 0;
+    free(cell_track);
+    cell_track = NULL;
+  }
+  return EXIT_SUCCESS;
+}
+
+static double now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec * MS_IN_SEC + (double) ts.tv_nsec / NS_IN_MS;
+}
+
+/**
+ * Print the expected number of moves to finish from every cell and its
+ * variance, solved from the board's transition matrix, then the chance
+ * to have finished after each move up to the given one and where a game
+ * is after it. How long it took goes to stderr.
+ * @return EXIT_SUCCESS or EXIT_FAILURE (after printing why) in case of
+ * allocation error, if the last cell can't be reached from every cell or
+ * if solving didn't converge.
+ */
+int print_analytics (const MarkovModel *board, int turns)
+{
+  double start = now_ms ();
+  ChainMatrix *matrix = chain_matrix_create (board);
+  uint32_t size = board->header->num_states;
+  double *expected = malloc ((size + 1) * sizeof (double));
+  double *variance = malloc ((size + 1) * sizeof (double));
+  double *current = calloc (size + 1, sizeof (double));
+  double *next = malloc ((size + 1) * sizeof (double));
+  AbsorptionInfo info;
+  AnalyticsStatus status = ANALYTICS_NO_MEMORY;
+  if (matrix && expected && variance && current && next)
+  {
+    status = solve_absorption (matrix, expected, variance, &info);
+  }
+  double solve_ms = now_ms () - start;
+  if (status == ANALYTICS_SOLVED)
+  {
+    printf ("Expected moves to finish (each ladder or snake is a move):\n");
+    for (uint32_t state = 0; state < size; state++)
+    {
+      Cell *cell = model_state_data (board, state);
+      printf ("[%d] %.4f (variance %.4f)\n", cell->number, expected[state],
+              variance[state]);
+    }
+    // games start from the first cell
+    current[0] = 1;
+    uint32_t last = size - 1;
+    double step_ms = 0;
+    printf ("Chance to have finished after each move:\n");
+    for (int turn = 1; turn <= turns; turn++)
+    {
+      start = now_ms ();
+      step_distribution (matrix, current, next);
+      step_ms += now_ms () - start;
+      double *swap = current;
+      current = next;
+      next = swap;
+      printf ("%d: %.6f\n", turn, current[last]);
+    }
+    printf ("Cells after %d moves:", turns);
+    for (uint32_t state = 0; state < size; state++)
+    {
+      if (current[state] > 0)
+      {
+        printf (" [%d] %.6f", ((Cell *) model_state_data (board, state))
+            ->number, current[state]);
+      }
+    }
+    printf ("\n");
+    fflush (stdout);
+    char method[METHOD_LEN] = "dense LU";
+    if (info.method == ANALYTICS_PROFILE_LU)
+    {
+      snprintf (method, sizeof (method), "LU in a %zu value profile",
+                info.profile_values);
+    }
+    else if (info.method == ANALYTICS_SPARSE_ITERATIVE)
+    {
+      snprintf (method, sizeof (method), "%d Gauss-Seidel sweeps",
+                info.sweeps);
+    }
+    fprintf (stderr, "Analytics: %u cells (%u not final) solved by %s in "
+                     "%.3f ms, %d moves of the distribution (%s, %s) in "
+                     "%.3f ms\n", size, info.transient, method, solve_ms,
+             turns, matrix->dense ? "dense" : "sparse",
+             analytics_kernel_name (), step_ms);
+  }
+  chain_matrix_free (&matrix);
+  free (expected);
+  free (variance);
+  free (current);
+  free (next);
+  if (status == ANALYTICS_UNREACHABLE)
+  {
+    return handle_error ("Error: the last cell can't be reached from every "
+                         "cell, so some games never finish\n");
+  }
+  if (status == ANALYTICS_NOT_CONVERGED)
+  {
+    fprintf (stdout, "Error: the expected moves didn't converge in %d "
+                     "sweeps\n", ANALYTICS_MAX_SWEEPS);
+    return EXIT_FAILURE;
+  }
+  return status == ANALYTICS_SOLVED ? EXIT_SUCCESS
+                                    : handle_error (ALLOCATION_ERROR_MASSAGE);
+}
+
+/**
+ * Simulate games in lockstep and print their lengths, how many finished
+ * within each number of moves and how often each cell was visited. How
+ * long it took goes to stderr.
+ * @return EXIT_SUCCESS or EXIT_FAILURE in case of allocation error.
+ */
+int print_simulation (const MarkovModel *board, uint64_t games,
+                      int max_moves, unsigned int seed, int threads)
+{
+  WalkTable *table = walk_table_create (board);
+  WalkStats stats;
+  double start = now_ms ();
+  if (!table || !simulate_walks (table, 0, games, max_moves, seed, threads,
+                                 &stats))
+  {
+    walk_table_free (&table);
+    return handle_error (ALLOCATION_ERROR_MASSAGE);
+  }
+  double elapsed_ms = now_ms () - start;
+  double sum = 0, sum_squares = 0;
+  for (int len = 0; len <= max_moves; len++)
+  {
+    sum += (double) len * (double) stats.length_counts[len];
+    sum_squares += (double) len * len * (double) stats.length_counts[len];
+  }
+  double mean = stats.finished ? sum / (double) stats.finished : 0;
+  double variance = stats.finished ? sum_squares / (double) stats.finished
+                                     - mean * mean : 0;
+  printf ("Simulated %llu games: %llu finished within %d moves, mean "
+          "length %.4f (variance %.4f)\n", (unsigned long long) stats.walks,
+          (unsigned long long) stats.finished, max_moves, mean, variance);
+  printf ("Games by length (share finished within it):\n");
+  for (int len = 0; len <= max_moves; len++)
+  {
+    if (stats.length_counts[len] > 0)
+    {
+      printf ("%d: %llu (%.6f)\n", len,
+              (unsigned long long) stats.length_counts[len],
+              walks_finished_within (&stats, len));
+    }
+  }
+  printf ("Visits per cell (per game):\n");
+  for (uint32_t state = 0; state < stats.size; state++)
+  {
+    printf ("[%d] %llu (%.4f)\n",
+            ((Cell *) model_state_data (board, state))->number,
+            (unsigned long long) stats.visits[state],
+            (double) stats.visits[state] / (double) stats.walks);
+  }
+  fflush (stdout);
+  fprintf (stderr, "Simulation: %llu games, %llu moves in %.3f ms on %d "
+                   "threads (%.1f M moves/sec)\n",
+           (unsigned long long) stats.walks,
+           (unsigned long long) stats.moves, elapsed_ms, threads,
+           (double) stats.moves / elapsed_ms / MS_IN_SEC);
+  walk_stats_free (&stats);
+  walk_table_free (&table);
+  return EXIT_SUCCESS;
+}
+
+#ifndef MARKOV_BENCH
+/**
+ * Flags given after the seed and game count.
+ */
+typedef struct SnakeOptions
+{
+    // report the instrumentation counters to stderr (only in builds with
+    // MARKOV_STATS), as JSON if stats_json
+    bool stats;
+    bool stats_json;
+    // moves to follow the exact game distribution for, 0 for none
+    int analytics_moves;
+    // games to simulate in lockstep, 0 for none
+    long long simulate;
+    // simulated games longer than this are cut off unfinished
+    int max_moves;
+    int threads;
+    // the board file, NULL for none
+    const char *board_path;
+    // cells of a generated board, 0 to not generate one
+    long board_size;
+    // faces of the dice, 0 for the board's own
+    int dice;
+    // ladders and snakes of a generated board, -1 for the default share
+    long transitions;
+} SnakeOptions;
+
+/**
+ * @return the value of an "--option=value" argument if arg is the given
+ * option, NULL otherwise.
+ */
+static const char *option_value (const char *arg, const char *option)
+{
+  size_t len = strlen (option);
+  if (strncmp (arg, option, len) != 0 || arg[len] != '=')
+  {
+    return NULL;
+  }
+  return arg + len + 1;
+}
+
+/**
+ * Read the options after the seed and game count.
+ * @return false (after printing why, for invalid values) on an invalid
+ * or unknown option.
+ */
+static bool parse_options (int argc, char *argv[], SnakeOptions *options)
+{
+  for (int i = ARG_COUNT + 1; i < argc; i++)
+  {
+    const char *value;
+    if (strcmp (argv[i], STATS_OPTION) == 0 ||
+        strcmp (argv[i], STATS_JSON_OPTION) == 0)
+    {
+      options->stats = true;
+      options->stats_json = strcmp (argv[i], STATS_JSON_OPTION) == 0;
+    }
+    else if (strcmp (argv[i], ANALYTICS_OPTION) == 0)
+    {
+      options->analytics_moves = MAX_GENERATION_LENGTH;
+    }
+    else if ((value = option_value (argv[i], ANALYTICS_OPTION)))
+    {
+      options->analytics_moves = (int) strtol (value, NULL, DECIMAL);
+      if (options->analytics_moves < 1)
+      {
+        fprintf (stdout, "Usage: %s needs a positive number of moves\n",
+                 ANALYTICS_OPTION);
+        return false;
+      }
+    }
+    else if ((value = option_value (argv[i], SIMULATE_OPTION)))
+    {
+      options->simulate = strtoll (value, NULL, DECIMAL);
+      if (options->simulate < 1)
+      {
+        fprintf (stdout, "Usage: %s needs a positive number of games\n",
+                 SIMULATE_OPTION);
+        return false;
+      }
+    }
+    else if ((value = option_value (argv[i], MAX_MOVES_OPTION)))
+    {
+      options->max_moves = (int) strtol (value, NULL, DECIMAL);
+      if (options->max_moves < 1)
+      {
+        fprintf (stdout, "Usage: %s must be positive\n", MAX_MOVES_OPTION);
+        return false;
+      }
+    }
+    else if ((value = option_value (argv[i], THREADS_OPTION)))
+    {
+      options->threads = (int) strtol (value, NULL, DECIMAL);
+      if (options->threads < 1 || options->threads > MAX_THREADS)
+      {
+        fprintf (stdout, "Usage: thread count must be 1 to %d\n",
+                 MAX_THREADS);
+        return false;
+      }
+    }
+    else if ((value = option_value (argv[i], BOARD_OPTION)))
+    {
+      options->board_path = value;
+    }
+    else if ((value = option_value (argv[i], BOARD_SIZE_OPTION)))
+    {
+      options->board_size = strtol (value, NULL, DECIMAL);
+      if (options->board_size < 2 || options->board_size > BOARD_MAX_SIZE)
+      {
+        fprintf (stdout, "Usage: board size must be 2 to %d\n",
+                 BOARD_MAX_SIZE);
+        return false;
+      }
+    }
+    else if ((value = option_value (argv[i], DICE_OPTION)))
+    {
+      options->dice = (int) strtol (value, NULL, DECIMAL);
+      if (options->dice < 1 || options->dice > BOARD_MAX_DICE)
+      {
+        fprintf (stdout, "Usage: dice must have 1 to %d faces\n",
+                 BOARD_MAX_DICE);
+        return false;
+      }
+    }
+    else if ((value = option_value (argv[i], TRANSITIONS_OPTION)))
+    {
+      options->transitions = strtol (value, NULL, DECIMAL);
+      if (options->transitions < 0)
+      {
+        fprintf (stdout, "Usage: %s can't be negative\n",
+                 TRANSITIONS_OPTION);
+        return false;
+      }
+    }
+    else
+    {
+      return false;
+    }
+  }
+  if (options->board_path && options->board_size)
+  {
+    fprintf (stdout, "Usage: %s and %s can't be used together\n",
+             BOARD_OPTION, BOARD_SIZE_OPTION);
+    return false;
+  }
+  long most_transitions = (options->board_size - 2) /
+                          BOARD_CELLS_PER_TRANSITION;
+  if (options->board_size && options->transitions > most_transitions)
+  {
+    fprintf (stdout, "Usage: a board of %ld cells has at most %ld ladders "
+                     "and snakes\n", options->board_size, most_transitions);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Set up the board the options ask for: read from a file, generated from
+ * the seed or the classic one, with the options' dice. How long it took
+ * goes to stderr for the first two.
+ * @return EXIT_SUCCESS or EXIT_FAILURE (after printing why, with the
+ * board left empty).
+ */
+static int set_up_board (const SnakeOptions *options, unsigned int seed,
+                         Board *board)
+{
+  double start = now_ms ();
+  int result;
+  int dice = options->dice ? options->dice : DICE_MAX;
+  if (options->board_path)
+  {
+    result = board_load (options->board_path, board);
+  }
+  else if (options->board_size)
+  {
+    long transitions = options->transitions;
+    if (transitions < 0)
+    {
+      transitions = MIN(options->board_size / DEFAULT_TRANSITION_SHARE,
+                        (options->board_size - 2) /
+                        BOARD_CELLS_PER_TRANSITION);
+    }
+    result = board_generate ((int) options->board_size, dice,
+                             (int) transitions, seed, board);
+  }
+  else
+  {
+    result = board_classic (board);
+  }
+  if (result == EXIT_SUCCESS && options->dice &&
+      board->dice_max != options->dice)
+  {
+    // --dice replaces the dice of a board file or the classic board
+    board->dice_max = options->dice;
+    if (board_check_reachable (board) == EXIT_FAILURE)
+    {
+      board_free (board);
+      return EXIT_FAILURE;
+    }
+  }
+  if (result == EXIT_SUCCESS &&
+      (options->board_path || options->board_size))
+  {
+    fprintf (stderr, "Board: %d cells, %d ladders and snakes, set up in "
+                     "%.3f ms\n", board->size, board->transition_count,
+             now_ms () - start);
+  }
+  return result;
+}
+
+/**
+ * @param argc num of arguments
+ * @param argv 1) Seed
+ *             2) Number of sentences to generate
+ *             then optionally:
+ *             --stats or --stats=json, to report the instrumentation
+ *             counters to stderr (only in builds with MARKOV_STATS)
+ *             --analytics[=MOVES], to print the exact expected game
+ *             length from every cell and the distribution of the game
+ *             over MOVES moves (MAX_GENERATION_LENGTH by default)
+ *             --simulate=GAMES, to simulate that many games in lockstep
+ *             and print their statistics, with --max-moves=N and
+ *             --threads=N
+ *             --board=PATH, to play on the board in the file, or
+ *             --board-size=N with --transitions=N, to play on a board
+ *             generated from the seed, and --dice=N
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int main (int argc, char *argv[])
+{
+  SnakeOptions options = {false, false, 0, 0, DEFAULT_MAX_MOVES, 1, NULL, 0,
+                          0, -1};
+  if (argc < ARG_COUNT + 1 || !parse_options (argc, argv, &options))
+  {
+    return EXIT_FAILURE;
+  }
+#ifndef MARKOV_STATS
+  if (options.stats)
+  {
+    fprintf (stdout, "Usage: %s needs a build with MARKOV_STATS\n",
+             STATS_OPTION);
+    return EXIT_FAILURE;
+  }
+#endif
+  unsigned int seed = (int) strtol (argv[SEED_ARG], NULL, DECIMAL);
+  markov_rng_seed_default (seed);
+  int amount_of_games_to_generate = (int) strtol
+      (argv[TWEET_COUNT_ARG], NULL, DECIMAL);
+  Board cells;
+  if (set_up_board (&options, seed, &cells) == EXIT_FAILURE)
+  {
+    return EXIT_FAILURE;
+  }
+  double start = now_ms ();
+  MarkovModel *board = create_snake_board (&cells);
+  board_free (&cells);
+  if (board == NULL)
+  {
+    return EXIT_FAILURE;
+  }
+  if (options.board_path || options.board_size)
+  {
+    fprintf (stderr, "Board chain built in %.3f ms\n", now_ms () - start);
+  }
+  int result = print_tracks(board, amount_of_games_to_generate);
+  if (result == EXIT_SUCCESS && options.analytics_moves > 0)
+  {
+    result = print_analytics (board, options.analytics_moves);
+  }
+  if (result == EXIT_SUCCESS && options.simulate > 0)
+  {
+    result = print_simulation (board, (uint64_t) options.simulate,
+                               options.max_moves, seed, options.threads);
+  }
+#ifdef MARKOV_STATS
+  if (options.stats)
+  {
+    fflush (stdout);
+    stats_report (stderr, board, options.stats_json);
+  }
+#endif
+  free_model (&board);
+  return result;
+}
+#endif // MARKOV_BENCH
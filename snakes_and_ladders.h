@@ -0,0 +1,149 @@
+#ifndef _SNAKES_AND_LADDERS_H_
+#define _SNAKES_AND_LADDERS_H_
+
+#include "markov_chain.h"
+#include "typed_chain.h"
+
+// the classic board
+#define BOARD_SIZE 100
+#define DICE_MAX 6
+#define MAX_GENERATION_LENGTH 60
+// limits of loaded and generated boards
+#define BOARD_MAX_SIZE 100000000
+#define BOARD_MAX_DICE 1024
+// generated ladders and snakes are at most this long, and there is at
+// most one of them per this many cells between the first and the last
+#define BOARD_MAX_JUMP 100
+#define BOARD_CELLS_PER_TRANSITION 4
+
+/**
+ * struct represents a Cell in the game board
+ */
+typedef struct Cell
+{
+    int number; // Cell number 1-board size
+    int ladder_to;  // ladder_to represents the jump of
+    // the ladder in case there is one from this square
+    int snake_to;  // snake_to represents the jump of
+    // the snake in case there is one from this square
+    //both ladder_to and snake_to should be
+    // -1 if the Cell doesn't have them
+    bool last; // whether this is the board's last cell, where games end
+} Cell;
+
+/**
+ * A game board: its cells with their ladders and snakes, and the dice
+ * moves are rolled with.
+ */
+typedef struct Board
+{
+    int size;
+    int dice_max;
+    int transition_count; // number of ladders and snakes
+    Cell *cells; // Cell[size]: cell i + 1 at index i
+} Board;
+
+// cells are identified by their number
+#define CELL_HASH(cell) ((uint64_t) (cell).number)
+#define CELL_EQUAL(first, second) ((first).number == (second).number)
+#define CELL_IS_LAST(cell) ((cell).last)
+
+/**
+ * Chain of cells specialized by TYPED_CHAIN: the cells are kept by value
+ * in the chain, and compared and checked inline.
+ */
+TYPED_CHAIN (CellChain, cell_chain, Cell, CELL_HASH, CELL_EQUAL,
+             CELL_IS_LAST)
+
+/**
+ * Set up the classic board: BOARD_SIZE cells, a DICE_MAX dice and the 20
+ * ladders and snakes of the transitions table.
+ * @param board filled with the board, freed with board_free
+ * @return EXIT_SUCCESS or EXIT_FAILURE in case of allocation error.
+ */
+int board_classic (Board *board);
+
+/**
+ * Read a board from a text file. Blank lines and lines starting with #
+ * are skipped; "size N" gives the number of cells and comes before the
+ * ladders and snakes, "dice N" the faces of the dice (DICE_MAX if
+ * missing), and every "FROM TO" line a ladder (FROM < TO) or a snake from
+ * cell FROM to cell TO. A cell has at most one of them, and the last
+ * cell none.
+ * @param path
+ * @param board filled with the board, freed with board_free
+ * @return EXIT_SUCCESS or EXIT_FAILURE (after printing why) if the file
+ * can't be read, isn't a valid board or the last cell can't be reached
+ * from every cell.
+ */
+int board_load (const char *path, Board *board);
+
+/**
+ * Generate a board: transition_count ladders and snakes, each at most
+ * BOARD_MAX_JUMP cells long, between random cells other than the first
+ * and the last, no cell joined twice. The same seed gives the same board.
+ * @param size 2 to BOARD_MAX_SIZE
+ * @param dice_max 1 to BOARD_MAX_DICE
+ * @param transition_count at most (size - 2) / BOARD_CELLS_PER_TRANSITION,
+ * so the free cells are found in a few draws each
+ * @param seed
+ * @param board filled with the board, freed with board_free
+ * @return EXIT_SUCCESS or EXIT_FAILURE (after printing why) in case of
+ * allocation error or if the last cell can't be reached from every cell.
+ */
+int board_generate (int size, int dice_max, int transition_count,
+                    uint64_t seed, Board *board);
+
+/**
+ * Check that the last cell can be reached from every cell of the board
+ * with its dice, so every game finishes, in time linear in its size.
+ * @param board
+ * @return EXIT_SUCCESS or EXIT_FAILURE (after printing why) if it can't,
+ * or in case of allocation error.
+ */
+int board_check_reachable (const Board *board);
+
+/**
+ * Free the cells of the board.
+ */
+void board_free (Board *board);
+
+/**
+ * Like create_snake_chain, into a CellChain: add every cell of the board
+ * and its moves, and build the samplers. Cell i + 1 is state i, so games
+ * start from state 0.
+ * @param cell_chain an empty chain
+ * @param board
+ * @return EXIT_SUCCESS or EXIT_FAILURE in case of allocation error.
+ */
+int fill_cell_chain (CellChain *cell_chain, const Board *board);
+
+/**
+ * Build the chain of a game board, with its samplers, ready to generate
+ * games from, in time linear in the board's size. Cell i + 1 is state i.
+ * @param board
+ * @return the chain, NULL in case of allocation error.
+ */
+MarkovChain *create_snake_chain (const Board *board);
+
+/**
+ * Build a game board's chain and freeze it, ready to generate games from.
+ * @param board
+ * @return the frozen board, owning copies of its cells, NULL in case of
+ * allocation error.
+ */
+MarkovModel *create_snake_board (const Board *board);
+
+/**
+ * Walk the board from its first cell until the last one or max_length
+ * cells.
+ * @param board a model made by create_snake_board
+ * @param max_length maximum number of cells in the track
+ * @param track_len incremented by the index of the last cell in the track
+ * @return the cells of the track (to be freed by the caller), NULL in case
+ * of allocation error.
+ */
+Cell **generate_game (const MarkovModel *board, int max_length, size_t
+*track_len);
+
+#endif //_SNAKES_AND_LADDERS_H_
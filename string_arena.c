@@ -0,0 +1,195 @@
+#include "string_arena.h"
+#include <string.h> // For memcpy()
+#include "markov_stats.h"
+
+#define ARENA_INIT_SLOTS 1024
+#define ARENA_INIT_STRINGS 256
+
+StringArena *arena_create (void)
+{
+  return calloc (1, sizeof (StringArena));
+}
+
+/** FNV-1a over the given bytes. */
+static uint32_t hash_bytes (const char *str, size_t len)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+  {
+    hash ^= (unsigned char) str[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * @return true if the interned string is the len bytes of str. Stops at
+ * the end of a shorter interned string, which may end its block.
+ */
+static bool interned_equals (const char *interned, const char *str,
+                             size_t len)
+{
+  size_t i = 0;
+  while (i < len && interned[i] == str[i] && interned[i] != '\0')
+  {
+    i++;
+  }
+  return i == len && interned[len] == '\0';
+}
+
+static ArenaSlot *find_arena_slot (StringArena *arena, const char *str,
+                                   size_t len, uint32_t hash)
+{
+  size_t mask = arena->slots_capacity - 1;
+  size_t pos = hash & mask;
+  while (arena->slots[pos].id_plus_one)
+  {
+    if (arena->slots[pos].hash == hash)
+    {
+      const char *curr = arena->strings[arena->slots[pos].id_plus_one - 1];
+      if (interned_equals (curr, str, len))
+      {
+        return &arena->slots[pos];
+      }
+    }
+    pos = (pos + 1) & mask;
+  }
+  return &arena->slots[pos];
+}
+
+static bool grow_arena_slots (StringArena *arena)
+{
+  size_t new_capacity = arena->slots_capacity ? arena->slots_capacity * 2
+                                              : ARENA_INIT_SLOTS;
+  STATS_ALLOC (new_capacity * sizeof (ArenaSlot));
+  ArenaSlot *new_slots = calloc (new_capacity, sizeof (ArenaSlot));
+  if (!new_slots)
+  {
+    return false;
+  }
+  size_t mask = new_capacity - 1;
+  for (size_t i = 0; i < arena->slots_capacity; i++)
+  {
+    if (!arena->slots[i].id_plus_one)
+    {
+      continue;
+    }
+    size_t pos = arena->slots[i].hash & mask;
+    while (new_slots[pos].id_plus_one)
+    {
+      pos = (pos + 1) & mask;
+    }
+    new_slots[pos] = arena->slots[i];
+  }
+  free (arena->slots);
+  arena->slots = new_slots;
+  arena->slots_capacity = new_capacity;
+  return true;
+}
+
+/**
+ * Reserve size bytes in the newest block, opening a new one if needed.
+ */
+static char *arena_alloc (StringArena *arena, size_t size)
+{
+  ArenaBlock *block = arena->blocks;
+  if (!block || block->size - block->used < size)
+  {
+    size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    STATS_ALLOC (sizeof (ArenaBlock) + block_size);
+    block = malloc (sizeof (ArenaBlock) + block_size);
+    if (!block)
+    {
+      return NULL;
+    }
+    block->next = arena->blocks;
+    block->used = 0;
+    block->size = block_size;
+    arena->blocks = block;
+  }
+  char *mem = block->data + block->used;
+  block->used += size;
+  return mem;
+}
+
+const char *arena_intern (StringArena *arena, const char *str, size_t len)
+{
+  // keep the load factor under 1/2
+  if ((arena->count + 1) * 2 > arena->slots_capacity &&
+      !grow_arena_slots (arena))
+  {
+    return NULL;
+  }
+  uint32_t hash = hash_bytes (str, len);
+  ArenaSlot *slot = find_arena_slot (arena, str, len, hash);
+  if (slot->id_plus_one)
+  {
+    return arena->strings[slot->id_plus_one - 1];
+  }
+  if (arena->count == arena->strings_capacity)
+  {
+    uint32_t new_capacity = arena->strings_capacity ?
+                            arena->strings_capacity * 2 :
+                            ARENA_INIT_STRINGS;
+    STATS_ALLOC (new_capacity * sizeof (const char *));
+    const char **new_strings = realloc (arena->strings, new_capacity *
+                                        sizeof (const char *));
+    if (!new_strings)
+    {
+      return NULL;
+    }
+    arena->strings = new_strings;
+    arena->strings_capacity = new_capacity;
+  }
+  size_t size = sizeof (uint32_t) + len + 1;
+  char *mem = arena_alloc (arena, size);
+  if (!mem)
+  {
+    return NULL;
+  }
+  uint32_t id = arena->count++;
+  memcpy (mem, &id, sizeof (uint32_t));
+  char *interned = mem + sizeof (uint32_t);
+  memcpy (interned, str, len);
+  interned[len] = '\0';
+  arena->strings[id] = interned;
+  arena->bytes += size;
+  *slot = (ArenaSlot) {id + 1, hash};
+  return interned;
+}
+
+const char *arena_string (const StringArena *arena, uint32_t id)
+{
+  return arena->strings[id];
+}
+
+size_t arena_memory (const StringArena *arena)
+{
+  size_t total = sizeof (StringArena) +
+                 arena->strings_capacity * sizeof (const char *) +
+                 arena->slots_capacity * sizeof (ArenaSlot);
+  for (ArenaBlock *block = arena->blocks; block; block = block->next)
+  {
+    total += sizeof (ArenaBlock) + block->size;
+  }
+  return total;
+}
+
+void arena_free (StringArena **ptr_arena)
+{
+  if (!*ptr_arena)
+  {
+    return;
+  }
+  ArenaBlock *block = (*ptr_arena)->blocks;
+  while (block)
+  {
+    ArenaBlock *next = block->next;
+    free (block);
+    block = next;
+  }
+  free ((*ptr_arena)->strings);
+  free ((*ptr_arena)->slots);
+  free (*ptr_arena);
+  *ptr_arena = NULL;
+}
@@ -0,0 +1,92 @@
+#ifndef _STRING_ARENA_H_
+#define _STRING_ARENA_H_
+
+#include <stdlib.h> // For size_t
+#include <stdint.h> // For uint32_t
+#include <stdbool.h> // for bool
+#include <string.h> // For memcpy()
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+/**
+ * One chunk of packed strings. Blocks are never moved, so pointers into
+ * them stay valid until the arena is freed.
+ */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+typedef struct ArenaSlot {
+    // id + 1 of the string in this slot, 0 marks an empty slot
+    uint32_t id_plus_one;
+    uint32_t hash;
+} ArenaSlot;
+
+/**
+ * Stores every distinct string once. Each string is packed right after
+ * its 32 bit id: [id][bytes]['\0'], so an interned pointer knows its own
+ * id and can be compared to other interned pointers by identity.
+ */
+typedef struct StringArena {
+    // newest block first
+    ArenaBlock *blocks;
+    // id -> interned string
+    const char **strings;
+    uint32_t count;
+    uint32_t strings_capacity;
+    ArenaSlot *slots;
+    // always a power of 2 (or 0 before the first string)
+    size_t slots_capacity;
+    // bytes taken by the packed strings, ids and terminators included
+    size_t bytes;
+} StringArena;
+
+/**
+ * Allocate a new empty arena.
+ * @return the arena, NULL in case of allocation error.
+ */
+StringArena *arena_create (void);
+
+/**
+ * Return the interned copy of the given string, adding it if needed.
+ * @param arena
+ * @param str bytes of the string, doesn't have to be null terminated
+ * @param len number of bytes in str
+ * @return stable null terminated pointer, NULL in case of allocation
+ * error.
+ */
+const char *arena_intern (StringArena *arena, const char *str, size_t len);
+
+/**
+ * @param interned a pointer returned by arena_intern
+ * @return the id of the interned string, ids are given from 0 up in
+ * the order strings were first interned. Inline, as every lookup of an
+ * interned word hashes it.
+ */
+static inline uint32_t arena_string_id (const char *interned)
+{
+  uint32_t id;
+  memcpy (&id, interned - sizeof (uint32_t), sizeof (uint32_t));
+  return id;
+}
+
+/**
+ * @return the interned string with the given id.
+ */
+const char *arena_string (const StringArena *arena, uint32_t id);
+
+/**
+ * @return total heap bytes used by the arena and its lookup tables.
+ */
+size_t arena_memory (const StringArena *arena);
+
+/**
+ * Free the arena and every string in it.
+ * @param ptr_arena pointer to the arena, set to NULL
+ */
+void arena_free (StringArena **ptr_arena);
+
+#endif //_STRING_ARENA_H_
@@ -1,213 +1,955 @@
-#include <string.h>
-#include "linked_list.h"
-#include "markov_chain.h"
-#define SEED_ARG 1
-#define TWEET_COUNT_ARG 2
-#define FILE_PATH_ARG 3
-#define MIN_ARG_COUNT 3
-#define MAX_ARG_COUNT 4
-#define WORDS_TO_READ_ARG 4
-#define DECIMAL 10
-#define MAX_WORD_LEN 100
-#define MAX_TWEET_LEN 20
-#define MAX_LINE_LEN 1000
-
-char *strcpy_modified(void *word_to_copy)
-{
-  char *new_word = malloc(MAX_WORD_LEN);
-  strcpy (new_word, word_to_copy);
-  return new_word;
-}
-
-
-bool is_last_test(void *test_arr)
-{
-  char *test_word = (char *) test_arr;
-  if(test_word[strlen(test_word)-1] == '.')
-  {
-    return true;
-  }
-  return false;
-}
-
-static int create_new_freq_list (MarkovNode *markov_node)
-{
-  markov_node->frequencies_list = malloc (sizeof
-                                              (MarkovNodeFrequency));
-  if (markov_node->frequencies_list == NULL)
-  {
-    fprintf (stdout, "Allocation failure: can't allocate a freq list");
-    return EXIT_FAILURE;
-  }
-  markov_node->freq_list_full_size = 1;
-  return EXIT_SUCCESS;
-}
-
-static int fill_database_helper (MarkovChain *markov_chain,
-                          char *first_word, char *second_word)
-{
-  Node *curr_node = add_to_database (markov_chain, first_word);
-  if (curr_node == NULL)
-  {
-    fprintf (stdout, "Allocation failure: couldn't allocate a node.");
-    free_database (&markov_chain);
-    return 1;
-  }
-  if (markov_chain->is_last(curr_node->data->data))
-  {
-    return 0;
-  }
-  Node *next_node = add_to_database (markov_chain, second_word);
-  if (next_node == NULL)
-  {
-    fprintf (stdout, "Allocation failure: couldn't allocate a node.");
-    free_database (&markov_chain);
-    return 1;
-  }
-  MarkovNode *second_node = next_node->data;
-  if (curr_node->data->frequencies_list == NULL)
-  {
-    create_new_freq_list (curr_node->data);
-  }
-  if (add_node_to_frequencies_list (curr_node->data, second_node,
-                                    markov_chain) == false)
-  {
-    fprintf (stdout, "Allocation failure: couldn't allocate a node.");
-    free_database (&markov_chain);
-    return 1;
-  }
-  return 0;
-}
-
-void print_str(void *data)
-{
-  char *converted_st = (char *) data;
-  while(*converted_st != '\0')
-  {
-    printf("%c", *converted_st);
-    converted_st++;
-  }
-}
-
-static void find_file_len (FILE *f, int *file_size)
-{
-  fseek (f, 0, SEEK_END);
-  *file_size = (int) ftell (f);
-  rewind (f);
-}
-
-static int
-fill_database (FILE *fp, int words_to_read, MarkovChain *markov_chain)
-{
-  if (fp == NULL)
-  {
-    return 1;
-  }
-  int file_size, word_counter = 0;
-  find_file_len (fp, &file_size);
-  char sentence[MAX_LINE_LEN];
-  while (fgets (sentence, file_size, fp) != NULL)
-  {
-    char *first_word = strtok (sentence, " \n\r");
-    char *second_word = strtok (NULL, " \n\r");
-    word_counter += 1;
-    if (first_word == NULL)
-    {
-      return 0;
-    }
-    while (first_word != NULL)
-    {
-      if (fill_database_helper (markov_chain, first_word,
-                                second_word) == 1)
-      {
-        free_database (&markov_chain);
-        return 1;
-      }
-      word_counter += 1;
-      first_word = second_word;
-      second_word = strtok (NULL, " \n\r");
-      if (word_counter >= words_to_read)
-      {
-        return 0;
-      }
-    }
-  }
-  return 0;
-}
-
-int set_chain_attributes(MarkovChain *main_chain)
-{
-  main_chain->comp_func = (comp_function) &strcmp;
-  main_chain->copy_func = (copy_function) &strcpy_modified;
-  main_chain->free_data = (free_function) &free;
-  main_chain->is_last = (is_last_function) &is_last_test;
-  main_chain->print_func = (print_function) &print_str;
-  main_chain->database = malloc (sizeof (LinkedList));
-  if(main_chain->database == NULL)
-  {
-    free(main_chain);
-    fprintf (stdout, "Allocation failure: couldn't allocate a "
-                     "database.\n");
-    return EXIT_FAILURE;
-  }
-  return EXIT_SUCCESS;
-}
-
-/** ownership of the markov chain is the scope's, don't need to
-later on free the markov chain itself, only it's database! **/
-int main (int argc, char *argv[])
-{
-  if (argc != MIN_ARG_COUNT + 1 && argc != MAX_ARG_COUNT + 1)
-  {
-    fprintf (stdout, "Usage: invalid parameters. Seed, tweet count,"
-                     " valid file path and optionally read count "
-                     "need to be submitted.\n");
-    return EXIT_FAILURE;
-  }
-  unsigned int seed = (int) strtol (argv[SEED_ARG], NULL, DECIMAL);
-  srand (seed);
-  int tweet_count = (int) strtol (argv[TWEET_COUNT_ARG], NULL,
-                                  DECIMAL);
-  FILE *input = fopen (argv[FILE_PATH_ARG], "r");
-  if (input == NULL)
-  {
-    fprintf (stdout, "Error: file can't be opened\n");
-    return EXIT_FAILURE;
-  }
-  int read_count = 0;
-  find_file_len (input, &read_count);
-  if (argc == MAX_ARG_COUNT + 1)
-  {
-    read_count = (int) strtol (argv[WORDS_TO_READ_ARG], NULL,
-                               DECIMAL);
-  }
-  MarkovChain* main_chain = malloc (sizeof(MarkovChain));
-  if(main_chain == NULL)
-  {
-    fprintf (stdout, "Allocation failure: can't allocate chain.");
-    return EXIT_FAILURE;
-  }
-  if(set_chain_attributes (main_chain) == EXIT_FAILURE)
-  {
-   return EXIT_FAILURE;
-  }
-  fill_database (input, read_count, main_chain);
-  MarkovNode *first_node = get_first_random_node (main_chain);
-  for (int i = 1; i <= tweet_count; i++)
-  {
-    printf ("%s %d: ", "Tweet", i);
-    generate_tweet (main_chain, first_node, MAX_TWEET_LEN);
-    if (i == tweet_count)
-    {
-      break;
-    }
-    first_node = get_first_random_node (main_chain);
-  }
-  free_database (&main_chain);
-  fclose (input);
-  return EXIT_SUCCESS;
-}
-
-//  print_frequencies (main_chain.database);
-//  print_list (main_chain.db);
-//  printf("%d", main_chain.db->size);
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "linked_list.h"
+#include "markov_chain.h"
+#include "corpus_reader.h"
+#include "tweets_generator.h"
+#include "markov_stats.h"
+#include "tweets_server.h"
+#define SEED_ARG 1
+#define TWEET_COUNT_ARG 2
+#define FILE_PATH_ARG 3
+#define MIN_ARG_COUNT 3
+#define MAX_ARG_COUNT 4
+#define WORDS_TO_READ_ARG 4
+#define DECIMAL 10
+#define MAX_WORD_LEN 100
+#define MAX_TWEET_LEN 20
+#define NO_WORD_LIMIT (-1)
+#define NS_IN_SEC 1000000000.0
+#define BYTES_IN_MB (1024.0 * 1024.0)
+#define OPTION_PREFIX "--"
+#define WEIGHTED_START_OPTION "--weighted-start"
+#define INGEST_RATE_OPTION "--ingest-rate"
+#define THREADS_OPTION "--threads"
+#define ORDER_OPTION "--order"
+#define SAVE_MODEL_OPTION "--save-model"
+#define LOAD_MODEL_OPTION "--load-model"
+#define STATS_OPTION "--stats"
+#define TOKENIZER_OPTION "--tokenizer"
+#define SERVE_OPTION "--serve"
+#define MIN_COUNT_OPTION "--min-count"
+#define DROP_STATES_OPTION "--drop-states"
+#define COUNT_BITS_OPTION "--count-bits"
+#define PERCENT 100.0
+#define SERVE_FILE_PATH_ARG 1
+#define SERVE_WORDS_TO_READ_ARG 2
+#define SERVE_MAX_ARG_COUNT 2
+#define STATS_JSON "json"
+#define STATS_TEXT "text"
+#define MODEL_ARG_COUNT 2
+#define MAX_THREADS 256
+
+/**
+ * Flags given as "--name" anywhere on the command line, next to the
+ * positional arguments.
+ */
+typedef struct TweetsOptions
+{
+    // draw first words by how often they occurred, not uniformly
+    bool weighted_start;
+    // report the corpus ingest throughput to stderr
+    bool ingest_rate;
+    // number of threads to train and generate with
+    int threads;
+    // number of words in each state of the trained chain
+    int order;
+    // file to save the trained model to, or NULL
+    const char *save_model;
+    // file to load a saved model from, or NULL. it is trained further
+    // when a file path is given too.
+    const char *load_model;
+    // report the instrumentation counters to stderr when done (only in
+    // builds with MARKOV_STATS)
+    bool stats;
+    // report them as JSON rather than text
+    bool stats_json;
+    // socket to serve tweets on instead of printing them, or NULL
+    const char *serve;
+    // how to compact the model before generating from it or saving it
+    CompactOptions compact;
+} TweetsOptions;
+
+/**
+ * Words are interned in the chain's arena before they reach the chain,
+ * so "copying" one is just handing out the same stable pointer.
+ */
+void *copy_interned(void *word)
+{
+  return word;
+}
+
+/** Interned words are equal exactly when their ids are. */
+int compare_interned(void *first_word, void *second_word)
+{
+  uint32_t first_id = arena_string_id (first_word);
+  uint32_t second_id = arena_string_id (second_word);
+  return (first_id > second_id) - (first_id < second_id);
+}
+
+size_t hash_interned(void *word)
+{
+  return arena_string_id (word);
+}
+
+bool is_last_test(void *test_arr)
+{
+  char *test_word = (char *) test_arr;
+  if(test_word[strlen(test_word)-1] == '.')
+  {
+    return true;
+  }
+  return false;
+}
+
+void print_str(void *data)
+{
+  fputs ((char *) data, stdout);
+}
+
+void append_str(void *data, OutputBuffer *out)
+{
+  output_append_str (out, (char *) data);
+}
+
+int set_chain_attributes(MarkovChain *main_chain, int order)
+{
+  main_chain->order = order;
+  main_chain->comp_func = (comp_function) &compare_interned;
+  main_chain->hash_func = (hash_function) &hash_interned;
+  main_chain->copy_func = (copy_function) &copy_interned;
+  // the words are owned by the arena, freed with it in one go.
+  main_chain->free_data = NULL;
+  main_chain->is_last = (is_last_function) &is_last_test;
+  main_chain->print_func = (print_function) &print_str;
+  main_chain->append_func = (append_function) &append_str;
+  main_chain->database = calloc (1, sizeof (LinkedList));
+  main_chain->arena = arena_create ();
+  if (order > 1)
+  {
+    main_chain->contexts = arena_create ();
+  }
+  if(main_chain->database == NULL || main_chain->arena == NULL ||
+     (order > 1 && main_chain->contexts == NULL))
+  {
+    free(main_chain->database);
+    arena_free (&main_chain->arena);
+    arena_free (&main_chain->contexts);
+    free(main_chain);
+    fprintf (stdout, "Allocation failure: couldn't allocate a "
+                     "database.\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+MarkovChain *create_chain (int order)
+{
+  MarkovChain *markov_chain = calloc (1, sizeof (MarkovChain));
+  if (markov_chain == NULL)
+  {
+    fprintf (stdout, "Allocation failure: can't allocate chain.");
+    return NULL;
+  }
+  if (set_chain_attributes (markov_chain, order) == EXIT_FAILURE)
+  {
+    return NULL;
+  }
+  return markov_chain;
+}
+
+/**
+ * State of one fill_database pass, handed to add_token for every word.
+ */
+typedef struct FillState
+{
+    MarkovChain *markov_chain;
+    // the state before the current word in this sentence, NULL at the
+    // start of a line or sentence
+    MarkovNode *prev_node;
+    // arena ids of the last words of this sentence, oldest first
+    uint32_t context[MAX_ORDER];
+    int context_len;
+    // words left to read, negative for no limit
+    long words_left;
+    bool failed;
+#ifdef MARKOV_STATS
+    // time spent adding to the chain, the rest of a pass is tokenizing
+    uint64_t insert_ns;
+#endif
+} FillState;
+
+/**
+ * Slide the given word into the state's context.
+ * @return the chain state ending with the word, the word itself in a
+ * chain of order 1. NULL while the sentence is still shorter than the
+ * order, and in case of allocation error (with failed set).
+ */
+static void *next_state_data (FillState *state, const char *word)
+{
+  MarkovChain *markov_chain = state->markov_chain;
+  if (markov_chain->order <= 1)
+  {
+    return (void *) word;
+  }
+  if (state->context_len == markov_chain->order)
+  {
+    memmove (state->context, state->context + 1,
+             (size_t) (markov_chain->order - 1) * sizeof (uint32_t));
+    state->context_len--;
+  }
+  state->context[state->context_len++] = arena_string_id (word);
+  if (state->context_len < markov_chain->order)
+  {
+    return NULL;
+  }
+  void *context = intern_context (markov_chain, state->context);
+  state->failed = context == NULL;
+  return context;
+}
+
+/**
+ * Intern the given token, add the state it ends to the chain and count
+ * it as a successor of the previous state of its sentence.
+ */
+static bool add_token (const char *token, size_t len, bool line_start,
+                       bool ends_sentence, void *context)
+{
+  FillState *state = context;
+  MarkovChain *markov_chain = state->markov_chain;
+  if (state->words_left == 0)
+  {
+    return false;
+  }
+  if (line_start)
+  {
+    state->prev_node = NULL;
+    state->context_len = 0;
+  }
+  const char *word = arena_intern (markov_chain->arena, token, len);
+  state->failed = word == NULL;
+  STATS_CLOCK (insert_start);
+  void *data = word ? next_state_data (state, word) : NULL;
+  if (data)
+  {
+    Node *curr_node = add_to_database (markov_chain, data);
+    state->failed = curr_node == NULL ||
+                    (state->prev_node &&
+                     !add_node_to_frequencies_list (state->prev_node,
+                                                    curr_node->data,
+                                                    markov_chain));
+    state->prev_node = curr_node ? curr_node->data : NULL;
+  }
+#ifdef MARKOV_STATS
+  state->insert_ns += stats_clock_ns () - insert_start;
+#endif
+  if (state->failed)
+  {
+    fprintf (stdout, "Allocation failure: couldn't allocate a node.");
+    return false;
+  }
+  if (ends_sentence)
+  {
+    // nothing follows the end of a sentence
+    state->prev_node = NULL;
+    state->context_len = 0;
+  }
+  if (state->words_left > 0)
+  {
+    state->words_left--;
+  }
+  return true;
+}
+
+int fill_database (const Corpus *corpus, long words_to_read,
+                   MarkovChain *markov_chain)
+{
+  FillState state = {.markov_chain = markov_chain,
+                     .words_left = words_to_read};
+  STATS_CLOCK (fill_start);
+  tokenize_mapped_corpus (corpus, &add_token, &state);
+  STATS_ADD (STATS_INSERT_NS, state.insert_ns);
+  STATS_ADD (STATS_TOKENIZE_NS,
+             stats_clock_ns () - fill_start - state.insert_ns);
+  return state.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int fill_database_stream (int fd, long words_to_read,
+                          MarkovChain *markov_chain, CorpusStream *stream)
+{
+  FillState state = {.markov_chain = markov_chain,
+                     .words_left = words_to_read};
+  STATS_CLOCK (fill_start);
+  tokenize_stream (fd, &add_token, &state, stream);
+  STATS_ADD (STATS_INSERT_NS, state.insert_ns);
+  STATS_ADD (STATS_TOKENIZE_NS,
+             stats_clock_ns () - fill_start - state.insert_ns);
+  return state.failed || stream->failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * State of one fill_word_chain pass, handed to add_word_token for every
+ * word.
+ */
+typedef struct WordFillState
+{
+    WordChain *word_chain;
+    StringArena *arena;
+    // the state of the word before in this sentence, TYPED_NO_STATE at
+    // the start of a line or sentence
+    uint32_t prev_state;
+    // words left to read, negative for no limit
+    long words_left;
+    bool failed;
+} WordFillState;
+
+static bool add_word_token (const char *token, size_t len, bool line_start,
+                            bool ends_sentence, void *context)
+{
+  WordFillState *state = context;
+  if (state->words_left == 0)
+  {
+    return false;
+  }
+  if (line_start)
+  {
+    state->prev_state = TYPED_NO_STATE;
+  }
+  const char *word = arena_intern (state->arena, token, len);
+  uint32_t curr_state = word ? word_chain_add (state->word_chain, word)
+                             : TYPED_NO_STATE;
+  state->failed = curr_state == TYPED_NO_STATE ||
+                  (state->prev_state != TYPED_NO_STATE &&
+                   !word_chain_count (state->word_chain, state->prev_state,
+                                      curr_state));
+  if (state->failed)
+  {
+    fprintf (stdout, "Allocation failure: couldn't allocate a node.");
+    return false;
+  }
+  // nothing follows the end of a sentence
+  state->prev_state = ends_sentence ? TYPED_NO_STATE : curr_state;
+  if (state->words_left > 0)
+  {
+    state->words_left--;
+  }
+  return true;
+}
+
+int fill_word_chain (const Corpus *corpus, long words_to_read,
+                     WordChain *word_chain, StringArena *arena)
+{
+  WordFillState state = {word_chain, arena, TYPED_NO_STATE, words_to_read,
+                         false};
+  tokenize_mapped_corpus (corpus, &add_word_token, &state);
+  return state.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int update_chain (MarkovChain *markov_chain, const char *lines, size_t len)
+{
+  FillState state = {.markov_chain = markov_chain,
+                     .words_left = NO_WORD_LIMIT};
+  STATS_CLOCK (fill_start);
+  tokenize_corpus (lines, len, &add_token, &state);
+  STATS_ADD (STATS_INSERT_NS, state.insert_ns);
+  STATS_ADD (STATS_TOKENIZE_NS,
+             stats_clock_ns () - fill_start - state.insert_ns);
+  return state.failed || !build_samplers (markov_chain) ? EXIT_FAILURE
+                                                        : EXIT_SUCCESS;
+}
+
+MarkovChain *load_chain (const char *model_path)
+{
+  STATS_CLOCK (read_start);
+  MarkovModel *model = load_model (model_path);
+  STATS_SINCE (STATS_READ_NS, read_start);
+  if (model == NULL)
+  {
+    return NULL;
+  }
+  STATS_CLOCK (insert_start);
+  MarkovChain *markov_chain = create_chain ((int) model->header->order);
+  if (markov_chain && !load_model_into_chain (markov_chain, model))
+  {
+    free_database (&markov_chain);
+  }
+  STATS_SINCE (STATS_INSERT_NS, insert_start);
+  free_model (&model);
+  return markov_chain;
+}
+
+/**
+ * One part of the corpus, trained into its own chain by one thread.
+ */
+typedef struct ShardJob
+{
+    Corpus shard;
+    MarkovChain *markov_chain;
+    int result;
+} ShardJob;
+
+static void *train_shard (void *arg)
+{
+  ShardJob *job = arg;
+  job->result = fill_database (&job->shard, NO_WORD_LIMIT,
+                               job->markov_chain);
+  return NULL;
+}
+
+/** Look a word of another chain up in the given arena. */
+static void *translate_interned (void *word, void *dst_arena)
+{
+  return (void *) arena_intern (dst_arena, word, strlen (word));
+}
+
+/**
+ * Cut the corpus into count shards of about the same size, each ending
+ * right after a newline.
+ */
+static void split_corpus (const Corpus *corpus, ShardJob *jobs, int count)
+{
+  size_t start = 0;
+  for (int i = 0; i < count; i++)
+  {
+    size_t end = corpus->len;
+    size_t cut = corpus->len / count * (i + 1);
+    if (i < count - 1 && cut > start && cut < corpus->len)
+    {
+      const char *newline = memchr (corpus->data + cut, '\n',
+                                    corpus->len - cut);
+      end = newline ? (size_t) (newline - corpus->data) + 1 : corpus->len;
+    }
+    else if (i < count - 1)
+    {
+      end = start;
+    }
+    jobs[i].shard = (Corpus) {corpus->data + start, end - start};
+    start = end;
+  }
+}
+
+int fill_database_parallel (const Corpus *corpus, MarkovChain *markov_chain,
+                            int thread_count)
+{
+  ShardJob *jobs = calloc (thread_count, sizeof (ShardJob));
+  pthread_t *threads = calloc (thread_count, sizeof (pthread_t));
+  bool *started = calloc (thread_count, sizeof (bool));
+  int result = EXIT_SUCCESS;
+  if (!jobs || !threads || !started)
+  {
+    free (jobs);
+    free (threads);
+    free (started);
+    return EXIT_FAILURE;
+  }
+  split_corpus (corpus, jobs, thread_count);
+  // the first shard is trained straight into the result chain
+  jobs[0].markov_chain = markov_chain;
+  for (int i = 1; i < thread_count; i++)
+  {
+    jobs[i].markov_chain = create_chain (markov_chain->order);
+    if (!jobs[i].markov_chain ||
+        pthread_create (&threads[i], NULL, &train_shard, &jobs[i]) != 0)
+    {
+      result = EXIT_FAILURE;
+      break;
+    }
+    started[i] = true;
+  }
+  if (result == EXIT_SUCCESS)
+  {
+    train_shard (&jobs[0]);
+    result = jobs[0].result;
+  }
+  for (int i = 1; i < thread_count; i++)
+  {
+    if (started[i])
+    {
+      pthread_join (threads[i], NULL);
+    }
+    STATS_CLOCK (merge_start);
+    if (result == EXIT_SUCCESS &&
+        (jobs[i].result == EXIT_FAILURE ||
+         !merge_chain (markov_chain, jobs[i].markov_chain,
+                       &translate_interned, markov_chain->arena)))
+    {
+      result = EXIT_FAILURE;
+    }
+    STATS_SINCE (STATS_INSERT_NS, merge_start);
+    if (jobs[i].markov_chain)
+    {
+      free_database (&jobs[i].markov_chain);
+    }
+  }
+  free (jobs);
+  free (threads);
+  free (started);
+  return result;
+}
+
+#ifndef MARKOV_BENCH
+static double elapsed_sec (const struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (double) (now.tv_sec - start->tv_sec) +
+         (double) (now.tv_nsec - start->tv_nsec) / NS_IN_SEC;
+}
+
+/**
+ * @return the value of an "--option=value" argument if arg is the given
+ * option, NULL otherwise.
+ */
+static const char *option_value (const char *arg, const char *option)
+{
+  size_t len = strlen (option);
+  if (strncmp (arg, option, len) != 0 || arg[len] != '=')
+  {
+    return NULL;
+  }
+  return arg + len + 1;
+}
+
+/**
+ * Select the tokenizer named by a --tokenizer value.
+ * @return false (after printing why) if it's unknown or unsupported.
+ */
+static bool select_tokenizer (const char *name)
+{
+  const char *names[] = {"auto", "scalar", "sse2", "avx2"};
+  const TokenizerKind kinds[] = {TOKENIZER_AUTO, TOKENIZER_SCALAR,
+                                 TOKENIZER_SSE2, TOKENIZER_AVX2};
+  for (size_t i = 0; i < sizeof (kinds) / sizeof (kinds[0]); i++)
+  {
+    if (strcmp (name, names[i]) == 0)
+    {
+      if (tokenizer_select (kinds[i]))
+      {
+        return true;
+      }
+      fprintf (stdout, "Error: this CPU can't run the %s tokenizer\n",
+               name);
+      return false;
+    }
+  }
+  fprintf (stdout, "Usage: %s must be auto, scalar, sse2 or avx2\n",
+           TOKENIZER_OPTION);
+  return false;
+}
+
+/**
+ * Take every "--option" argument out of argv, so the positional
+ * arguments keep their fixed positions.
+ * @return the number of arguments left in argv, -1 on unknown option.
+ */
+static int parse_options (int argc, char *argv[], TweetsOptions *options)
+{
+  int positional = 1;
+  for (int i = 1; i < argc; i++)
+  {
+    const char *value;
+    if (strncmp (argv[i], OPTION_PREFIX, strlen (OPTION_PREFIX)) != 0)
+    {
+      argv[positional++] = argv[i];
+    }
+    else if (strcmp (argv[i], WEIGHTED_START_OPTION) == 0)
+    {
+      options->weighted_start = true;
+    }
+    else if (strcmp (argv[i], INGEST_RATE_OPTION) == 0)
+    {
+      options->ingest_rate = true;
+    }
+    else if ((value = option_value (argv[i], THREADS_OPTION)))
+    {
+      options->threads = (int) strtol (value, NULL, DECIMAL);
+      if (options->threads < 1 || options->threads > MAX_THREADS)
+      {
+        fprintf (stdout, "Usage: thread count must be 1 to %d\n",
+                 MAX_THREADS);
+        return -1;
+      }
+    }
+    else if ((value = option_value (argv[i], ORDER_OPTION)))
+    {
+      options->order = (int) strtol (value, NULL, DECIMAL);
+      if (options->order < 1 || options->order > MAX_ORDER)
+      {
+        fprintf (stdout, "Usage: order must be 1 to %d\n", MAX_ORDER);
+        return -1;
+      }
+    }
+    else if ((value = option_value (argv[i], SAVE_MODEL_OPTION)))
+    {
+      options->save_model = value;
+    }
+    else if ((value = option_value (argv[i], LOAD_MODEL_OPTION)))
+    {
+      options->load_model = value;
+    }
+    else if ((value = option_value (argv[i], SERVE_OPTION)))
+    {
+      options->serve = value;
+    }
+    else if ((value = option_value (argv[i], MIN_COUNT_OPTION)))
+    {
+      long min_count = strtol (value, NULL, DECIMAL);
+      if (min_count < 1 || min_count > INT32_MAX)
+      {
+        fprintf (stdout, "Usage: minimum count must be at least 1\n");
+        return -1;
+      }
+      options->compact.min_count = (uint32_t) min_count;
+    }
+    else if (strcmp (argv[i], DROP_STATES_OPTION) == 0)
+    {
+      options->compact.drop_states = true;
+    }
+    else if ((value = option_value (argv[i], COUNT_BITS_OPTION)))
+    {
+      options->compact.count_bits = (int) strtol (value, NULL, DECIMAL);
+      if (options->compact.count_bits != 8 &&
+          options->compact.count_bits != 16 &&
+          options->compact.count_bits != COMPACT_EXACT_BITS)
+      {
+        fprintf (stdout, "Usage: count bits must be 8, 16 or %d\n",
+                 COMPACT_EXACT_BITS);
+        return -1;
+      }
+    }
+    else if ((value = option_value (argv[i], TOKENIZER_OPTION)))
+    {
+      if (!select_tokenizer (value))
+      {
+        return -1;
+      }
+    }
+    else if (strcmp (argv[i], STATS_OPTION) == 0 ||
+             (value = option_value (argv[i], STATS_OPTION)))
+    {
+#ifndef MARKOV_STATS
+      fprintf (stdout, "Usage: %s needs a build with MARKOV_STATS\n",
+               STATS_OPTION);
+      return -1;
+#endif
+      options->stats = true;
+      options->stats_json = value && strcmp (value, STATS_JSON) == 0;
+      if (value && !options->stats_json && strcmp (value, STATS_TEXT) != 0)
+      {
+        fprintf (stdout, "Usage: %s must be %s or %s\n", STATS_OPTION,
+                 STATS_TEXT, STATS_JSON);
+        return -1;
+      }
+    }
+    else
+    {
+      fprintf (stdout, "Usage: unknown option %s\n", argv[i]);
+      return -1;
+    }
+  }
+  return positional;
+}
+
+/**
+ * Open the corpus at the given path, "-" for stdin, and train a chain on
+ * it: mapped if it's a plain file, streamed otherwise.
+ * @param read_count number of words to read, NO_WORD_LIMIT for all
+ * @return the trained chain, NULL on failure (after printing why).
+ */
+static MarkovChain *train_chain (const char *path, long read_count,
+                                 const TweetsOptions *options)
+{
+  Corpus corpus;
+  int stream_fd;
+  STATS_CLOCK (read_start);
+  bool opened = corpus_open (path, &corpus, &stream_fd);
+  STATS_SINCE (STATS_READ_NS, read_start);
+  if (!opened)
+  {
+    fprintf (stdout, "Error: file can't be opened\n");
+    return NULL;
+  }
+  // a loaded model is trained further, starting from its counts
+  MarkovChain* main_chain = options->load_model ?
+                            load_chain (options->load_model) :
+                            create_chain (options->order);
+  if(main_chain == NULL)
+  {
+    if (options->load_model)
+    {
+      fprintf (stdout, "Error: %s isn't a valid model file\n",
+               options->load_model);
+    }
+    corpus_close (&corpus, stream_fd);
+    return NULL;
+  }
+  main_chain->weighted_start = options->weighted_start;
+  struct timespec ingest_start;
+  clock_gettime (CLOCK_MONOTONIC, &ingest_start);
+  CorpusStream stream = {0, corpus.len, false, false};
+  // a word budget is counted from the start of the file, so it can only
+  // be honoured by reading it in order. A stream can only be read in
+  // order.
+  int fill_result;
+  if (stream_fd >= 0)
+  {
+    fill_result = fill_database_stream (stream_fd, read_count, main_chain,
+                                        &stream);
+  }
+  else
+  {
+    fill_result = (options->threads > 1 && read_count < 0) ?
+                  fill_database_parallel (&corpus, main_chain,
+                                          options->threads) :
+                  fill_database (&corpus, read_count, main_chain);
+  }
+  corpus_close (&corpus, stream_fd);
+  if (stream.failed)
+  {
+    fprintf (stdout, "Error: couldn't read the corpus from %s\n", path);
+    free_database (&main_chain);
+    return NULL;
+  }
+  if (fill_result == EXIT_FAILURE || !build_samplers (main_chain))
+  {
+    fprintf (stdout, ALLOCATION_ERROR_MASSAGE);
+    free_database (&main_chain);
+    return NULL;
+  }
+  if (options->ingest_rate)
+  {
+    double seconds = elapsed_sec (&ingest_start);
+    fprintf (stderr, "Ingested %zu bytes in %.3f s (%.1f MB/s, %s "
+                     "tokenizer)", stream.bytes, seconds,
+             (double) stream.bytes / BYTES_IN_MB / seconds,
+             tokenizer_name ());
+    if (stream.gzip)
+    {
+      fprintf (stderr, " from %zu gzip bytes", stream.bytes_read);
+    }
+    fprintf (stderr, "\n");
+  }
+  return main_chain;
+}
+
+/**
+ * Write the instrumentation counters to stderr if asked to.
+ */
+static void report_stats (const TweetsOptions *options,
+                          const MarkovModel *model)
+{
+#ifdef MARKOV_STATS
+  if (options->stats)
+  {
+    stats_report (stderr, model, options->stats_json);
+  }
+#else
+  (void) options;
+  (void) model;
+#endif
+}
+
+static int generate_tweets (const MarkovModel *model,
+                            const TweetsOptions *options,
+                            unsigned int seed, int tweet_count)
+{
+  if (model->header->num_starts == 0 && tweet_count > 0)
+  {
+    fprintf (stdout, "Error: no word in the file can start a tweet\n");
+    return EXIT_FAILURE;
+  }
+  fflush (stdout);
+  if (!generate_model_tweets_batch (model, tweet_count, options->threads,
+                                    seed, STDOUT_FILENO))
+  {
+    fprintf (stdout, "Error: couldn't generate the tweets\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Map a saved model to generate from.
+ * @return the model, NULL on failure (after printing why).
+ */
+static MarkovModel *open_model (const char *model_path,
+                                const TweetsOptions *options)
+{
+  STATS_CLOCK (read_start);
+  MarkovModel *model = load_model (model_path);
+  STATS_SINCE (STATS_READ_NS, read_start);
+  if (model == NULL)
+  {
+    fprintf (stdout, "Error: %s isn't a valid model file\n", model_path);
+    return NULL;
+  }
+  model->weighted_start = options->weighted_start;
+  return model;
+}
+
+/**
+ * Train a chain on the given corpus (starting from --load-model if
+ * given) and freeze it for generation.
+ * @return the frozen model, NULL on failure (after printing why).
+ */
+static MarkovModel *build_model (const char *path, long read_count,
+                                 const TweetsOptions *options)
+{
+  MarkovChain *main_chain = train_chain (path, read_count, options);
+  if (main_chain == NULL)
+  {
+    return NULL;
+  }
+  // training is over, generate from the compact frozen form
+  MarkovModel *model = freeze_chain (&main_chain);
+  if (model == NULL)
+  {
+    fprintf (stdout, ALLOCATION_ERROR_MASSAGE);
+    free_database (&main_chain);
+  }
+  return model;
+}
+
+static bool compact_requested (const CompactOptions *compact)
+{
+  return compact->min_count > 1 || compact->drop_states ||
+         compact->count_bits < COMPACT_EXACT_BITS;
+}
+
+static void report_compaction (const CompactReport *report)
+{
+  fprintf (stderr, "Compacted model: %zu -> %zu bytes (%+.1f%%), "
+                   "states %u -> %u, successors %u -> %u, strings "
+                   "%u -> %u\n", report->bytes_before, report->bytes_after,
+           PERCENT * ((double) report->bytes_after /
+                      (double) report->bytes_before - 1.0),
+           report->states_before, report->states_after,
+           report->edges_before, report->edges_after,
+           report->strings_before, report->strings_after);
+  fprintf (stderr, "Successor distributions: mean divergence %.4f, max "
+                   "%.4f, %.2f%% of counts dropped\n",
+           report->mean_divergence, report->max_divergence,
+           PERCENT * report->dropped_share);
+}
+
+/**
+ * Compact the model if asked to, reporting what it saved to stderr, then
+ * save it if asked to.
+ * @param ptr_model the model, replaced by its compacted copy
+ * @return true on success, false on failure (after printing why).
+ */
+static bool finish_model (MarkovModel **ptr_model,
+                          const TweetsOptions *options)
+{
+  if (compact_requested (&options->compact))
+  {
+    CompactReport report;
+    MarkovModel *compacted = compact_model (*ptr_model, &options->compact,
+                                            &report);
+    if (compacted == NULL)
+    {
+      fprintf (stdout, ALLOCATION_ERROR_MASSAGE);
+      return false;
+    }
+    report_compaction (&report);
+    free_model (ptr_model);
+    *ptr_model = compacted;
+  }
+  if (options->save_model && !write_model (*ptr_model, options->save_model))
+  {
+    fprintf (stdout, "Error: couldn't save the model to %s\n",
+             options->save_model);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Load or train the model once, then serve tweets from it until
+ * stopped. The positional arguments are an optional file path and read
+ * count, as for generating.
+ */
+static int serve (int argc, char *argv[], const TweetsOptions *options)
+{
+  if (argc > SERVE_MAX_ARG_COUNT + 1 ||
+      (argc == 1 && !options->load_model))
+  {
+    fprintf (stdout, "Usage: with --serve, give a valid file path and "
+                     "optionally read count, or --load-model.\n");
+    return EXIT_FAILURE;
+  }
+  long read_count = argc == SERVE_MAX_ARG_COUNT + 1 ?
+                    strtol (argv[SERVE_WORDS_TO_READ_ARG], NULL, DECIMAL) :
+                    NO_WORD_LIMIT;
+  MarkovModel *model = argc == 1 ? open_model (options->load_model, options)
+                                 : build_model (argv[SERVE_FILE_PATH_ARG],
+                                                read_count, options);
+  if (model == NULL || !finish_model (&model, options))
+  {
+    free_model (&model);
+    return EXIT_FAILURE;
+  }
+  int result = EXIT_FAILURE;
+  if (model->header->num_starts == 0)
+  {
+    fprintf (stdout, "Error: no word can start a tweet\n");
+  }
+  else
+  {
+    result = serve_tweets (model, options->serve, options->threads);
+  }
+  report_stats (options, model);
+  free_model (&model);
+  return result;
+}
+
+/** ownership of the markov chain is the scope's, don't need to
+later on free the markov chain itself, only it's database! **/
+int main (int argc, char *argv[])
+{
+  TweetsOptions options = {false, false, 1, 1, NULL, NULL, false, false,
+                           NULL, {1, false, COMPACT_EXACT_BITS}};
+  argc = parse_options (argc, argv, &options);
+  if (argc > 0 && options.serve)
+  {
+    return serve (argc, argv, &options);
+  }
+  if (!(options.load_model && argc == MODEL_ARG_COUNT + 1) &&
+      argc != MIN_ARG_COUNT + 1 && argc != MAX_ARG_COUNT + 1)
+  {
+    fprintf (stdout, "Usage: invalid parameters. Seed, tweet count,"
+                     " valid file path and optionally read count "
+                     "need to be submitted. With --load-model the file"
+                     " path is optional.\n");
+    return EXIT_FAILURE;
+  }
+  unsigned int seed = (int) strtol (argv[SEED_ARG], NULL, DECIMAL);
+  int tweet_count = (int) strtol (argv[TWEET_COUNT_ARG], NULL,
+                                  DECIMAL);
+  long read_count = NO_WORD_LIMIT;
+  if (argc == MAX_ARG_COUNT + 1)
+  {
+    read_count = strtol (argv[WORDS_TO_READ_ARG], NULL, DECIMAL);
+  }
+  MarkovModel *model = options.load_model && argc == MODEL_ARG_COUNT + 1 ?
+                       open_model (options.load_model, &options) :
+                       build_model (argv[FILE_PATH_ARG], read_count,
+                                    &options);
+  if (model == NULL || !finish_model (&model, &options))
+  {
+    free_model (&model);
+    return EXIT_FAILURE;
+  }
+  int result = generate_tweets (model, &options, seed, tweet_count);
+  report_stats (&options, model);
+  free_model (&model);
+  return result;
+}
+
+#endif // MARKOV_BENCH
+
+//  print_frequencies (main_chain.database);
+//  print_list (main_chain.db);
+//  printf("%d", main_chain.db->size);
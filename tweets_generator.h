@@ -0,0 +1,103 @@
+#ifndef _TWEETS_GENERATOR_H_
+#define _TWEETS_GENERATOR_H_
+
+#include "markov_chain.h"
+#include "corpus_reader.h"
+#include "typed_chain.h"
+
+/** A word ends its sentence when it ends with a '.'. */
+static inline bool word_is_last (const char *word)
+{
+  size_t len = strlen (word);
+  return len > 0 && word[len - 1] == '.';
+}
+
+// words interned in one arena are equal exactly when their pointers are
+#define WORD_HASH(word) arena_string_id (word)
+#define WORD_EQUAL(first, second) ((first) == (second))
+
+/**
+ * Order 1 chain of interned words, specialized by TYPED_CHAIN: lookups
+ * hash and compare word pointers inline instead of calling the
+ * MarkovChain callbacks.
+ */
+TYPED_CHAIN (WordChain, word_chain, const char *, WORD_HASH, WORD_EQUAL,
+             word_is_last)
+
+/**
+ * Allocate a new empty tweets chain, with its own string arena.
+ * @param order number of words in each state, 1 to MAX_ORDER
+ * @return the chain, NULL in case of allocation error.
+ */
+MarkovChain *create_chain (int order);
+
+/**
+ * Fill the chain with every pair of following words in the corpus,
+ * tokenizing the mapped file in place. Words are only copied when
+ * they are first interned.
+ * @param corpus the mapped corpus
+ * @param words_to_read how many words to read, negative for all
+ * @param markov_chain
+ * @return EXIT_SUCCESS or EXIT_FAILURE in case of allocation error.
+ */
+int fill_database (const Corpus *corpus, long words_to_read,
+                   MarkovChain *markov_chain);
+
+/**
+ * Like fill_database, reading the corpus from a descriptor with
+ * tokenize_stream: stdin, a pipe or a gzip file, never staged whole in
+ * memory or on disk.
+ * @param fd
+ * @param words_to_read how many words to read, negative for all
+ * @param markov_chain
+ * @param stream filled with what was read
+ * @return EXIT_SUCCESS or EXIT_FAILURE in case of allocation error or if
+ * the stream couldn't be read (stream->failed).
+ */
+int fill_database_stream (int fd, long words_to_read,
+                          MarkovChain *markov_chain, CorpusStream *stream);
+
+/**
+ * Like fill_database, into a WordChain: the words are interned in arena
+ * and every pair of following words is counted. Build its samplers with
+ * word_chain_build_samplers before drawing from it.
+ * @param corpus the mapped corpus
+ * @param words_to_read how many words to read, negative for all
+ * @param word_chain
+ * @param arena the arena the chain's words are interned in
+ * @return EXIT_SUCCESS or EXIT_FAILURE in case of allocation error.
+ */
+int fill_word_chain (const Corpus *corpus, long words_to_read,
+                     WordChain *word_chain, StringArena *arena);
+
+/**
+ * Like fill_database over the whole corpus, but split at line
+ * boundaries between thread_count threads. Each one trains a private
+ * chain, and the partial chains are then merged in corpus order, so the
+ * result is identical to the serial one.
+ * @return EXIT_SUCCESS or EXIT_FAILURE in case of allocation error.
+ */
+int fill_database_parallel (const Corpus *corpus, MarkovChain *markov_chain,
+                            int thread_count);
+
+/**
+ * Train a chain further on a batch of new lines, in memory. Only the
+ * states the batch touches are updated, so the cost depends on the size
+ * of the batch, not of the chain. The chain is ready to generate from
+ * afterwards.
+ * @param markov_chain a chain made by create_chain or load_chain
+ * @param lines the new lines, separated by '\n'
+ * @param len number of bytes in lines
+ * @return EXIT_SUCCESS or EXIT_FAILURE in case of allocation error.
+ */
+int update_chain (MarkovChain *markov_chain, const char *lines, size_t len);
+
+/**
+ * Load a saved model into a new chain that can be trained further.
+ * @param model_path
+ * @return the chain, NULL if the file isn't a valid model or in case of
+ * allocation error.
+ */
+MarkovChain *load_chain (const char *model_path);
+
+#endif //_TWEETS_GENERATOR_H_
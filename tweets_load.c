@@ -0,0 +1,276 @@
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "tweets_server.h"
+
+/**
+ * Load generator for the tweets server: a number of clients, each on its
+ * own connection and thread, send requests one after the other, and the
+ * latency of every request (from sending it to reading the last byte of
+ * its answer) is reported as percentiles.
+ *
+ * Usage: tweets_load <socket_path> [clients] [requests_per_client]
+ *                    [tweets_per_request] [max_length]
+ */
+
+#define SOCKET_ARG 1
+#define CLIENTS_ARG 2
+#define REQUESTS_ARG 3
+#define TWEETS_ARG 4
+#define MAX_LENGTH_ARG 5
+#define MAX_ARG_COUNT 5
+#define DEFAULT_CLIENTS 4
+#define DEFAULT_REQUESTS 1000
+#define DEFAULT_TWEETS 10
+#define DECIMAL 10
+#define NS_IN_SEC 1000000000.0
+#define NS_IN_US 1000.0
+#define PERCENT 100.0
+#define ANSWER_BUFFER_SIZE (64 * 1024)
+
+typedef struct Client {
+    const char *socket_path;
+    int id;
+    int requests;
+    int tweets;
+    int max_length;
+    // latency of each request, in nanoseconds
+    double *latencies;
+    int completed;
+    int errors;
+} Client;
+
+static double now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec * NS_IN_SEC + (double) ts.tv_nsec;
+}
+
+static int connect_to (const char *socket_path)
+{
+  struct sockaddr_un address;
+  memset (&address, 0, sizeof (address));
+  address.sun_family = AF_UNIX;
+  if (strlen (socket_path) >= sizeof (address.sun_path))
+  {
+    return -1;
+  }
+  strcpy (address.sun_path, socket_path);
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0 &&
+      connect (fd, (struct sockaddr *) &address, sizeof (address)) != 0)
+  {
+    close (fd);
+    return -1;
+  }
+  return fd;
+}
+
+static bool send_all (int fd, const char *data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t result = write (fd, data, len);
+    if (result < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (result <= 0)
+    {
+      return false;
+    }
+    data += result;
+    len -= (size_t) result;
+  }
+  return true;
+}
+
+/**
+ * Read one answer: its header line, then the body it announces.
+ * @return 1 for an OK answer, 0 for an ERR one, -1 if the connection
+ * broke.
+ */
+static int read_answer (int fd, char *buffer, size_t *buffered)
+{
+  size_t len = *buffered;
+  char *newline;
+  while (!(newline = memchr (buffer, '\n', len)))
+  {
+    ssize_t result = read (fd, buffer + len, ANSWER_BUFFER_SIZE - len);
+    if (result < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (result <= 0 || len + (size_t) result == ANSWER_BUFFER_SIZE)
+    {
+      return -1;
+    }
+    len += (size_t) result;
+  }
+  bool ok = strncmp (buffer, SERVE_OK " ", strlen (SERVE_OK) + 1) == 0;
+  size_t body = ok ? strtoull (buffer + strlen (SERVE_OK) + 1, NULL,
+                               DECIMAL) : 0;
+  size_t header = (size_t) (newline + 1 - buffer);
+  len -= header;
+  memmove (buffer, newline + 1, len);
+  // skip the body, keeping whatever follows it
+  while (len < body)
+  {
+    body -= len;
+    ssize_t result = read (fd, buffer, ANSWER_BUFFER_SIZE);
+    if (result < 0 && errno == EINTR)
+    {
+      len = 0;
+      continue;
+    }
+    if (result <= 0)
+    {
+      return -1;
+    }
+    len = (size_t) result;
+  }
+  len -= body;
+  memmove (buffer, buffer + body, len);
+  *buffered = len;
+  return ok ? 1 : 0;
+}
+
+static void *run_client (void *arg)
+{
+  Client *client = arg;
+  char *buffer = malloc (ANSWER_BUFFER_SIZE);
+  int fd = buffer ? connect_to (client->socket_path) : -1;
+  size_t buffered = 0;
+  for (int i = 0; fd >= 0 && i < client->requests; i++)
+  {
+    char request[SERVE_MAX_REQUEST_LEN];
+    int len = snprintf (request, sizeof (request), "%d %d %d\n",
+                        client->tweets, client->id * client->requests + i,
+                        client->max_length);
+    double start = now_ns ();
+    int answer = send_all (fd, request, (size_t) len) ?
+                 read_answer (fd, buffer, &buffered) : -1;
+    if (answer < 0)
+    {
+      break;
+    }
+    client->latencies[client->completed++] = now_ns () - start;
+    client->errors += answer == 0;
+  }
+  if (fd >= 0)
+  {
+    close (fd);
+  }
+  free (buffer);
+  return NULL;
+}
+
+static int compare_doubles (const void *first, const void *second)
+{
+  double a = *(const double *) first, b = *(const double *) second;
+  return (a > b) - (a < b);
+}
+
+/**
+ * @return the nearest-rank percentile of the sorted values.
+ */
+static double percentile (const double *sorted, int count, double percent)
+{
+  int rank = (int) (percent / PERCENT * count + 0.5);
+  rank = rank < 1 ? 1 : rank > count ? count : rank;
+  return sorted[rank - 1];
+}
+
+static int int_arg (int argc, char *argv[], int arg, int default_value)
+{
+  return argc > arg ? (int) strtol (argv[arg], NULL, DECIMAL)
+                    : default_value;
+}
+
+int main (int argc, char *argv[])
+{
+  if (argc <= SOCKET_ARG || argc > MAX_ARG_COUNT + 1)
+  {
+    fprintf (stdout, "Usage: tweets_load <socket_path> [clients] "
+                     "[requests_per_client] [tweets_per_request] "
+                     "[max_length]\n");
+    return EXIT_FAILURE;
+  }
+  int client_count = int_arg (argc, argv, CLIENTS_ARG, DEFAULT_CLIENTS);
+  int requests = int_arg (argc, argv, REQUESTS_ARG, DEFAULT_REQUESTS);
+  int tweets = int_arg (argc, argv, TWEETS_ARG, DEFAULT_TWEETS);
+  int max_length = int_arg (argc, argv, MAX_LENGTH_ARG, MAX_TWEET_LEN);
+  if (client_count < 1 || requests < 1)
+  {
+    fprintf (stdout, "Usage: clients and requests must be positive\n");
+    return EXIT_FAILURE;
+  }
+  Client *clients = calloc ((size_t) client_count, sizeof (Client));
+  pthread_t *threads = calloc ((size_t) client_count, sizeof (pthread_t));
+  double *latencies = malloc ((size_t) client_count * (size_t) requests *
+                              sizeof (double));
+  if (!clients || !threads || !latencies)
+  {
+    fprintf (stdout, "Allocation failure: can't start the clients.\n");
+    free (clients);
+    free (threads);
+    free (latencies);
+    return EXIT_FAILURE;
+  }
+  double start = now_ns ();
+  int started = 0;
+  for (; started < client_count; started++)
+  {
+    clients[started] = (Client) {argv[SOCKET_ARG], started, requests,
+                                 tweets, max_length,
+                                 latencies + (size_t) started * requests,
+                                 0, 0};
+    if (pthread_create (&threads[started], NULL, run_client,
+                        &clients[started]) != 0)
+    {
+      break;
+    }
+  }
+  int completed = 0, errors = 0;
+  for (int i = 0; i < started; i++)
+  {
+    pthread_join (threads[i], NULL);
+    // pack every client's latencies at the front
+    memmove (latencies + completed, clients[i].latencies,
+             (size_t) clients[i].completed * sizeof (double));
+    completed += clients[i].completed;
+    errors += clients[i].errors;
+  }
+  double seconds = (now_ns () - start) / NS_IN_SEC;
+  int result = completed == client_count * requests ? EXIT_SUCCESS
+                                                    : EXIT_FAILURE;
+  if (completed > 0)
+  {
+    qsort (latencies, (size_t) completed, sizeof (double),
+           compare_doubles);
+    fprintf (stdout, "requests %d errors %d failed %d clients %d "
+                     "tweets/request %d\n", completed, errors,
+             client_count * requests - completed, started, tweets);
+    fprintf (stdout, "throughput %.0f requests/sec\n",
+             (double) completed / seconds);
+    fprintf (stdout, "latency_us p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+             percentile (latencies, completed, 50) / NS_IN_US,
+             percentile (latencies, completed, 90) / NS_IN_US,
+             percentile (latencies, completed, 99) / NS_IN_US,
+             latencies[completed - 1] / NS_IN_US);
+  }
+  else
+  {
+    fprintf (stdout, "Error: no request completed on %s\n",
+             argv[SOCKET_ARG]);
+  }
+  free (clients);
+  free (threads);
+  free (latencies);
+  return result;
+}
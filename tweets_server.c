@@ -0,0 +1,521 @@
+#include "tweets_server.h"
+#include <string.h> // For strlen(), memchr(), memmove()
+#include <errno.h> // For errno
+#include <signal.h> // For sigaction()
+#include <unistd.h> // For read(), close(), pipe()
+#include <fcntl.h> // For fcntl()
+#include <poll.h> // For poll()
+#include <pthread.h> // For the worker pool
+#include <sys/socket.h> // For socket(), accept(), setsockopt()
+#include <sys/un.h> // For sockaddr_un
+#include <sys/stat.h> // For lstat()
+#include <sys/time.h> // For timeval
+#include "output_buffer.h"
+#include "markov_stats.h"
+
+#define SERVE_BACKLOG 64
+// connections accepted but not yet taken by a worker
+#define SERVE_QUEUE_SIZE 256
+#define SERVE_HEADER_LEN 32
+#define DECIMAL 10
+
+/**
+ * Accepted connections waiting for a worker, and what every worker is
+ * serving, so a stopping server can cut them off.
+ */
+typedef struct ServeQueue {
+    int fds[SERVE_QUEUE_SIZE];
+    int head;
+    int count;
+    bool stopping;
+    // fd each worker is serving, -1 while it waits
+    int *serving;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} ServeQueue;
+
+typedef struct Worker {
+    const MarkovModel *model;
+    ServeQueue *queue;
+    int id;
+} Worker;
+
+// a byte is written to the pipe to stop the server, from request_stop
+// or by the server itself. it's never read, so it stays readable.
+static int stop_pipe[2] = {-1, -1};
+
+static void request_stop (int signal_number)
+{
+  (void) signal_number;
+  int saved_errno = errno;
+  // a full pipe is already readable, so the write may fail
+  ssize_t written = write (stop_pipe[1], "", 1);
+  (void) written;
+  errno = saved_errno;
+}
+
+/**
+ * Stop on SIGINT and SIGTERM, and ignore SIGPIPE so a client hanging up
+ * only fails its own write.
+ */
+static void set_signal_handlers (void)
+{
+  struct sigaction action;
+  memset (&action, 0, sizeof (action));
+  action.sa_handler = request_stop;
+  sigemptyset (&action.sa_mask);
+  sigaction (SIGINT, &action, NULL);
+  sigaction (SIGTERM, &action, NULL);
+  signal (SIGPIPE, SIG_IGN);
+}
+
+static bool write_all (int fd, const char *data, size_t len)
+{
+  OutputBuffer text = {(char *) data, len, len, false};
+  return output_flush_fd (&text, fd);
+}
+
+/**
+ * Parse one request line.
+ * @return true if it is a valid request, false otherwise (with reason
+ * set).
+ */
+static bool parse_request (const char *line, const MarkovModel *model,
+                           int *count, uint64_t *seed, int *max_length,
+                           const char **reason)
+{
+  char *end;
+  long count_arg = strtol (line, &end, DECIMAL);
+  const char *seed_start = end;
+  unsigned long long seed_arg = strtoull (seed_start, &end, DECIMAL);
+  bool has_seed = end != seed_start;
+  const char *length_start = end;
+  long length_arg = strtol (length_start, &end, DECIMAL);
+  if (end == length_start || !has_seed || *end != '\0')
+  {
+    *reason = "expected <tweet_count> <seed> <max_length>";
+    return false;
+  }
+  if (count_arg < 0 || count_arg > SERVE_MAX_TWEETS)
+  {
+    *reason = "tweet count out of range";
+    return false;
+  }
+  if (length_arg < (long) model->header->order ||
+      length_arg > MAX_TWEET_LEN)
+  {
+    *reason = "max length out of range";
+    return false;
+  }
+  *count = (int) count_arg;
+  *seed = (uint64_t) seed_arg;
+  *max_length = (int) length_arg;
+  return true;
+}
+
+/**
+ * Answer one request line on fd.
+ * @return false if the connection should be closed.
+ */
+static bool answer_request (const MarkovModel *model, const char *line,
+                            int fd, OutputBuffer *text)
+{
+  int count, max_length;
+  uint64_t seed;
+  const char *reason;
+  char header[SERVE_HEADER_LEN + SERVE_MAX_REQUEST_LEN];
+  if (!parse_request (line, model, &count, &seed, &max_length, &reason))
+  {
+    int len = snprintf (header, sizeof (header), "%s %s\n", SERVE_ERROR,
+                        reason);
+    return write_all (fd, header, (size_t) len);
+  }
+  STATS_CLOCK (render_start);
+  bool rendered = append_model_tweets (model, 0, count, seed, max_length,
+                                       text);
+  STATS_SINCE (STATS_GENERATE_NS, render_start);
+  if (!rendered)
+  {
+    text->len = 0;
+    text->failed = false;
+    int len = snprintf (header, sizeof (header), "%s %s\n", SERVE_ERROR,
+                        "out of memory");
+    return write_all (fd, header, (size_t) len);
+  }
+  int len = snprintf (header, sizeof (header), "%s %zu\n", SERVE_OK,
+                      text->len);
+  STATS_CLOCK (write_start);
+  bool written = write_all (fd, header, (size_t) len) &&
+                 output_flush_fd (text, fd);
+  STATS_SINCE (STATS_OUTPUT_NS, write_start);
+  return written;
+}
+
+/**
+ * Answer every request of a connection until it is closed, a request
+ * line is too long or a write fails.
+ */
+static void serve_connection (const MarkovModel *model, int fd,
+                              OutputBuffer *text)
+{
+  char request[SERVE_MAX_REQUEST_LEN + 1];
+  size_t len = 0;
+  while (true)
+  {
+    char *newline = memchr (request, '\n', len);
+    if (newline)
+    {
+      *newline = '\0';
+      if (newline > request && newline[-1] == '\r')
+      {
+        newline[-1] = '\0';
+      }
+      if (!answer_request (model, request, fd, text))
+      {
+        return;
+      }
+      len -= (size_t) (newline + 1 - request);
+      memmove (request, newline + 1, len);
+      continue;
+    }
+    if (len == SERVE_MAX_REQUEST_LEN)
+    {
+      static const char too_long[] = SERVE_ERROR " request too long\n";
+      write_all (fd, too_long, sizeof (too_long) - 1);
+      return;
+    }
+    ssize_t result = read (fd, request + len, SERVE_MAX_REQUEST_LEN - len);
+    if (result < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (result <= 0)
+    {
+      return;
+    }
+    len += (size_t) result;
+  }
+}
+
+/**
+ * @return the next connection to serve, -1 once the server stops.
+ */
+static int take_connection (Worker *worker)
+{
+  ServeQueue *queue = worker->queue;
+  pthread_mutex_lock (&queue->lock);
+  while (!queue->stopping && queue->count == 0)
+  {
+    pthread_cond_wait (&queue->not_empty, &queue->lock);
+  }
+  int fd = -1;
+  if (!queue->stopping)
+  {
+    fd = queue->fds[queue->head];
+    queue->head = (queue->head + 1) % SERVE_QUEUE_SIZE;
+    queue->count--;
+    queue->serving[worker->id] = fd;
+    pthread_cond_signal (&queue->not_full);
+  }
+  pthread_mutex_unlock (&queue->lock);
+  return fd;
+}
+
+static void *serve_worker (void *arg)
+{
+  Worker *worker = arg;
+  // reused for every request of this worker
+  OutputBuffer text = {0};
+  int fd;
+  while ((fd = take_connection (worker)) >= 0)
+  {
+    serve_connection (worker->model, fd, &text);
+    pthread_mutex_lock (&worker->queue->lock);
+    worker->queue->serving[worker->id] = -1;
+    pthread_mutex_unlock (&worker->queue->lock);
+    close (fd);
+  }
+  output_free (&text);
+  return NULL;
+}
+
+/**
+ * Queue an accepted connection, waiting while every slot is taken. The
+ * connection is closed if the server stops meanwhile.
+ */
+static void queue_connection (ServeQueue *queue, int fd)
+{
+  pthread_mutex_lock (&queue->lock);
+  while (queue->count == SERVE_QUEUE_SIZE && !queue->stopping)
+  {
+    pthread_cond_wait (&queue->not_full, &queue->lock);
+  }
+  if (queue->stopping)
+  {
+    pthread_mutex_unlock (&queue->lock);
+    close (fd);
+    return;
+  }
+  queue->fds[(queue->head + queue->count) % SERVE_QUEUE_SIZE] = fd;
+  queue->count++;
+  pthread_cond_signal (&queue->not_empty);
+  pthread_mutex_unlock (&queue->lock);
+}
+
+/**
+ * Wait for the stop pipe, then mark the queue stopping and wake everyone
+ * waiting on it, the accept loop included when the queue is full. A
+ * signal handler can't do that itself.
+ */
+static void *watch_stop (void *arg)
+{
+  ServeQueue *queue = arg;
+  struct pollfd stop = {.fd = stop_pipe[0], .events = POLLIN};
+  while (poll (&stop, 1, -1) < 0 && errno == EINTR)
+  {
+  }
+  pthread_mutex_lock (&queue->lock);
+  queue->stopping = true;
+  pthread_cond_broadcast (&queue->not_full);
+  pthread_cond_broadcast (&queue->not_empty);
+  pthread_mutex_unlock (&queue->lock);
+  return NULL;
+}
+
+/**
+ * Make the stop pipe, with a write end that never blocks the signal
+ * handler.
+ * @return false if it can't be made.
+ */
+static bool open_stop_pipe (void)
+{
+  if (pipe (stop_pipe) != 0)
+  {
+    return false;
+  }
+  if (fcntl (stop_pipe[1], F_SETFL, O_NONBLOCK) != 0)
+  {
+    close (stop_pipe[0]);
+    close (stop_pipe[1]);
+    stop_pipe[0] = stop_pipe[1] = -1;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Close the stop pipe, forgetting it first so a late signal writes
+ * nowhere.
+ */
+static void close_stop_pipe (void)
+{
+  int read_end = stop_pipe[0], write_end = stop_pipe[1];
+  stop_pipe[0] = stop_pipe[1] = -1;
+  close (read_end);
+  close (write_end);
+}
+
+/**
+ * Give an accepted connection blocking reads and writes that time out
+ * after SERVE_IDLE_TIMEOUT_SEC seconds, so an idle or stuck client only
+ * holds its worker that long.
+ * @return false if they can't be set.
+ */
+static bool set_connection_timeouts (int fd)
+{
+  struct timeval timeout = {.tv_sec = SERVE_IDLE_TIMEOUT_SEC};
+  int flags = fcntl (fd, F_GETFL);
+  return flags >= 0 && fcntl (fd, F_SETFL, flags & ~O_NONBLOCK) == 0 &&
+         setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                     sizeof (timeout)) == 0 &&
+         setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                     sizeof (timeout)) == 0;
+}
+
+/**
+ * Wake every worker and cut off the connections they are serving, then
+ * close the ones nobody took.
+ */
+static void stop_workers (ServeQueue *queue, int worker_count)
+{
+  pthread_mutex_lock (&queue->lock);
+  queue->stopping = true;
+  for (int i = 0; i < worker_count; i++)
+  {
+    if (queue->serving[i] >= 0)
+    {
+      shutdown (queue->serving[i], SHUT_RDWR);
+    }
+  }
+  for (; queue->count > 0; queue->count--)
+  {
+    close (queue->fds[queue->head]);
+    queue->head = (queue->head + 1) % SERVE_QUEUE_SIZE;
+  }
+  pthread_cond_broadcast (&queue->not_empty);
+  pthread_mutex_unlock (&queue->lock);
+}
+
+/**
+ * @return a non blocking socket listening on socket_path, -1 on failure.
+ * A socket left at the path by an earlier server is replaced, anything
+ * else there is left alone and fails.
+ */
+static int listen_on (const char *socket_path)
+{
+  struct sockaddr_un address;
+  memset (&address, 0, sizeof (address));
+  address.sun_family = AF_UNIX;
+  if (strlen (socket_path) >= sizeof (address.sun_path))
+  {
+    return -1;
+  }
+  strcpy (address.sun_path, socket_path);
+  struct stat path_stat;
+  if (lstat (socket_path, &path_stat) == 0)
+  {
+    if (!S_ISSOCK (path_stat.st_mode))
+    {
+      fprintf (stdout, "Error: %s exists and isn't a socket\n",
+               socket_path);
+      return -1;
+    }
+    unlink (socket_path);
+  }
+  int listen_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0)
+  {
+    return -1;
+  }
+  // accept() is only called once poll() finds a connection, and must not
+  // block if the client is gone by then
+  if (bind (listen_fd, (struct sockaddr *) &address, sizeof (address)) != 0 ||
+      listen (listen_fd, SERVE_BACKLOG) != 0 ||
+      fcntl (listen_fd, F_SETFL, O_NONBLOCK) != 0)
+  {
+    close (listen_fd);
+    return -1;
+  }
+  return listen_fd;
+}
+
+int serve_tweets (const MarkovModel *model, const char *socket_path,
+                  int worker_count)
+{
+  // the lock and conditions are initialized once the server can start
+  ServeQueue queue = {.stopping = false};
+  Worker *workers = calloc ((size_t) worker_count, sizeof (Worker));
+  pthread_t *threads = calloc ((size_t) worker_count, sizeof (pthread_t));
+  queue.serving = malloc ((size_t) worker_count * sizeof (int));
+  if (!workers || !threads || !queue.serving)
+  {
+    fprintf (stdout, "Allocation failure: can't start the server.\n");
+    free (workers);
+    free (threads);
+    free (queue.serving);
+    return EXIT_FAILURE;
+  }
+  if (!open_stop_pipe ())
+  {
+    fprintf (stdout, "Error: can't start the server\n");
+    free (workers);
+    free (threads);
+    free (queue.serving);
+    return EXIT_FAILURE;
+  }
+  int listen_fd = listen_on (socket_path);
+  if (listen_fd < 0)
+  {
+    fprintf (stdout, "Error: can't listen on %s\n", socket_path);
+    close_stop_pipe ();
+    free (workers);
+    free (threads);
+    free (queue.serving);
+    return EXIT_FAILURE;
+  }
+  set_signal_handlers ();
+  pthread_mutex_init (&queue.lock, NULL);
+  pthread_cond_init (&queue.not_empty, NULL);
+  pthread_cond_init (&queue.not_full, NULL);
+  pthread_t watcher;
+  bool watching = pthread_create (&watcher, NULL, watch_stop, &queue) == 0;
+  int started = 0;
+  for (; started < worker_count; started++)
+  {
+    workers[started] = (Worker) {model, &queue, started};
+    queue.serving[started] = -1;
+    if (pthread_create (&threads[started], NULL, serve_worker,
+                        &workers[started]) != 0)
+    {
+      break;
+    }
+  }
+  int result = watching && started == worker_count ? EXIT_SUCCESS
+                                                   : EXIT_FAILURE;
+  if (result == EXIT_SUCCESS)
+  {
+    fprintf (stdout, "Serving on %s with %d workers\n", socket_path,
+             worker_count);
+    fflush (stdout);
+  }
+  // waits for a connection or the stop pipe, whichever comes first
+  struct pollfd events[2] = {{.fd = listen_fd, .events = POLLIN},
+                             {.fd = stop_pipe[0], .events = POLLIN}};
+  while (result == EXIT_SUCCESS)
+  {
+    if (poll (events, 2, -1) < 0)
+    {
+      if (errno != EINTR)
+      {
+        fprintf (stdout, "Error: can't wait for connections on %s\n",
+                 socket_path);
+        result = EXIT_FAILURE;
+      }
+      continue;
+    }
+    if (events[1].revents != 0)
+    {
+      break;
+    }
+    int fd = accept (listen_fd, NULL, NULL);
+    if (fd >= 0)
+    {
+      if (set_connection_timeouts (fd))
+      {
+        queue_connection (&queue, fd);
+      }
+      else
+      {
+        close (fd);
+      }
+    }
+    else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+             errno != ECONNABORTED)
+    {
+      fprintf (stdout, "Error: accept failed on %s\n", socket_path);
+      result = EXIT_FAILURE;
+    }
+  }
+  if (watching)
+  {
+    // ends the watcher when the server stops on its own
+    request_stop (0);
+    pthread_join (watcher, NULL);
+  }
+  stop_workers (&queue, started);
+  for (int i = 0; i < started; i++)
+  {
+    pthread_join (threads[i], NULL);
+  }
+  close (listen_fd);
+  unlink (socket_path);
+  close_stop_pipe ();
+  pthread_cond_destroy (&queue.not_full);
+  pthread_cond_destroy (&queue.not_empty);
+  pthread_mutex_destroy (&queue.lock);
+  free (workers);
+  free (threads);
+  free (queue.serving);
+  return result;
+}
@@ -0,0 +1,36 @@
+#ifndef _TWEETS_SERVER_H_
+#define _TWEETS_SERVER_H_
+
+#include "markov_chain.h"
+
+/**
+ * Tweets are served over a Unix stream socket, one request per line:
+ *
+ *     <tweet_count> <seed> <max_length>\n
+ *
+ * answered with "OK <bytes>\n" and then exactly that many bytes of
+ * "Tweet <i>: ..." lines, the same ones the tweets generator prints for
+ * that seed, or with a single "ERR <reason>\n" line. A connection may
+ * send any number of requests, one after the other, and is closed once
+ * a read or write waits SERVE_IDLE_TIMEOUT_SEC seconds.
+ */
+#define SERVE_MAX_REQUEST_LEN 128
+#define SERVE_MAX_TWEETS 100000
+#define SERVE_OK "OK"
+#define SERVE_ERROR "ERR"
+#define SERVE_IDLE_TIMEOUT_SEC 5
+
+/**
+ * Answer requests on the given socket path until SIGINT or SIGTERM,
+ * with a fixed pool of worker threads, each serving one connection at a
+ * time. The socket file is replaced if it exists, and removed when done.
+ * @param model the model to generate from, with at least one start state
+ * @param socket_path
+ * @param worker_count number of worker threads, at least 1
+ * @return EXIT_SUCCESS once stopped by a signal, EXIT_FAILURE if the
+ * socket or a worker can't be set up (after printing why).
+ */
+int serve_tweets (const MarkovModel *model, const char *socket_path,
+                  int worker_count);
+
+#endif //_TWEETS_SERVER_H_
@@ -0,0 +1,519 @@
+#ifndef _TYPED_CHAIN_H_
+#define _TYPED_CHAIN_H_
+
+#include <stdint.h> // For uint32_t, uint64_t
+#include <string.h> // For memset()
+#include "markov_chain.h" // For MarkovRng
+#include "slab_pool.h"
+
+/**
+ * Type specialized markov chains. TYPED_CHAIN (Chain, prefix, Type, HASH,
+ * EQUAL, IS_LAST) defines a chain of states of the given Type, stored by
+ * value in one array and referred to by their 32 bit id (the order they
+ * were added in), with static inline functions prefix_add, prefix_count,
+ * prefix_build_samplers, prefix_first_random, prefix_next_random,
+ * prefix_walk and prefix_free. HASH (value), EQUAL (first, second) and
+ * IS_LAST (value) are expanded in place, so unlike MarkovChain, whose
+ * every lookup and step goes through function pointers on void*, the
+ * compiler sees and inlines them.
+ *
+ * A chain counts and draws successors exactly like MarkovChain does, so
+ * for the same states and counts it walks the same paths for a given
+ * MarkovRng stream (or default stream seed). Only the generic chain can
+ * be merged, saved or frozen.
+ */
+
+#define TYPED_NO_STATE UINT32_MAX
+#define TYPED_INIT_CAPACITY 16
+
+typedef struct TypedSuccessor {
+    uint32_t state;
+    uint64_t count;
+} TypedSuccessor;
+
+typedef struct TypedSlot {
+    // id + 1 of the state in this slot, 0 marks an empty slot
+    uint32_t id_plus_one;
+    uint32_t hash;
+} TypedSlot;
+
+typedef struct TypedEdgeSlot {
+    // (state << 32) | successor of a taken slot
+    uint64_t key;
+    // position + 1 of the successor in the state's list, 0 marks an
+    // empty slot
+    uint32_t position_plus_one;
+} TypedEdgeSlot;
+
+/**
+ * Hash index of every (state, successor) pair of a chain, so counting a
+ * successor is one probe whatever the length of the state's list.
+ * A zeroed index is valid and gets built on first use.
+ */
+typedef struct TypedEdgeIndex {
+    TypedEdgeSlot *slots;
+    // always a power of 2 (or 0 before the first edge)
+    size_t capacity;
+    size_t count;
+} TypedEdgeIndex;
+
+/** The splitmix64 finalizer, spreads dense keys over the slots. */
+static inline uint64_t typed_mix (uint64_t z)
+{
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+/**
+ * @return the slot of the given edge if it's in the index, otherwise the
+ * empty slot it goes into.
+ */
+static inline TypedEdgeSlot *typed_edge_slot (const TypedEdgeIndex *index,
+                                              uint64_t key)
+{
+  size_t mask = index->capacity - 1;
+  for (size_t i = typed_mix (key) & mask;; i = (i + 1) & mask)
+  {
+    TypedEdgeSlot *slot = &index->slots[i];
+    if (slot->position_plus_one == 0 || slot->key == key)
+    {
+      return slot;
+    }
+  }
+}
+
+/**
+ * Make room for one more edge, keeping the index at most half full.
+ * @return false in case of allocation error.
+ */
+static inline bool typed_edge_reserve (TypedEdgeIndex *index)
+{
+  if ((index->count + 1) * 2 <= index->capacity)
+  {
+    return true;
+  }
+  size_t capacity = index->capacity ? index->capacity * 2
+                                    : TYPED_INIT_CAPACITY;
+  TypedEdgeIndex grown = {calloc (capacity, sizeof (TypedEdgeSlot)),
+                          capacity, index->count};
+  if (!grown.slots)
+  {
+    return false;
+  }
+  for (size_t i = 0; i < index->capacity; i++)
+  {
+    if (index->slots[i].position_plus_one)
+    {
+      *typed_edge_slot (&grown, index->slots[i].key) = index->slots[i];
+    }
+  }
+  free (index->slots);
+  *index = grown;
+  return true;
+}
+
+/**
+ * @return a random number in [0, bound), from rng or, when rng is NULL,
+ * from the thread's default stream.
+ */
+static inline uint64_t typed_draw (MarkovRng *rng, uint64_t bound)
+{
+  return markov_rng_bounded64 (rng ? rng : markov_rng_default (), bound);
+}
+
+/** qsort comparator of state ids. */
+static inline int typed_compare_ids (const void *first, const void *second)
+{
+  uint32_t first_id = *(const uint32_t *) first;
+  uint32_t second_id = *(const uint32_t *) second;
+  return (first_id > second_id) - (first_id < second_id);
+}
+
+/**
+ * @return the first of size running sums that passes rand_ind.
+ */
+static inline uint32_t typed_search_cumulative (const uint64_t *cumulative,
+                                                uint32_t size,
+                                                uint64_t rand_ind)
+{
+  uint32_t low = 0, high = size - 1;
+  while (low < high)
+  {
+    uint32_t mid = low + (high - low) / 2;
+    if (cumulative[mid] > rand_ind)
+    {
+      high = mid;
+    }
+    else
+    {
+      low = mid + 1;
+    }
+  }
+  return low;
+}
+
+#define TYPED_CHAIN(Chain, prefix, Type, HASH, EQUAL, IS_LAST)              \
+                                                                            \
+typedef struct Chain##State {                                               \
+    Type value;                                                             \
+    TypedSuccessor *successors;                                             \
+    /* running sum of the successors' counts, NULL until built */           \
+    uint64_t *cumulative;                                                   \
+    uint32_t successor_count;                                               \
+    uint32_t successor_capacity;                                            \
+    /* IS_LAST of the value, checked once when it's added */                \
+    bool last;                                                              \
+    /* false while queued in the chain's dirty list */                      \
+    bool sampler_valid;                                                     \
+    /* in the chain's starts */                                             \
+    bool start;                                                             \
+} Chain##State;                                                             \
+                                                                            \
+/* A zeroed chain is a valid empty chain. */                                \
+typedef struct Chain {                                                      \
+    /* every state, by id */                                                \
+    Chain##State *states;                                                   \
+    uint32_t count;                                                         \
+    uint32_t capacity;                                                      \
+    /* open addressing index of the states by HASH, at most half full */    \
+    TypedSlot *slots;                                                       \
+    size_t slots_capacity;                                                  \
+    TypedEdgeIndex edges;                                                   \
+    /* states a walk may start from (not last, with successors), by id, */  \
+    /* built by build_samplers */                                           \
+    uint32_t *starts;                                                       \
+    uint32_t start_count;                                                   \
+    /* ids of the states counted since the last build_samplers */           \
+    uint32_t *dirty;                                                        \
+    uint32_t dirty_count;                                                   \
+    uint32_t dirty_capacity;                                                \
+    /* the successor lists and samplers, created with the first state */    \
+    SlabPool *pool;                                                         \
+} Chain;                                                                    \
+                                                                            \
+static inline TypedSlot *prefix##_slot (const Chain *chain, Type value,     \
+                                        uint32_t hash)                      \
+{                                                                           \
+  size_t mask = chain->slots_capacity - 1;                                  \
+  for (size_t i = hash & mask;; i = (i + 1) & mask)                         \
+  {                                                                         \
+    TypedSlot *slot = &chain->slots[i];                                     \
+    if (slot->id_plus_one == 0 ||                                           \
+        (slot->hash == hash &&                                              \
+         EQUAL (chain->states[slot->id_plus_one - 1].value, value)))        \
+    {                                                                       \
+      return slot;                                                          \
+    }                                                                       \
+  }                                                                         \
+}                                                                           \
+                                                                            \
+/**                                                                         \
+ * @return the id of the state with the given value, TYPED_NO_STATE if     \
+ * there's none.                                                            \
+ */                                                                         \
+static inline uint32_t prefix##_find (const Chain *chain, Type value)      \
+{                                                                           \
+  if (chain->count == 0)                                                    \
+  {                                                                         \
+    return TYPED_NO_STATE;                                                  \
+  }                                                                         \
+  return prefix##_slot (chain, value,                                       \
+                        (uint32_t) typed_mix (HASH (value)))                \
+             ->id_plus_one - 1;                                             \
+}                                                                           \
+                                                                            \
+/**                                                                         \
+ * Make room for one more state.                                            \
+ * @return false in case of allocation error.                               \
+ */                                                                         \
+static inline bool prefix##_reserve (Chain *chain)                          \
+{                                                                           \
+  if (!chain->pool && !(chain->pool = pool_create ()))                      \
+  {                                                                         \
+    return false;                                                           \
+  }                                                                         \
+  if (chain->count == chain->capacity)                                      \
+  {                                                                         \
+    uint32_t capacity = chain->capacity ? chain->capacity * 2               \
+                                        : TYPED_INIT_CAPACITY;              \
+    Chain##State *states = realloc (chain->states,                          \
+                                    capacity * sizeof (Chain##State));      \
+    if (!states)                                                            \
+    {                                                                       \
+      return false;                                                         \
+    }                                                                       \
+    chain->states = states;                                                 \
+    chain->capacity = capacity;                                             \
+  }                                                                         \
+  if ((chain->count + 1) * 2 > chain->slots_capacity)                       \
+  {                                                                         \
+    size_t capacity = chain->slots_capacity ? chain->slots_capacity * 2     \
+                                            : TYPED_INIT_CAPACITY;          \
+    TypedSlot *slots = calloc (capacity, sizeof (TypedSlot));               \
+    if (!slots)                                                             \
+    {                                                                       \
+      return false;                                                         \
+    }                                                                       \
+    for (size_t i = 0; i < chain->slots_capacity; i++)                      \
+    {                                                                       \
+      TypedSlot slot = chain->slots[i];                                     \
+      size_t j = slot.hash & (capacity - 1);                                \
+      while (slot.id_plus_one && slots[j].id_plus_one)                      \
+      {                                                                     \
+        j = (j + 1) & (capacity - 1);                                       \
+      }                                                                     \
+      if (slot.id_plus_one)                                                 \
+      {                                                                     \
+        slots[j] = slot;                                                    \
+      }                                                                     \
+    }                                                                       \
+    free (chain->slots);                                                    \
+    chain->slots = slots;                                                   \
+    chain->slots_capacity = capacity;                                       \
+  }                                                                         \
+  return true;                                                              \
+}                                                                           \
+                                                                            \
+/**                                                                         \
+ * If a state with the given value is in the chain, return its id.         \
+ * Otherwise add the value (copied by value) as a new state.                \
+ * @return the id of the state, TYPED_NO_STATE in case of allocation        \
+ * error.                                                                   \
+ */                                                                         \
+static inline uint32_t prefix##_add (Chain *chain, Type value)              \
+{                                                                           \
+  if (!prefix##_reserve (chain))                                            \
+  {                                                                         \
+    return TYPED_NO_STATE;                                                  \
+  }                                                                         \
+  uint32_t hash = (uint32_t) typed_mix (HASH (value));                      \
+  TypedSlot *slot = prefix##_slot (chain, value, hash);                     \
+  if (slot->id_plus_one)                                                    \
+  {                                                                         \
+    return slot->id_plus_one - 1;                                           \
+  }                                                                         \
+  uint32_t id = chain->count++;                                             \
+  chain->states[id] = (Chain##State) {value, NULL, NULL, 0, 0,              \
+                                      IS_LAST (value), true, false};        \
+  *slot = (TypedSlot) {id + 1, hash};                                       \
+  return id;                                                                \
+}                                                                           \
+                                                                            \
+/**                                                                         \
+ * Queue the state's sampler to be rebuilt by build_samplers.               \
+ * @return false in case of allocation error.                               \
+ */                                                                         \
+static inline bool prefix##_invalidate (Chain *chain, uint32_t id)          \
+{                                                                           \
+  if (!chain->states[id].sampler_valid)                                     \
+  {                                                                         \
+    return true;                                                            \
+  }                                                                         \
+  if (chain->dirty_count == chain->dirty_capacity)                          \
+  {                                                                         \
+    uint32_t capacity = chain->dirty_capacity ? chain->dirty_capacity * 2   \
+                                              : TYPED_INIT_CAPACITY;        \
+    uint32_t *dirty = realloc (chain->dirty, capacity * sizeof (uint32_t)); \
+    if (!dirty)                                                             \
+    {                                                                       \
+      return false;                                                         \
+    }                                                                       \
+    chain->dirty = dirty;                                                   \
+    chain->dirty_capacity = capacity;                                       \
+  }                                                                         \
+  chain->dirty[chain->dirty_count++] = id;                                  \
+  chain->states[id].sampler_valid = false;                                  \
+  return true;                                                              \
+}                                                                           \
+                                                                            \
+/**                                                                         \
+ * Count one more occurrence of to following from, adding it to the end    \
+ * of from's successors the first time.                                     \
+ * @return false in case of allocation error.                               \
+ */                                                                         \
+static inline bool prefix##_count (Chain *chain, uint32_t from, uint32_t to)\
+{                                                                           \
+  if (!typed_edge_reserve (&chain->edges) ||                                \
+      !prefix##_invalidate (chain, from))                                   \
+  {                                                                         \
+    return false;                                                           \
+  }                                                                         \
+  Chain##State *state = &chain->states[from];                               \
+  uint64_t key = ((uint64_t) from << 32) | to;                              \
+  TypedEdgeSlot *edge = typed_edge_slot (&chain->edges, key);               \
+  if (edge->position_plus_one)                                              \
+  {                                                                         \
+    state->successors[edge->position_plus_one - 1].count++;                 \
+    return true;                                                            \
+  }                                                                         \
+  if (state->successor_count == state->successor_capacity)                  \
+  {                                                                         \
+    size_t size = (state->successor_count + 1) * sizeof (TypedSuccessor);   \
+    TypedSuccessor *successors = pool_alloc_array (chain->pool, size);      \
+    if (!successors)                                                        \
+    {                                                                       \
+      return false;                                                         \
+    }                                                                       \
+    if (state->successor_count > 0)                                         \
+    {                                                                       \
+      memcpy (successors, state->successors,                                \
+              state->successor_count * sizeof (TypedSuccessor));            \
+    }                                                                       \
+    pool_release_array (chain->pool, state->successors,                     \
+                        state->successor_capacity *                         \
+                        sizeof (TypedSuccessor));                           \
+    pool_release_array (chain->pool, state->cumulative,                     \
+                        state->successor_capacity * sizeof (uint64_t));     \
+    state->successors = successors;                                         \
+    state->cumulative = NULL;                                               \
+    state->successor_capacity = (uint32_t) (pool_array_size (size) /        \
+                                            sizeof (TypedSuccessor));       \
+  }                                                                         \
+  state->successors[state->successor_count++] = (TypedSuccessor) {to, 1};   \
+  *edge = (TypedEdgeSlot) {key, state->successor_count};                    \
+  chain->edges.count++;                                                     \
+  return true;                                                              \
+}                                                                           \
+                                                                            \
+/**                                                                         \
+ * Rebuild the sampler of every state counted since the last call, and add  \
+ * the states that got their first successor to the start states (kept in   \
+ * id order). Only the queued states are visited. Call after counting and   \
+ * before drawing.                                                          \
+ * @return false in case of allocation error, the chain is left as it was.  \
+ */                                                                         \
+static inline bool prefix##_build_samplers (Chain *chain)                   \
+{                                                                           \
+  uint32_t new_starts = 0;                                                  \
+  for (uint32_t i = 0; i < chain->dirty_count; i++)                         \
+  {                                                                         \
+    Chain##State *state = &chain->states[chain->dirty[i]];                  \
+    if (!state->cumulative &&                                               \
+        !(state->cumulative = pool_alloc_array                              \
+            (chain->pool, state->successor_capacity * sizeof (uint64_t))))  \
+    {                                                                       \
+      return false;                                                         \
+    }                                                                       \
+    uint64_t total = 0;                                                     \
+    for (uint32_t j = 0; j < state->successor_count; j++)                   \
+    {                                                                       \
+      total += state->successors[j].count;                                  \
+      state->cumulative[j] = total;                                         \
+    }                                                                       \
+    new_starts += !state->last && !state->start;                            \
+  }                                                                         \
+  if (new_starts > 0)                                                       \
+  {                                                                         \
+    uint32_t *starts = realloc (chain->starts,                              \
+                                (chain->start_count + new_starts) *         \
+                                sizeof (uint32_t));                         \
+    if (!starts)                                                            \
+    {                                                                       \
+      return false;                                                         \
+    }                                                                       \
+    chain->starts = starts;                                                 \
+  }                                                                         \
+  /* keep only the new start states in the dirty list, then merge them */   \
+  /* into the starts from the back */                                       \
+  new_starts = 0;                                                           \
+  for (uint32_t i = 0; i < chain->dirty_count; i++)                         \
+  {                                                                         \
+    uint32_t id = chain->dirty[i];                                          \
+    Chain##State *state = &chain->states[id];                               \
+    state->sampler_valid = true;                                            \
+    if (!state->last && !state->start)                                      \
+    {                                                                       \
+      state->start = true;                                                  \
+      chain->dirty[new_starts++] = id;                                      \
+    }                                                                       \
+  }                                                                         \
+  chain->dirty_count = 0;                                                   \
+  qsort (chain->dirty, new_starts, sizeof (uint32_t), typed_compare_ids);   \
+  uint32_t old = chain->start_count;                                        \
+  chain->start_count += new_starts;                                         \
+  for (uint32_t k = chain->start_count; new_starts > 0; k--)                \
+  {                                                                         \
+    if (old > 0 && chain->starts[old - 1] > chain->dirty[new_starts - 1])   \
+    {                                                                       \
+      chain->starts[k - 1] = chain->starts[--old];                          \
+    }                                                                       \
+    else                                                                    \
+    {                                                                       \
+      chain->starts[k - 1] = chain->dirty[--new_starts];                    \
+    }                                                                       \
+  }                                                                         \
+  return true;                                                              \
+}                                                                           \
+                                                                            \
+                                                                            \
+/**                                                                         \
+ * @return a uniformly drawn start state, TYPED_NO_STATE if there's none.   \
+ */                                                                         \
+static inline uint32_t prefix##_first_random (const Chain *chain,           \
+                                              MarkovRng *rng)               \
+{                                                                           \
+  if (chain->start_count == 0)                                              \
+  {                                                                         \
+    return TYPED_NO_STATE;                                                  \
+  }                                                                         \
+  return chain->starts[typed_draw (rng, chain->start_count)];               \
+}                                                                           \
+                                                                            \
+/**                                                                         \
+ * @return a successor of the state drawn by its count, TYPED_NO_STATE if   \
+ * it has none.                                                             \
+ */                                                                         \
+static inline uint32_t prefix##_next_random (const Chain *chain,            \
+                                             uint32_t id, MarkovRng *rng)   \
+{                                                                           \
+  const Chain##State *state = &chain->states[id];                           \
+  uint32_t size = state->successor_count;                                   \
+  if (size == 0)                                                            \
+  {                                                                         \
+    return TYPED_NO_STATE;                                                  \
+  }                                                                         \
+  uint64_t rand_ind = typed_draw (rng, state->cumulative[size - 1]);        \
+  return state->successors[typed_search_cumulative (state->cumulative,      \
+                                                    size, rand_ind)].state; \
+}                                                                           \
+                                                                            \
+/**                                                                         \
+ * Walk the chain from first until a last state, a state without            \
+ * successors or max_length states.                                         \
+ * @param walk filled with the ids of the states of the walk                \
+ * @return the number of states in walk.                                    \
+ */                                                                         \
+static inline int prefix##_walk (const Chain *chain, uint32_t first,        \
+                                 MarkovRng *rng, uint32_t *walk,            \
+                                 int max_length)                            \
+{                                                                           \
+  int len = 0;                                                              \
+  uint32_t id = first;                                                      \
+  while (id != TYPED_NO_STATE && len < max_length)                          \
+  {                                                                         \
+    walk[len++] = id;                                                       \
+    if (chain->states[id].last || len == max_length)                        \
+    {                                                                       \
+      break;                                                                \
+    }                                                                       \
+    id = prefix##_next_random (chain, id, rng);                             \
+  }                                                                         \
+  return len;                                                               \
+}                                                                           \
+                                                                            \
+/**                                                                         \
+ * Free everything the chain holds and leave it empty.                      \
+ */                                                                         \
+static inline void prefix##_free (Chain *chain)                             \
+{                                                                           \
+  free (chain->states);                                                     \
+  free (chain->slots);                                                      \
+  free (chain->edges.slots);                                                \
+  free (chain->starts);                                                     \
+  free (chain->dirty);                                                      \
+  pool_free (&chain->pool);                                                 \
+  memset (chain, 0, sizeof (Chain));                                        \
+}
+
+#endif //_TYPED_CHAIN_H_
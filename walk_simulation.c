@@ -0,0 +1,291 @@
+#include "walk_simulation.h"
+#include <string.h> // For memset()
+#include <pthread.h> // For the simulation threads
+
+WalkTable *walk_table_create (const MarkovModel *model)
+{
+  uint32_t size = model->header->num_states;
+  WalkTable *table = calloc (1, sizeof (WalkTable));
+  if (!table)
+  {
+    return NULL;
+  }
+  table->size = size;
+  // +1 so empty models still get valid allocations
+  table->slot_offsets = malloc ((size + 1) * sizeof (uint32_t));
+  table->stops = malloc (size + 1);
+  if (!table->slot_offsets || !table->stops)
+  {
+    walk_table_free (&table);
+    return NULL;
+  }
+  uint64_t slot_count = 0;
+  for (uint32_t state = 0; state < size; state++)
+  {
+    uint32_t begin = model->succ_offsets[state];
+    uint32_t end = model->succ_offsets[state + 1];
+    uint64_t total = 0;
+    for (uint32_t edge = begin; edge < end; edge++)
+    {
+      total += model_edge_count (model, state, edge);
+    }
+    if (total > WALK_MAX_STATE_TOTAL || slot_count + total > UINT32_MAX)
+    {
+      walk_table_free (&table);
+      return NULL;
+    }
+    table->slot_offsets[state] = (uint32_t) slot_count;
+    table->stops[state] = begin == end ||
+                          (model->state_flags[state] & MODEL_STATE_LAST);
+    slot_count += total;
+  }
+  table->slot_offsets[size] = (uint32_t) slot_count;
+  table->slots = malloc ((slot_count + 1) * sizeof (uint32_t));
+  if (!table->slots)
+  {
+    walk_table_free (&table);
+    return NULL;
+  }
+  for (uint32_t state = 0; state < size; state++)
+  {
+    uint32_t slot = table->slot_offsets[state];
+    for (uint32_t edge = model->succ_offsets[state];
+         edge < model->succ_offsets[state + 1]; edge++)
+    {
+      for (uint32_t i = model_edge_count (model, state, edge); i > 0; i--)
+      {
+        table->slots[slot++] = model->succ_targets[edge];
+      }
+    }
+  }
+  return table;
+}
+
+void walk_table_free (WalkTable **ptr_table)
+{
+  if (!*ptr_table)
+  {
+    return;
+  }
+  free ((*ptr_table)->slot_offsets);
+  free ((*ptr_table)->slots);
+  free ((*ptr_table)->stops);
+  free (*ptr_table);
+  *ptr_table = NULL;
+}
+
+void walk_stats_free (WalkStats *stats)
+{
+  free (stats->length_counts);
+  free (stats->visits);
+  stats->length_counts = NULL;
+  stats->visits = NULL;
+}
+
+static bool walk_stats_init (WalkStats *stats, uint32_t size, int max_moves)
+{
+  memset (stats, 0, sizeof (WalkStats));
+  stats->max_moves = max_moves;
+  stats->size = size;
+  stats->length_counts = calloc ((size_t) max_moves + 1, sizeof (uint64_t));
+  stats->visits = calloc ((size_t) size + 1, sizeof (uint64_t));
+  if (!stats->length_counts || !stats->visits)
+  {
+    walk_stats_free (stats);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * The walks of one block, advanced together: lane k is on state
+ * positions[k] after moves[k] moves. Only the first active lanes are
+ * still walking. Each move, every active lane's number of slots goes to
+ * bounds[k] and its draw from the block's stream to draws[k].
+ */
+typedef struct WalkLanes {
+    uint32_t positions[WALK_LANES];
+    uint32_t moves[WALK_LANES];
+    uint32_t bounds[WALK_LANES];
+    uint32_t draws[WALK_LANES];
+    MarkovRngBatch rng;
+    uint32_t active;
+} WalkLanes;
+
+/**
+ * Count the lanes that stopped or ran out of moves into stats, and move
+ * the last active lane into each one's place.
+ */
+static void retire_lanes (WalkLanes *lanes, const WalkTable *table,
+                          int max_moves, WalkStats *stats)
+{
+  uint32_t k = 0;
+  while (k < lanes->active)
+  {
+    bool stopped = table->stops[lanes->positions[k]];
+    if (!stopped && lanes->moves[k] < (uint32_t) max_moves)
+    {
+      k++;
+      continue;
+    }
+    if (stopped)
+    {
+      stats->finished++;
+      stats->length_counts[lanes->moves[k]]++;
+    }
+    stats->moves += lanes->moves[k];
+    uint32_t last = --lanes->active;
+    lanes->positions[k] = lanes->positions[last];
+    lanes->moves[k] = lanes->moves[last];
+  }
+}
+
+/**
+ * Run the count walks of a block from the start state in lockstep, all
+ * drawing from the block's batch stream of the seed.
+ */
+static void run_block (const WalkTable *table, uint32_t start,
+                       uint64_t block, uint32_t count, int max_moves,
+                       uint64_t seed, WalkLanes *lanes, WalkStats *stats)
+{
+  const uint32_t *slot_offsets = table->slot_offsets;
+  const uint32_t *slots = table->slots;
+  uint64_t *visits = stats->visits;
+  for (uint32_t k = 0; k < count; k++)
+  {
+    lanes->positions[k] = start;
+    lanes->moves[k] = 0;
+  }
+  markov_rng_batch_seed (&lanes->rng, seed, block);
+  visits[start] += count;
+  stats->walks += count;
+  lanes->active = count;
+  retire_lanes (lanes, table, max_moves, stats);
+  while (lanes->active > 0)
+  {
+    // one move of every active walk: its slots, a draw among them and
+    // the slot's successor
+    uint32_t active = lanes->active;
+    for (uint32_t k = 0; k < active; k++)
+    {
+      uint32_t position = lanes->positions[k];
+      lanes->bounds[k] = slot_offsets[position + 1] - slot_offsets[position];
+    }
+    markov_rng_batch_bounded (&lanes->rng, lanes->bounds, lanes->draws,
+                              active);
+    for (uint32_t k = 0; k < active; k++)
+    {
+      uint32_t position = slots[slot_offsets[lanes->positions[k]] +
+                                lanes->draws[k]];
+      lanes->positions[k] = position;
+      lanes->moves[k]++;
+      visits[position]++;
+    }
+    retire_lanes (lanes, table, max_moves, stats);
+  }
+}
+
+typedef struct WalkWorker {
+    const WalkTable *table;
+    uint32_t start;
+    uint64_t walk_count;
+    int max_moves;
+    uint64_t seed;
+    // the worker runs blocks index, index + stride, ...
+    uint64_t index;
+    uint64_t stride;
+    WalkStats stats;
+    bool success;
+} WalkWorker;
+
+static void *walk_worker (void *arg)
+{
+  WalkWorker *worker = arg;
+  WalkLanes *lanes = malloc (sizeof (WalkLanes));
+  worker->success = lanes && walk_stats_init
+      (&worker->stats, worker->table->size, worker->max_moves);
+  for (uint64_t block = worker->index; worker->success &&
+       block * WALK_LANES < worker->walk_count; block += worker->stride)
+  {
+    uint64_t left = worker->walk_count - block * WALK_LANES;
+    run_block (worker->table, worker->start, block,
+               left < WALK_LANES ? (uint32_t) left : WALK_LANES,
+               worker->max_moves, worker->seed, lanes, &worker->stats);
+  }
+  free (lanes);
+  return NULL;
+}
+
+/**
+ * Add the statistics of a worker to the total.
+ */
+static void merge_stats (WalkStats *total, const WalkStats *part)
+{
+  total->walks += part->walks;
+  total->finished += part->finished;
+  total->moves += part->moves;
+  for (int i = 0; i <= total->max_moves; i++)
+  {
+    total->length_counts[i] += part->length_counts[i];
+  }
+  for (uint32_t state = 0; state < total->size; state++)
+  {
+    total->visits[state] += part->visits[state];
+  }
+}
+
+bool simulate_walks (const WalkTable *table, uint32_t start,
+                     uint64_t walk_count, int max_moves, uint64_t seed,
+                     int thread_count, WalkStats *stats)
+{
+  if (start >= table->size || max_moves < 1 || thread_count < 1 ||
+      !walk_stats_init (stats, table->size, max_moves))
+  {
+    return false;
+  }
+  WalkWorker *workers = calloc ((size_t) thread_count, sizeof (WalkWorker));
+  pthread_t *threads = calloc ((size_t) thread_count, sizeof (pthread_t));
+  bool success = workers && threads;
+  int started = 0;
+  for (; success && started < thread_count; started++)
+  {
+    workers[started] = (WalkWorker) {.table = table, .start = start,
+                                     .walk_count = walk_count,
+                                     .max_moves = max_moves, .seed = seed,
+                                     .index = (uint64_t) started,
+                                     .stride = (uint64_t) thread_count};
+    if (pthread_create (&threads[started], NULL, &walk_worker,
+                        &workers[started]) != 0)
+    {
+      success = false;
+      break;
+    }
+  }
+  for (int i = 0; i < started; i++)
+  {
+    pthread_join (threads[i], NULL);
+    success = success && workers[i].success;
+    if (success)
+    {
+      merge_stats (stats, &workers[i].stats);
+    }
+    walk_stats_free (&workers[i].stats);
+  }
+  free (workers);
+  free (threads);
+  if (!success)
+  {
+    walk_stats_free (stats);
+  }
+  return success;
+}
+
+double walks_finished_within (const WalkStats *stats, int moves)
+{
+  uint64_t finished = 0;
+  for (int i = 0; i <= moves && i <= stats->max_moves; i++)
+  {
+    finished += stats->length_counts[i];
+  }
+  return stats->walks ? (double) finished / (double) stats->walks : 0;
+}
@@ -0,0 +1,91 @@
+#ifndef _WALK_SIMULATION_H_
+#define _WALK_SIMULATION_H_
+
+#include "markov_chain.h"
+
+// walks run in lockstep in blocks of this many, one block per thread at
+// a time
+#define WALK_LANES 1024
+// a state counted more times than this has too many slots to draw from
+#define WALK_MAX_STATE_TOTAL 4096
+
+/**
+ * The moves of a frozen or loaded model laid out for drawing in O(1):
+ * every state gets one slot per count of its successors, so a draw in
+ * [0, total) picks its successor directly. Meant for models whose
+ * states were counted few times, like the game board.
+ */
+typedef struct WalkTable {
+    uint32_t size;
+    // uint32_t[size + 1]: where each state's slots start, its total count
+    // is the length of its slots
+    uint32_t *slot_offsets;
+    // uint32_t[slot_offsets[size]]: the successor of each slot
+    uint32_t *slots;
+    // uint8_t[size]: 1 for the states walks stop at (last, or without
+    // successors)
+    uint8_t *stops;
+} WalkTable;
+
+/**
+ * What simulate_walks saw over all its walks.
+ */
+typedef struct WalkStats {
+    uint64_t walks;
+    // walks that reached a stopping state within max_moves
+    uint64_t finished;
+    // moves made by all the walks, finished or not
+    uint64_t moves;
+    int max_moves;
+    // uint64_t[max_moves + 1]: the number of finished walks of each length
+    uint64_t *length_counts;
+    uint32_t size;
+    // uint64_t[size]: how many times walks were on each state, the start
+    // included
+    uint64_t *visits;
+} WalkStats;
+
+/**
+ * Build the walk table of a model.
+ * @param model
+ * @return the table, NULL if a state was counted more than
+ * WALK_MAX_STATE_TOTAL times or in case of allocation error.
+ */
+WalkTable *walk_table_create (const MarkovModel *model);
+
+/**
+ * Free the table and set it to NULL. Does nothing on NULL.
+ */
+void walk_table_free (WalkTable **ptr_table);
+
+/**
+ * Run walk_count random walks from the start state, each until it stops
+ * or makes max_moves moves, and gather their statistics. Walks advance
+ * WALK_LANES at a time in lockstep, on thread_count threads. Block b of
+ * walks draws from batch stream b of the seed (see markov_rng_batch_seed),
+ * so the statistics are the same for any thread count.
+ * @param table
+ * @param start
+ * @param walk_count
+ * @param max_moves at least 1
+ * @param seed
+ * @param thread_count at least 1
+ * @param stats filled with the statistics, freed with walk_stats_free
+ * @return true on success, false in case of allocation or thread error.
+ */
+bool simulate_walks (const WalkTable *table, uint32_t start,
+                     uint64_t walk_count, int max_moves, uint64_t seed,
+                     int thread_count, WalkStats *stats);
+
+/**
+ * @return the share of all the walks that finished within the given
+ * number of moves.
+ */
+double walks_finished_within (const WalkStats *stats, int moves);
+
+/**
+ * Free the arrays of the statistics.
+ */
+void walk_stats_free (WalkStats *stats);
+
+#endif //_WALK_SIMULATION_H_